@@ -0,0 +1,335 @@
+// Viktor Fransson DVAMI22h
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "mem_bitmap.h"
+#include "mem_lock.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define MEM_BITMAP_X86 1
+#endif
+
+#define MEM_BITMAP_WORD_BITS 64
+#define MEM_BITMAP_FULL (~(uint64_t)0)
+
+
+typedef size_t (*skip_kernel_t)(const uint64_t* words, size_t from, size_t count);
+
+/*
+ * Two bits per granule: `used` is set for every granule of an allocated block and `ends` for
+ * its last granule, so a free finds the length of its block without looking at its neighbours.
+ * Allocations search `used` under `bitmap_lock`. Frees clear their own bits with atomic
+ * and-not and take no lock, clearing the end bit before the used bits so an allocation
+ * reusing the granules never has its end bit cleared by the late free.
+ */
+static char* arena = NULL;
+static size_t arena_size = 0;
+static uint64_t* used = NULL;
+static uint64_t* ends = NULL;
+static size_t word_count = 0;
+static size_t first_free_word = 0; // No word below this has a free granule
+
+static struct mem_lock bitmap_lock = MEM_LOCK_INITIALIZER;
+static skip_kernel_t skip_full = NULL;
+
+
+/**
+ * Returns the mask of bits [from, to) of a word.
+ */
+static inline uint64_t bit_range(unsigned int from, unsigned int to){
+    uint64_t bits = (to - from == MEM_BITMAP_WORD_BITS) ? MEM_BITMAP_FULL : (((uint64_t)1 << (to - from)) - 1);
+    return bits << from;
+}
+
+
+/**
+ * Returns the index of the first word at or after `from` that is not all ones, or `count` if there is none.
+ */
+static size_t skip_full_plain(const uint64_t* words, size_t from, size_t count){
+    while (from < count && __atomic_load_n(&words[from], __ATOMIC_RELAXED) == MEM_BITMAP_FULL){
+        from++;
+    }
+    return from;
+}
+
+
+#ifdef MEM_BITMAP_X86
+
+/**
+ * skip_full_plain comparing four words per instruction. The words may be cleared by
+ * concurrent frees while they are read; the caller rereads the word it stops at.
+ */
+__attribute__((target("avx2")))
+static size_t skip_full_avx2(const uint64_t* words, size_t from, size_t count){
+    __m256i full = _mm256_set1_epi64x(-1);
+
+    while (from + 4 <= count){
+        __m256i v = _mm256_loadu_si256((const __m256i*)(words + from));
+        int mask = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpeq_epi64(v, full)));
+        if (mask != 0xF){
+            return from + __builtin_ctz(~mask & 0xF);
+        }
+        from += 4;
+    }
+    return skip_full_plain(words, from, count);
+}
+
+#endif // MEM_BITMAP_X86
+
+
+/**
+ * Returns a mask with a bit set at every position where a run of `n` set bits of `bits` starts.
+ * Runs are not followed past the top of the word.
+ */
+static inline uint64_t run_starts(uint64_t bits, unsigned int n){
+    unsigned int length = 1;
+    while (length < n && bits != 0){
+        unsigned int shift = length < n - length ? length : n - length;
+        bits &= bits >> shift;
+        length += shift;
+    }
+    return bits;
+}
+
+
+/**
+ * Finds the first run of `n` free granules. The caller holds `bitmap_lock`.
+ *
+ * @param n Run length in granules, at most MEM_BITMAP_WORD_BITS.
+ * @param from Word to start searching at.
+ * @param first_open Set to the first word seen with a free granule.
+ * @return The index of the first granule of the run, or -1 if there is none.
+ *
+ * Behavior:
+ * - Skips words without free granules several at a time.
+ * - Counts the free granules at the top of each word, so runs crossing into the next word are found.
+ * - Looks for runs inside a word only if the word has at least `n` free granules.
+ */
+static long find_run(unsigned int n, size_t from, size_t* first_open){
+    size_t carried = 0; // Free granules at the top of the words before
+    *first_open = word_count;
+
+    for (size_t w = from; w < word_count; w++){
+        if (carried == 0){
+            w = skip_full(used, w, word_count);
+            if (w == word_count){
+                break;
+            }
+        }
+        if (*first_open == word_count){
+            *first_open = w;
+        }
+
+        uint64_t free_bits = ~__atomic_load_n(&used[w], __ATOMIC_ACQUIRE);
+        if (free_bits == MEM_BITMAP_FULL){
+            if (carried + MEM_BITMAP_WORD_BITS >= n){
+                return w * MEM_BITMAP_WORD_BITS - carried;
+            }
+            carried += MEM_BITMAP_WORD_BITS;
+            continue;
+        }
+
+        if (carried > 0 && carried + __builtin_ctzll(~free_bits) >= n){
+            return w * MEM_BITMAP_WORD_BITS - carried;
+        }
+        if ((unsigned int)__builtin_popcountll(free_bits) >= n){
+            uint64_t starts = run_starts(free_bits, n);
+            if (starts != 0){
+                return w * MEM_BITMAP_WORD_BITS + __builtin_ctzll(starts);
+            }
+        }
+        carried = free_bits == 0 ? 0 : __builtin_clzll(~free_bits);
+    }
+    return -1;
+}
+
+
+/**
+ * Sets or clears the bits of granules [first, last] in a bitmap, a word at a time.
+ */
+static void mark_range(uint64_t* bitmap, size_t first, size_t last, int set){
+    while (first <= last){
+        size_t w = first / MEM_BITMAP_WORD_BITS;
+        unsigned int from = first % MEM_BITMAP_WORD_BITS;
+        unsigned int to = (last / MEM_BITMAP_WORD_BITS == w) ? last % MEM_BITMAP_WORD_BITS + 1 : MEM_BITMAP_WORD_BITS;
+        uint64_t mask = bit_range(from, to);
+
+        if (set){
+            __atomic_fetch_or(&bitmap[w], mask, __ATOMIC_RELAXED);
+        }
+        else{
+            __atomic_fetch_and(&bitmap[w], ~mask, __ATOMIC_RELEASE);
+        }
+        first = w * MEM_BITMAP_WORD_BITS + to;
+    }
+}
+
+
+/**
+ * Hands the bitmap allocator an arena carved from the pool.
+ *
+ * @param start Start of the arena, or `NULL` to turn the bitmap allocator off.
+ * @param size Size of the arena in bytes.
+ * @return 1 on success, 0 if the bitmaps could not be allocated.
+ *
+ * Behavior:
+ * - Aligns the arena to MEM_BITMAP_GRANULE and trims it to whole bitmap words.
+ * - Picks the AVX2 scan if the CPU supports it.
+ * - Must not run while other threads use the bitmap allocator.
+ */
+int mem_bitmap_init(void* start, size_t size){
+    mem_bitmap_deinit();
+    if (start == NULL){
+        return 1;
+    }
+
+    size_t pad = (MEM_BITMAP_GRANULE - ((uintptr_t)start & (MEM_BITMAP_GRANULE - 1))) & (MEM_BITMAP_GRANULE - 1);
+    size = size > pad ? size - pad : 0;
+    size_t words = size / (MEM_BITMAP_GRANULE * MEM_BITMAP_WORD_BITS);
+
+    used = (uint64_t*)calloc(words + 1, sizeof(uint64_t));
+    ends = (uint64_t*)calloc(words + 1, sizeof(uint64_t));
+    if (used == NULL || ends == NULL){
+        mem_bitmap_deinit();
+        return 0;
+    }
+
+    skip_full = skip_full_plain;
+#ifdef MEM_BITMAP_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")){
+        skip_full = skip_full_avx2;
+    }
+#endif
+
+    arena = (char*)start + pad;
+    word_count = words;
+    arena_size = words * MEM_BITMAP_GRANULE * MEM_BITMAP_WORD_BITS;
+    first_free_word = 0;
+    return 1;
+}
+
+
+/**
+ * Turns the bitmap allocator off and frees its bitmaps.
+ */
+void mem_bitmap_deinit(){
+    free(used);
+    free(ends);
+    used = NULL;
+    ends = NULL;
+    arena = NULL;
+    arena_size = 0;
+    word_count = 0;
+    first_free_word = 0;
+}
+
+
+/**
+ * Allocates the first run of free granules that fits the request.
+ *
+ * @param size The size of the block to allocate, below MEM_BITMAP_MAX_SIZE.
+ * @return Pointer to the block, or `NULL` if no run is long enough.
+ *
+ * Behavior:
+ * - Rounds the size up to whole granules, at least one.
+ * - Searches and marks the run under the bitmap lock.
+ * - Moves the start of the next search up to the first word with a free granule, unless
+ *   a concurrent free lowered it in the meantime.
+ */
+void* mem_bitmap_alloc(size_t size){
+    if (arena == NULL || size >= MEM_BITMAP_MAX_SIZE){
+        return NULL;
+    }
+    unsigned int n = size > 0 ? (size + MEM_BITMAP_GRANULE - 1) / MEM_BITMAP_GRANULE : 1;
+
+    mem_lock_acquire(&bitmap_lock);
+    size_t from = __atomic_load_n(&first_free_word, __ATOMIC_RELAXED);
+    size_t first_open;
+    long first = find_run(n, from, &first_open);
+    if (first >= 0){
+        mark_range(used, first, first + n - 1, 1);
+        mark_range(ends, first + n - 1, first + n - 1, 1);
+    }
+    if (first_open > from){
+        __atomic_compare_exchange_n(&first_free_word, &from, first_open, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+    }
+    mem_lock_release(&bitmap_lock);
+
+    return first >= 0 ? arena + first * MEM_BITMAP_GRANULE : NULL;
+}
+
+
+/**
+ * Returns the last granule of the allocated block starting at granule `first`, or -1 if it is not allocated.
+ */
+static long last_granule(size_t first){
+    size_t w = first / MEM_BITMAP_WORD_BITS;
+    if (!(__atomic_load_n(&used[w], __ATOMIC_ACQUIRE) & ((uint64_t)1 << (first % MEM_BITMAP_WORD_BITS)))){
+        return -1;
+    }
+
+    uint64_t bits = __atomic_load_n(&ends[w], __ATOMIC_RELAXED) & (MEM_BITMAP_FULL << (first % MEM_BITMAP_WORD_BITS));
+    while (bits == 0 && ++w < word_count){
+        bits = __atomic_load_n(&ends[w], __ATOMIC_RELAXED);
+    }
+    return bits != 0 ? (long)(w * MEM_BITMAP_WORD_BITS + __builtin_ctzll(bits)) : -1;
+}
+
+
+/**
+ * Returns the granule a pointer into the arena starts, or -1 if it is not the start of a granule of the arena.
+ */
+static long granule_of(void* block){
+    char* ptr = (char*)block;
+    if (arena == NULL || ptr < arena || ptr >= arena + arena_size || (ptr - arena) % MEM_BITMAP_GRANULE != 0){
+        return -1;
+    }
+    return (ptr - arena) / MEM_BITMAP_GRANULE;
+}
+
+
+/**
+ * Frees a block of the bitmap arena.
+ *
+ * @param block The block to free.
+ * @return 1 if the block was in the bitmap arena, 0 if it belongs to the general pool.
+ *
+ * Behavior:
+ * - Clears the end bit of the block, then its used bits, with atomic and-not. No lock is taken.
+ * - Lowers the word the next search starts from if the block lies before it.
+ * - Ignores pointers into the arena that are not allocated.
+ */
+int mem_bitmap_free(void* block){
+    char* ptr = (char*)block;
+    if (arena == NULL || ptr < arena || ptr >= arena + arena_size){
+        return 0;
+    }
+
+    long first = granule_of(block);
+    long last = first >= 0 ? last_granule(first) : -1;
+    if (last < 0){
+        return 1;
+    }
+
+    mark_range(ends, last, last, 0);
+    mark_range(used, first, last, 0);
+
+    size_t w = first / MEM_BITMAP_WORD_BITS;
+    size_t hint = __atomic_load_n(&first_free_word, __ATOMIC_RELAXED);
+    while (w < hint && !__atomic_compare_exchange_n(&first_free_word, &hint, w, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)){
+    }
+    return 1;
+}
+
+
+/**
+ * Returns the size of an allocated block of the bitmap arena, or 0 for any other pointer.
+ */
+size_t mem_bitmap_size(void* block){
+    long first = granule_of(block);
+    long last = first >= 0 ? last_granule(first) : -1;
+    return last >= 0 ? (last - first + 1) * MEM_BITMAP_GRANULE : 0;
+}
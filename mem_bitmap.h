@@ -0,0 +1,54 @@
+#ifndef MEM_BITMAP_H
+#define MEM_BITMAP_H
+
+#include <stddef.h> // For size_t
+
+// Requests below this size are served from the bitmap arena
+#define MEM_BITMAP_MAX_SIZE 1024
+
+// Unit the bitmap arena is handed out in, one bit per granule
+#define MEM_BITMAP_GRANULE 16
+
+// Share of the pool set aside as the bitmap arena, as a divisor of the pool size
+#define MEM_BITMAP_ARENA_DIVISOR 4
+
+
+/**
+ * Hands the bitmap allocator an arena carved from the pool, dropping whatever it held before.
+ *
+ * @param arena Start of the arena, or `NULL` to turn the bitmap allocator off.
+ * @param size Size of the arena in bytes.
+ * @return 1 on success, 0 if the bitmaps could not be allocated.
+ */
+int mem_bitmap_init(void* arena, size_t size);
+
+/**
+ * Turns the bitmap allocator off and frees its bitmaps.
+ */
+void mem_bitmap_deinit();
+
+/**
+ * Allocates the first run of free granules that fits the request.
+ *
+ * @param size The size of the block to allocate, below MEM_BITMAP_MAX_SIZE.
+ * @return Pointer to the block, or `NULL` if no run is long enough.
+ */
+void* mem_bitmap_alloc(size_t size);
+
+/**
+ * Frees a block of the bitmap arena by clearing its bits, without taking a lock.
+ *
+ * @param block The block to free.
+ * @return 1 if the block was in the bitmap arena, 0 if it belongs to the general pool.
+ */
+int mem_bitmap_free(void* block);
+
+/**
+ * Returns the size of a block of the bitmap arena, a whole number of granules.
+ *
+ * @param block Any pointer.
+ * @return The block size, or 0 if the block is not an allocated block of the bitmap arena.
+ */
+size_t mem_bitmap_size(void* block);
+
+#endif // MEM_BITMAP_H
@@ -0,0 +1,235 @@
+// Viktor Fransson DVAMI22h
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "mem_class.h"
+
+// Objects are addressed by their offset into the arena in units of this many bytes
+#define MEM_CLASS_GRANULE 8
+
+
+/**
+ * A Treiber stack of the free blocks of one size class.
+ *
+ * `head` packs a version tag in the upper 32 bits and the granule index of the top block
+ * plus one in the lower 32 bits, 0 meaning empty. Every push and pop bumps the tag, so a
+ * compare-and-swap against a head that was popped and pushed again in between fails (ABA).
+ * Free blocks link to the next one through their first four bytes, in the same encoding.
+ */
+struct class_stack{
+    uint64_t head;
+    size_t size;
+} __attribute__((aligned(64)));
+
+
+static struct class_stack stacks[MEM_CLASS_COUNT];
+
+static char* arena = NULL;
+static size_t arena_size = 0;
+static size_t arena_next = 0; // Offset of the next chunk no class has claimed yet
+static unsigned char* chunk_class = NULL; // Class index plus one of every chunk, 0 while unclaimed
+
+
+static inline uint32_t to_index(void* block){
+    return (uint32_t)(((char*)block - arena) / MEM_CLASS_GRANULE) + 1;
+}
+
+static inline uint32_t* to_block(uint32_t index){
+    return (uint32_t*)(arena + (size_t)(index - 1) * MEM_CLASS_GRANULE);
+}
+
+
+/**
+ * Pushes the chain of blocks `first` to `last`, already linked to each other, with one compare-and-swap.
+ */
+static void push_chain(struct class_stack* stack, void* first, void* last){
+    uint64_t old = __atomic_load_n(&stack->head, __ATOMIC_RELAXED);
+    uint64_t new_head;
+    do{
+        __atomic_store_n((uint32_t*)last, (uint32_t)old, __ATOMIC_RELAXED);
+        new_head = (((old >> 32) + 1) << 32) | to_index(first);
+    } while (!__atomic_compare_exchange_n(&stack->head, &old, new_head, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+
+/**
+ * Pops the top block of a stack.
+ *
+ * @return The block, or `NULL` if the stack is empty.
+ *
+ * Behavior:
+ * - Reads the link of the top block, which another thread may already have popped and be
+ *   writing to. The arena stays mapped, and the tag makes the compare-and-swap fail in that case.
+ */
+static void* pop(struct class_stack* stack){
+    uint64_t old = __atomic_load_n(&stack->head, __ATOMIC_ACQUIRE);
+    uint64_t new_head;
+    do{
+        uint32_t index = (uint32_t)old;
+        if (index == 0){
+            return NULL;
+        }
+        uint32_t next = __atomic_load_n(to_block(index), __ATOMIC_RELAXED);
+        new_head = (((old >> 32) + 1) << 32) | next;
+    } while (!__atomic_compare_exchange_n(&stack->head, &old, new_head, 1, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE));
+
+    return to_block((uint32_t)old);
+}
+
+
+/**
+ * Claims the next chunk of the arena for a class, keeps its first block and pushes the rest.
+ *
+ * @return The first block of the chunk, or `NULL` if the arena is used up.
+ */
+static void* refill(int class_index){
+    struct class_stack* stack = &stacks[class_index];
+    size_t offset = __atomic_fetch_add(&arena_next, MEM_CLASS_CHUNK, __ATOMIC_RELAXED);
+    if (offset + MEM_CLASS_CHUNK > arena_size){
+        return NULL;
+    }
+
+    char* chunk = arena + offset;
+    __atomic_store_n(&chunk_class[offset / MEM_CLASS_CHUNK], class_index + 1, __ATOMIC_RELEASE);
+
+    size_t count = MEM_CLASS_CHUNK / stack->size;
+    if (count > 1){
+        for (size_t i = 1; i + 1 < count; i++){
+            __atomic_store_n((uint32_t*)(chunk + i * stack->size), to_index(chunk + (i + 1) * stack->size), __ATOMIC_RELAXED);
+        }
+        push_chain(stack, chunk + stack->size, chunk + (count - 1) * stack->size);
+    }
+    return chunk;
+}
+
+
+/**
+ * Hands the size classes an arena carved from the pool.
+ *
+ * @param start Start of the arena, or `NULL` to turn the size classes off.
+ * @param size Size of the arena in bytes.
+ * @return 1 on success, 0 if the chunk map could not be allocated.
+ *
+ * Behavior:
+ * - Aligns the arena to MEM_CLASS_GRANULE and trims it to whole chunks that granule indexes can address.
+ * - Empties every stack. Blocks handed out from an earlier arena are forgotten.
+ * - Must not run while other threads use the size classes.
+ */
+int mem_class_init(void* start, size_t size){
+    static const size_t sizes[MEM_CLASS_COUNT] = MEM_CLASS_SIZES;
+
+    mem_class_deinit();
+    if (start == NULL){
+        return 1;
+    }
+
+    size_t pad = (MEM_CLASS_GRANULE - ((uintptr_t)start & (MEM_CLASS_GRANULE - 1))) & (MEM_CLASS_GRANULE - 1);
+    size = size > pad ? size - pad : 0;
+    if (size > (size_t)UINT32_MAX * MEM_CLASS_GRANULE){
+        size = (size_t)UINT32_MAX * MEM_CLASS_GRANULE;
+    }
+    size -= size % MEM_CLASS_CHUNK;
+
+    chunk_class = (unsigned char*)calloc(size / MEM_CLASS_CHUNK + 1, 1);
+    if (chunk_class == NULL){
+        return 0;
+    }
+
+    for (int i = 0; i < MEM_CLASS_COUNT; i++){
+        stacks[i].head = 0;
+        stacks[i].size = sizes[i];
+    }
+    arena = (char*)start + pad;
+    arena_size = size;
+    arena_next = 0;
+    return 1;
+}
+
+
+/**
+ * Turns the size classes off and frees their chunk map.
+ */
+void mem_class_deinit(){
+    free(chunk_class);
+    chunk_class = NULL;
+    arena = NULL;
+    arena_size = 0;
+    arena_next = 0;
+}
+
+
+/**
+ * Allocates a block from the smallest class that fits.
+ *
+ * @param size The size of the block to allocate.
+ * @return Pointer to the block, or `NULL` if the size has no class or the class arena is used up.
+ *
+ * Behavior:
+ * - Pops the class stack, a single compare-and-swap without any lock.
+ * - Claims a new chunk of the arena when the stack is empty.
+ */
+void* mem_class_alloc(size_t size){
+    if (arena == NULL){
+        return NULL;
+    }
+
+    for (int i = 0; i < MEM_CLASS_COUNT; i++){
+        if (size <= stacks[i].size){
+            void* block = pop(&stacks[i]);
+            return block != NULL ? block : refill(i);
+        }
+    }
+    return NULL;
+}
+
+
+/**
+ * Returns the index of the class a pointer into the arena belongs to, or -1 if it is not a class block.
+ */
+static int class_of(void* block){
+    char* ptr = (char*)block;
+    if (arena == NULL || ptr < arena || ptr >= arena + arena_size){
+        return -1;
+    }
+
+    size_t offset = ptr - arena;
+    int class_index = __atomic_load_n(&chunk_class[offset / MEM_CLASS_CHUNK], __ATOMIC_ACQUIRE) - 1;
+    if (class_index < 0 || (offset % MEM_CLASS_CHUNK) % stacks[class_index].size != 0){
+        return -1;
+    }
+    return class_index;
+}
+
+
+/**
+ * Pushes a block back on its class stack if it came from the class arena.
+ *
+ * @param block The block to free.
+ * @return 1 if the block was in the class arena, 0 if it belongs to the general pool.
+ *
+ * Behavior:
+ * - Takes a single compare-and-swap, without any lock.
+ * - Ignores pointers into the arena that are not the start of a class block.
+ */
+int mem_class_free(void* block){
+    char* ptr = (char*)block;
+    if (arena == NULL || ptr < arena || ptr >= arena + arena_size){
+        return 0;
+    }
+
+    int class_index = class_of(block);
+    if (class_index >= 0){
+        push_chain(&stacks[class_index], block, block);
+    }
+    return 1;
+}
+
+
+/**
+ * Returns the size of the class a block of the class arena belongs to, or 0 for any other pointer.
+ */
+size_t mem_class_size(void* block){
+    int class_index = class_of(block);
+    return class_index >= 0 ? stacks[class_index].size : 0;
+}
@@ -0,0 +1,59 @@
+#ifndef MEM_CLASS_H
+#define MEM_CLASS_H
+
+#include <stddef.h> // For size_t
+
+// Size classes served from lock-free stacks: sizeof(Node) of the linked list on LP64, 64 and 128 bytes
+#define MEM_CLASS_SIZES {56, 64, 128}
+#define MEM_CLASS_COUNT 3
+
+// Largest request served by a size class
+#define MEM_CLASS_MAX_SIZE 128
+
+// The class arena is handed to the size classes in chunks of this many bytes
+#define MEM_CLASS_CHUNK 4096
+
+// Share of the pool set aside as the class arena, as a divisor of the pool size
+#define MEM_CLASS_ARENA_DIVISOR 4
+
+
+/**
+ * Hands the size classes an arena carved from the pool, dropping whatever they held before.
+ *
+ * @param arena Start of the arena, or `NULL` to turn the size classes off.
+ * @param size Size of the arena in bytes.
+ * @return 1 on success, 0 if the chunk map could not be allocated.
+ */
+int mem_class_init(void* arena, size_t size);
+
+/**
+ * Turns the size classes off and frees their chunk map.
+ */
+void mem_class_deinit();
+
+/**
+ * Allocates a block from the stack of the smallest class that fits, with a single
+ * compare-and-swap when the stack is not empty.
+ *
+ * @param size The size of the block to allocate.
+ * @return Pointer to the block, or `NULL` if the size has no class or the class arena is used up.
+ */
+void* mem_class_alloc(size_t size);
+
+/**
+ * Pushes a block back on its class stack if it came from the class arena.
+ *
+ * @param block The block to free.
+ * @return 1 if the block was a class block and is now free, 0 if it belongs to the general pool.
+ */
+int mem_class_free(void* block);
+
+/**
+ * Returns the size of the class a block of the class arena belongs to.
+ *
+ * @param block Any pointer.
+ * @return The class size, or 0 if the block is not in the class arena.
+ */
+size_t mem_class_size(void* block);
+
+#endif // MEM_CLASS_H
@@ -0,0 +1,148 @@
+// Viktor Fransson DVAMI22h
+
+#include <sched.h>
+
+#include "mem_combine.h"
+#include "mem_internal.h"
+#include "mem_lock.h"
+
+// Pauses between two attempts at the combiner lock while waiting for a combiner
+#define MEM_COMBINE_YIELD_SPINS 64
+
+
+/**
+ * A request slot owned by one thread. Each slot has a cache line to itself so
+ * posting a request does not disturb the slots of other threads.
+ */
+struct combine_slot{
+    int in_use;  // Owned by a live thread
+    int pending; // A request is waiting in the slot
+    int op;
+    size_t size;
+    void* block; // Block to free, or the allocated block once served
+} __attribute__((aligned(64)));
+
+
+static struct combine_slot slots[MEM_COMBINE_SLOTS];
+static int slots_high = 0; // Slots at or above this index have never been used
+
+// Held by the thread currently serving the posted requests
+static struct mem_lock combine_lock = MEM_LOCK_INITIALIZER;
+
+static __thread struct combine_slot* my_slot = NULL;
+static pthread_key_t slot_key;
+static pthread_once_t slot_key_once = PTHREAD_ONCE_INIT;
+
+
+/**
+ * Gives a thread's slot back when the thread exits.
+ */
+static void release_slot(void* slot){
+    __atomic_store_n(&((struct combine_slot*)slot)->in_use, 0, __ATOMIC_RELEASE);
+}
+
+
+static void create_slot_key(){
+    pthread_key_create(&slot_key, release_slot);
+}
+
+
+/**
+ * Returns the calling thread's slot, claiming a free one on first use.
+ *
+ * @return The slot, or `NULL` if all MEM_COMBINE_SLOTS slots belong to live threads.
+ */
+static struct combine_slot* get_slot(){
+    if (my_slot != NULL){
+        return my_slot;
+    }
+
+    pthread_once(&slot_key_once, create_slot_key);
+
+    for (int i = 0; i < MEM_COMBINE_SLOTS; i++){
+        int free_slot = 0;
+        if (__atomic_load_n(&slots[i].in_use, __ATOMIC_RELAXED) == 0
+            && __atomic_compare_exchange_n(&slots[i].in_use, &free_slot, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)){
+
+            int high = __atomic_load_n(&slots_high, __ATOMIC_RELAXED);
+            while (high < i + 1
+                   && !__atomic_compare_exchange_n(&slots_high, &high, i + 1, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED)){
+            }
+
+            my_slot = &slots[i];
+            pthread_setspecific(slot_key, my_slot);
+            return my_slot;
+        }
+    }
+    return NULL;
+}
+
+
+/**
+ * Executes one request, taking the pool locks it needs.
+ */
+static void* execute(int op, size_t size, void* block){
+    if (op == MEM_COMBINE_ALLOC){
+        return mem_pool_alloc(size);
+    }
+    mem_pool_free(block);
+    return NULL;
+}
+
+
+/**
+ * Serves every pending request. The caller holds the combiner lock.
+ */
+static void combine(){
+    int high = __atomic_load_n(&slots_high, __ATOMIC_ACQUIRE);
+
+    for (int i = 0; i < high; i++){
+        struct combine_slot* slot = &slots[i];
+        if (__atomic_load_n(&slot->pending, __ATOMIC_ACQUIRE)){
+            slot->block = execute(slot->op, slot->size, slot->block);
+            __atomic_store_n(&slot->pending, 0, __ATOMIC_RELEASE); // Hands the result to the owner
+        }
+    }
+}
+
+
+/**
+ * Runs an allocator operation through the flat-combining front end.
+ *
+ * @param op MEM_COMBINE_ALLOC or MEM_COMBINE_FREE.
+ * @param size Size to allocate, for MEM_COMBINE_ALLOC.
+ * @param block Block to free, for MEM_COMBINE_FREE.
+ * @return The allocated block for MEM_COMBINE_ALLOC, `NULL` for MEM_COMBINE_FREE.
+ *
+ * Behavior:
+ * - Posts the request in the caller's slot.
+ * - Whenever the combiner lock is free, takes it and serves all pending requests, including its own.
+ * - Otherwise waits for another combiner to serve the request, yielding now and then.
+ * - Runs the request directly when no slot is left for the thread.
+ */
+void* mem_combine(int op, size_t size, void* block){
+    struct combine_slot* slot = get_slot();
+    if (slot == NULL){
+        return execute(op, size, block);
+    }
+
+    slot->op = op;
+    slot->size = size;
+    slot->block = block;
+    __atomic_store_n(&slot->pending, 1, __ATOMIC_RELEASE);
+
+    unsigned int spins = 0;
+    while (__atomic_load_n(&slot->pending, __ATOMIC_ACQUIRE)){
+        if (mem_lock_try_acquire(&combine_lock)){
+            combine();
+            mem_lock_release(&combine_lock);
+            continue;
+        }
+
+        mem_cpu_relax();
+        if (++spins % MEM_COMBINE_YIELD_SPINS == 0){
+            sched_yield(); // Let the combiner run if it shares our CPU
+        }
+    }
+    return slot->block;
+}
@@ -0,0 +1,28 @@
+#ifndef MEM_COMBINE_H
+#define MEM_COMBINE_H
+
+#include <stddef.h> // For size_t
+
+// Maximum number of threads that can have a request slot at the same time
+#define MEM_COMBINE_SLOTS 512
+
+// Operations a thread can post to its slot
+#define MEM_COMBINE_ALLOC 1
+#define MEM_COMBINE_FREE 2
+
+
+/**
+ * Runs an allocator operation through the flat-combining front end.
+ *
+ * The caller posts the request in its own slot. Whichever thread gets the combiner
+ * lock executes every posted request in one pass, so the allocator state stays
+ * in that core's cache instead of moving between cores for each operation.
+ *
+ * @param op MEM_COMBINE_ALLOC or MEM_COMBINE_FREE.
+ * @param size Size to allocate, for MEM_COMBINE_ALLOC.
+ * @param block Block to free, for MEM_COMBINE_FREE.
+ * @return The allocated block for MEM_COMBINE_ALLOC, `NULL` for MEM_COMBINE_FREE.
+ */
+void* mem_combine(int op, size_t size, void* block);
+
+#endif // MEM_COMBINE_H
@@ -0,0 +1,167 @@
+// Viktor Fransson DVAMI22h
+
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "mem_copy.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define MEM_COPY_X86 1
+#endif
+
+
+typedef void (*copy_kernel_t)(void* dst, const void* src, size_t n);
+
+// Kernel used for large copies, picked once by select_kernel
+static copy_kernel_t stream_kernel = NULL;
+static pthread_once_t kernel_once = PTHREAD_ONCE_INIT;
+
+
+/**
+ * Fallback kernel for CPUs without streaming stores.
+ */
+static void copy_plain(void* dst, const void* src, size_t n){
+    memcpy(dst, src, n);
+}
+
+
+#ifdef MEM_COPY_X86
+
+/**
+ * Copies the unaligned head of `dst` with memcpy so the streaming loop can use
+ * aligned stores, and returns how many bytes were copied.
+ */
+static size_t copy_head(void* dst, const void* src, size_t n, size_t align){
+    size_t head = (align - ((uintptr_t)dst & (align - 1))) & (align - 1);
+    if (head > n){
+        head = n;
+    }
+    memcpy(dst, src, head);
+    return head;
+}
+
+
+__attribute__((target("avx512f")))
+static void copy_stream_avx512(void* dst, const void* src, size_t n){
+    size_t done = copy_head(dst, src, n, 64);
+    char* d = (char*)dst + done;
+    const char* s = (const char*)src + done;
+    n -= done;
+
+    while (n >= 256){
+        __m512i a = _mm512_loadu_si512((const void*)(s));
+        __m512i b = _mm512_loadu_si512((const void*)(s + 64));
+        __m512i c = _mm512_loadu_si512((const void*)(s + 128));
+        __m512i e = _mm512_loadu_si512((const void*)(s + 192));
+        _mm512_stream_si512((void*)(d), a);
+        _mm512_stream_si512((void*)(d + 64), b);
+        _mm512_stream_si512((void*)(d + 128), c);
+        _mm512_stream_si512((void*)(d + 192), e);
+        s += 256;
+        d += 256;
+        n -= 256;
+    }
+    _mm_sfence(); // Streaming stores are weakly ordered, publish them before returning
+    memcpy(d, s, n);
+}
+
+
+__attribute__((target("avx2")))
+static void copy_stream_avx2(void* dst, const void* src, size_t n){
+    size_t done = copy_head(dst, src, n, 32);
+    char* d = (char*)dst + done;
+    const char* s = (const char*)src + done;
+    n -= done;
+
+    while (n >= 128){
+        __m256i a = _mm256_loadu_si256((const __m256i*)(s));
+        __m256i b = _mm256_loadu_si256((const __m256i*)(s + 32));
+        __m256i c = _mm256_loadu_si256((const __m256i*)(s + 64));
+        __m256i e = _mm256_loadu_si256((const __m256i*)(s + 96));
+        _mm256_stream_si256((__m256i*)(d), a);
+        _mm256_stream_si256((__m256i*)(d + 32), b);
+        _mm256_stream_si256((__m256i*)(d + 64), c);
+        _mm256_stream_si256((__m256i*)(d + 96), e);
+        s += 128;
+        d += 128;
+        n -= 128;
+    }
+    _mm_sfence();
+    memcpy(d, s, n);
+}
+
+
+__attribute__((target("sse2")))
+static void copy_stream_sse2(void* dst, const void* src, size_t n){
+    size_t done = copy_head(dst, src, n, 16);
+    char* d = (char*)dst + done;
+    const char* s = (const char*)src + done;
+    n -= done;
+
+    while (n >= 64){
+        __m128i a = _mm_loadu_si128((const __m128i*)(s));
+        __m128i b = _mm_loadu_si128((const __m128i*)(s + 16));
+        __m128i c = _mm_loadu_si128((const __m128i*)(s + 32));
+        __m128i e = _mm_loadu_si128((const __m128i*)(s + 48));
+        _mm_stream_si128((__m128i*)(d), a);
+        _mm_stream_si128((__m128i*)(d + 16), b);
+        _mm_stream_si128((__m128i*)(d + 32), c);
+        _mm_stream_si128((__m128i*)(d + 48), e);
+        s += 64;
+        d += 64;
+        n -= 64;
+    }
+    _mm_sfence();
+    memcpy(d, s, n);
+}
+
+#endif // MEM_COPY_X86
+
+
+/**
+ * Picks the widest streaming kernel the CPU and OS support.
+ *
+ * Behavior:
+ * - Queries CPUID through the compiler builtins, which also check that the OS saves the vector state.
+ * - Falls back to plain memcpy on CPUs (or architectures) without streaming stores.
+ */
+static void select_kernel(){
+    stream_kernel = copy_plain;
+
+#ifdef MEM_COPY_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")){
+        stream_kernel = copy_stream_avx512;
+    }
+    else if (__builtin_cpu_supports("avx2")){
+        stream_kernel = copy_stream_avx2;
+    }
+    else if (__builtin_cpu_supports("sse2")){
+        stream_kernel = copy_stream_sse2;
+    }
+#endif
+}
+
+
+/**
+ * Copies a block of memory, using streaming stores for large copies.
+ *
+ * @param dst Destination of the copy.
+ * @param src Source of the copy.
+ * @param n Number of bytes to copy.
+ *
+ * Behavior:
+ * - Copies below MEM_COPY_STREAM_THRESHOLD use memcpy, which is faster while the data fits in cache.
+ * - Larger copies use the kernel selected on first use.
+ */
+void mem_copy(void* dst, const void* src, size_t n){
+    if (n < MEM_COPY_STREAM_THRESHOLD){
+        memcpy(dst, src, n);
+        return;
+    }
+
+    pthread_once(&kernel_once, select_kernel);
+    stream_kernel(dst, src, n);
+}
@@ -0,0 +1,23 @@
+#ifndef MEM_COPY_H
+#define MEM_COPY_H
+
+#include <stddef.h> // For size_t
+
+// Copies at or above this size bypass the cache with streaming stores
+#define MEM_COPY_STREAM_THRESHOLD (1024 * 1024)
+
+/**
+ * Copies `n` bytes from `src` to `dst`. The two ranges must not overlap.
+ *
+ * Small copies go straight to `memcpy`. Copies of at least
+ * MEM_COPY_STREAM_THRESHOLD bytes use a non-temporal store kernel
+ * (AVX-512, AVX2 or SSE2) picked once at runtime from CPUID, so a large
+ * relocation does not evict the rest of the working set from the cache.
+ *
+ * @param dst Destination of the copy.
+ * @param src Source of the copy.
+ * @param n Number of bytes to copy.
+ */
+void mem_copy(void* dst, const void* src, size_t n);
+
+#endif // MEM_COPY_H
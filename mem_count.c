@@ -0,0 +1,105 @@
+// Viktor Fransson DVAMI22h
+
+#include <pthread.h>
+
+#include "mem_count.h"
+
+
+static struct mem_count_shard shards[MEM_COUNT_SHARDS];
+static int shards_high = 0; // Shards at or above this index have never been used
+
+struct mem_count_shard mem_count_overflow;
+
+// Totals at the last mem_count_reset, which reads subtract
+static size_t baseline[MEM_COUNT_KINDS];
+
+__thread struct mem_count_shard* mem_count_local = NULL;
+static pthread_key_t shard_key;
+static pthread_once_t shard_key_once = PTHREAD_ONCE_INIT;
+
+
+/**
+ * Gives a thread's shard back when the thread exits. Its counts stay, and the next thread
+ * to claim the shard adds to them, so nothing counted is lost.
+ */
+static void release_shard(void* shard){
+    __atomic_store_n(&((struct mem_count_shard*)shard)->in_use, 0, __ATOMIC_RELEASE);
+}
+
+
+static void create_shard_key(){
+    pthread_key_create(&shard_key, release_shard);
+}
+
+
+/**
+ * Claims a free shard for the calling thread, on its first counted operation.
+ *
+ * @return The shard, or `NULL` if all MEM_COUNT_SHARDS shards belong to live threads.
+ */
+struct mem_count_shard* mem_count_claim(){
+    pthread_once(&shard_key_once, create_shard_key);
+
+    for (int i = 0; i < MEM_COUNT_SHARDS; i++){
+        int free_shard = 0;
+        if (__atomic_load_n(&shards[i].in_use, __ATOMIC_RELAXED) == 0
+            && __atomic_compare_exchange_n(&shards[i].in_use, &free_shard, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)){
+
+            int high = __atomic_load_n(&shards_high, __ATOMIC_RELAXED);
+            while (high < i + 1
+                   && !__atomic_compare_exchange_n(&shards_high, &high, i + 1, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED)){
+            }
+
+            mem_count_local = &shards[i];
+            pthread_setspecific(shard_key, mem_count_local);
+            return mem_count_local;
+        }
+    }
+    return NULL;
+}
+
+
+/**
+ * Adds up the counters of every shard that was ever used, and of the overflow shard.
+ */
+static void sum(size_t counts[MEM_COUNT_KINDS]){
+    int high = __atomic_load_n(&shards_high, __ATOMIC_ACQUIRE);
+
+    for (int kind = 0; kind < MEM_COUNT_KINDS; kind++){
+        counts[kind] = __atomic_load_n(&mem_count_overflow.counts[kind], __ATOMIC_RELAXED);
+        for (int i = 0; i < high; i++){
+            counts[kind] += __atomic_load_n(&shards[i].counts[kind], __ATOMIC_RELAXED);
+        }
+    }
+}
+
+
+/**
+ * Sums the counters of every thread since the last mem_count_reset.
+ *
+ * Behavior:
+ * - Reads the shards without stopping their owners, so operations that run meanwhile may
+ *   or may not be included. Every operation that finished before the call is.
+ */
+void mem_count_read(size_t counts[MEM_COUNT_KINDS]){
+    sum(counts);
+    for (int kind = 0; kind < MEM_COUNT_KINDS; kind++){
+        counts[kind] -= __atomic_load_n(&baseline[kind], __ATOMIC_RELAXED);
+    }
+}
+
+
+/**
+ * Starts counting from zero again.
+ *
+ * Behavior:
+ * - Records the current totals as the new zero instead of clearing the shards, which only
+ *   their owners may write.
+ */
+void mem_count_reset(){
+    size_t counts[MEM_COUNT_KINDS];
+    sum(counts);
+    for (int kind = 0; kind < MEM_COUNT_KINDS; kind++){
+        __atomic_store_n(&baseline[kind], counts[kind], __ATOMIC_RELAXED);
+    }
+}
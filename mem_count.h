@@ -0,0 +1,126 @@
+#ifndef MEM_COUNT_H
+#define MEM_COUNT_H
+
+#include <stddef.h> // For size_t
+#include <stdint.h>
+#include <time.h> // For clock_gettime where there is no cycle counter
+
+#include "memory_manager.h" // For MEM_LOCK_HISTOGRAM_BUCKETS
+
+// Maximum number of threads that can have a counter shard of their own at the same time
+#define MEM_COUNT_SHARDS 512
+
+// Operations counted for mem_stats
+#define MEM_COUNT_ALLOCS 0
+#define MEM_COUNT_FREES 1
+#define MEM_COUNT_RESIZES 2
+#define MEM_COUNT_FAILED 3
+
+// Bytes in blocks callers hold that no block table counts: size class, bitmap and spilled blocks.
+// A free adds the negated size in the shard of the thread that frees, so only the sum means anything.
+#define MEM_COUNT_HELD_BYTES 4
+
+// Builds with MEM_LOCK_HISTOGRAMS also count lock waits and holds, one counter per histogram bucket
+#define MEM_COUNT_WAIT 5
+#define MEM_COUNT_HOLD (MEM_COUNT_WAIT + MEM_LOCK_HISTOGRAM_BUCKETS)
+#ifdef MEM_LOCK_HISTOGRAMS
+#define MEM_COUNT_KINDS (MEM_COUNT_HOLD + MEM_LOCK_HISTOGRAM_BUCKETS)
+#else
+#define MEM_COUNT_KINDS 5
+#endif
+
+
+/**
+ * Counters of one thread. Each shard starts on a cache line of its own and is only written by the
+ * thread that owns it, so counting an operation is a plain increment that never contends.
+ */
+struct mem_count_shard{
+    int in_use; // Owned by a live thread
+    size_t counts[MEM_COUNT_KINDS];
+} __attribute__((aligned(64)));
+
+
+/**
+ * Claims a free shard for the calling thread, on its first counted operation.
+ *
+ * @return The shard, or `NULL` if all MEM_COUNT_SHARDS shards belong to live threads.
+ */
+struct mem_count_shard* mem_count_claim();
+
+extern __thread struct mem_count_shard* mem_count_local;
+
+// Counts of threads that found no free shard, updated atomically since they share it
+extern struct mem_count_shard mem_count_overflow;
+
+
+/**
+ * Adds to a counter of the calling thread. Counters wrap around, so adding `(size_t)0 - n`
+ * takes `n` off the sum of all threads.
+ *
+ * @param kind One of the MEM_COUNT_ constants.
+ * @param amount What to add.
+ */
+static inline void mem_count_add(int kind, size_t amount){
+    struct mem_count_shard* shard = mem_count_local;
+    if (shard == NULL){
+        shard = mem_count_claim();
+    }
+    if (shard == NULL){
+        __atomic_fetch_add(&mem_count_overflow.counts[kind], amount, __ATOMIC_RELAXED);
+        return;
+    }
+    // Only this thread writes the shard; the atomic store just keeps readers from seeing a torn value
+    __atomic_store_n(&shard->counts[kind], shard->counts[kind] + amount, __ATOMIC_RELAXED);
+}
+
+/**
+ * Counts one operation of the calling thread.
+ *
+ * @param kind One of the MEM_COUNT_ constants.
+ */
+static inline void mem_count(int kind){
+    mem_count_add(kind, 1);
+}
+
+/**
+ * Reads the cycle counter, or the time in nanoseconds where the CPU has none we can read.
+ */
+static inline uint64_t mem_count_clock(){
+#if defined(__x86_64__) || defined(__i386__)
+    return __builtin_ia32_rdtsc();
+#elif defined(__aarch64__)
+    uint64_t ticks;
+    __asm__ volatile("mrs %0, cntvct_el0" : "=r"(ticks));
+    return ticks;
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+#endif
+}
+
+/**
+ * Counts a lock wait or hold in its histogram bucket: bucket 0 for no time at all, bucket
+ * b for `2^(b-1)` to `2^b - 1` cycles, and the last bucket for anything longer.
+ *
+ * @param histogram MEM_COUNT_WAIT or MEM_COUNT_HOLD.
+ * @param cycles The duration.
+ */
+static inline void mem_count_duration(int histogram, uint64_t cycles){
+    int bucket = cycles == 0 ? 0 : 64 - __builtin_clzll(cycles);
+    mem_count(histogram + (bucket < MEM_LOCK_HISTOGRAM_BUCKETS ? bucket : MEM_LOCK_HISTOGRAM_BUCKETS - 1));
+}
+
+/**
+ * Sums the counters of every thread, past and present, since the last mem_count_reset.
+ *
+ * @param counts Set to the total of each kind, indexed by the MEM_COUNT_ constants.
+ */
+void mem_count_read(size_t counts[MEM_COUNT_KINDS]);
+
+/**
+ * Starts counting from zero again. Threads keep their shards.
+ */
+void mem_count_reset();
+
+#endif // MEM_COUNT_H
@@ -0,0 +1,331 @@
+// Viktor Fransson DVAMI22h
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "mem_handle.h"
+#include "mem_lock.h"
+
+// No slot, at the ends of the address list and the free slot list
+#define MEM_HANDLE_NONE UINT32_MAX
+
+
+/**
+ * What a handle refers to. Live slots are linked in address order, so the gaps between
+ * neighbours are the free space of the arena and need no bookkeeping of their own. Unused
+ * slots have `offset` MEM_HANDLE_NONE and are chained through `next`.
+ */
+struct handle_slot{
+    uint32_t offset; // From the start of the arena
+    uint32_t size;
+    uint32_t pins;
+    uint32_t prev;
+    uint32_t next;
+};
+
+
+// State of the handle allocator, guarded by `handle_lock`
+static struct mem_lock handle_lock = MEM_LOCK_INITIALIZER;
+static char* arena = NULL;
+static size_t arena_size = 0;
+static struct handle_slot* slots = NULL;
+static uint32_t capacity = 0;
+static uint32_t used = 0; // Slots ever handed out; the ones above are untouched
+static uint32_t free_slots = MEM_HANDLE_NONE;
+static uint32_t head = MEM_HANDLE_NONE; // Lowest addressed block
+
+// Where the compaction pass in progress goes on, see mem_handle_compact
+static int in_pass = 0;
+static uint32_t cursor = MEM_HANDLE_NONE;
+static size_t pass_moved = 0;
+
+
+/**
+ * Hands the handle allocator an arena carved from the pool, dropping every handle it held before.
+ *
+ * @param start Start of the arena, or `NULL` to turn handles off.
+ * @param size Size of the arena in bytes.
+ * @return 1 on success, 0 if the handle table could not be allocated.
+ *
+ * Behavior:
+ * - Aligns the start to MEM_HANDLE_ALIGN, and leaves the arena empty.
+ */
+int mem_handle_init(void* start, size_t size){
+    mem_handle_deinit();
+    if (start == NULL){
+        return 1;
+    }
+
+    slots = (struct handle_slot*)malloc(MEM_HANDLE_INITIAL_SLOTS * sizeof(struct handle_slot));
+    if (slots == NULL){
+        return 0;
+    }
+    capacity = MEM_HANDLE_INITIAL_SLOTS;
+
+    size_t pad = (MEM_HANDLE_ALIGN - ((uintptr_t)start & (MEM_HANDLE_ALIGN - 1))) & (MEM_HANDLE_ALIGN - 1);
+    size = size > pad ? size - pad : 0;
+    arena = (char*)start + pad;
+    arena_size = size < UINT32_MAX ? size & ~(size_t)(MEM_HANDLE_ALIGN - 1) : UINT32_MAX & ~(MEM_HANDLE_ALIGN - 1);
+    return 1;
+}
+
+
+/**
+ * Turns handles off and frees the handle table.
+ */
+void mem_handle_deinit(){
+    mem_lock_acquire(&handle_lock);
+    free(slots);
+    slots = NULL;
+    capacity = 0;
+    used = 0;
+    free_slots = MEM_HANDLE_NONE;
+    head = MEM_HANDLE_NONE;
+    in_pass = 0;
+    cursor = MEM_HANDLE_NONE;
+    arena = NULL;
+    arena_size = 0;
+    mem_lock_release(&handle_lock);
+}
+
+
+/**
+ * Takes an unused slot, growing the table if every slot is live. The caller holds `handle_lock`.
+ *
+ * @return Its index, or MEM_HANDLE_NONE if the table could not grow.
+ */
+static uint32_t new_slot(){
+    if (free_slots != MEM_HANDLE_NONE){
+        uint32_t s = free_slots;
+        free_slots = slots[s].next;
+        return s;
+    }
+    if (used == capacity){
+        if (capacity >= MEM_HANDLE_NONE / 2){
+            return MEM_HANDLE_NONE;
+        }
+        struct handle_slot* grown = (struct handle_slot*)realloc(slots, 2 * (size_t)capacity * sizeof(struct handle_slot));
+        if (grown == NULL){
+            return MEM_HANDLE_NONE;
+        }
+        slots = grown;
+        capacity *= 2;
+    }
+    return used++;
+}
+
+
+/**
+ * Checks a handle against the table. The caller holds `handle_lock`.
+ *
+ * @return Its slot index, or MEM_HANDLE_NONE for 0, a handle never handed out, or a freed one.
+ */
+static inline uint32_t live_slot(uint32_t handle){
+    if (handle == 0 || handle - 1 >= used || slots[handle - 1].offset == MEM_HANDLE_NONE){
+        return MEM_HANDLE_NONE;
+    }
+    return handle - 1;
+}
+
+
+// End of a live block, which is where the gap after it starts
+static inline uint32_t block_end(uint32_t s){
+    return s == MEM_HANDLE_NONE ? 0 : slots[s].offset + slots[s].size;
+}
+
+
+/**
+ * Allocates a movable block in the first gap of the arena that fits.
+ *
+ * @param size The size of the block to allocate.
+ * @return The handle, the slot index plus one, or 0 if no gap is large enough or the table could not grow.
+ *
+ * Behavior:
+ * - Rounds the size up to MEM_HANDLE_ALIGN.
+ * - Walks the blocks in address order, like the first fit scan of the block tables. Once
+ *   compaction has packed the blocks, the only gap is the one after the last block.
+ */
+uint32_t mem_handle_alloc(size_t size){
+    if (arena == NULL || size > arena_size){
+        return 0;
+    }
+    uint32_t rounded = (uint32_t)((size + MEM_HANDLE_ALIGN - 1) & ~(size_t)(MEM_HANDLE_ALIGN - 1));
+
+    mem_lock_acquire(&handle_lock);
+    uint32_t prev = MEM_HANDLE_NONE;
+    uint32_t next = head;
+    while (1){
+        uint32_t gap_end = next == MEM_HANDLE_NONE ? (uint32_t)arena_size : slots[next].offset;
+        if (gap_end - block_end(prev) >= rounded){
+            break;
+        }
+        if (next == MEM_HANDLE_NONE){
+            mem_lock_release(&handle_lock);
+            return 0;
+        }
+        prev = next;
+        next = slots[next].next;
+    }
+
+    uint32_t s = new_slot();
+    if (s == MEM_HANDLE_NONE){
+        mem_lock_release(&handle_lock);
+        return 0;
+    }
+    slots[s] = (struct handle_slot){block_end(prev), rounded, 0, prev, next};
+    if (prev != MEM_HANDLE_NONE){
+        slots[prev].next = s;
+    }
+    else{
+        head = s;
+    }
+    if (next != MEM_HANDLE_NONE){
+        slots[next].prev = s;
+    }
+    mem_lock_release(&handle_lock);
+    return s + 1;
+}
+
+
+/**
+ * Frees the block of a handle and makes the handle invalid. Freeing 0, or a handle that is
+ * not live, does nothing.
+ */
+void mem_handle_free(uint32_t handle){
+    mem_lock_acquire(&handle_lock);
+    uint32_t s = live_slot(handle);
+    if (s == MEM_HANDLE_NONE){
+        mem_lock_release(&handle_lock);
+        return;
+    }
+    uint32_t prev = slots[s].prev;
+    uint32_t next = slots[s].next;
+    if (prev != MEM_HANDLE_NONE){
+        slots[prev].next = next;
+    }
+    else{
+        head = next;
+    }
+    if (next != MEM_HANDLE_NONE){
+        slots[next].prev = prev;
+    }
+    if (cursor == s){
+        cursor = next;
+    }
+    slots[s].offset = MEM_HANDLE_NONE;
+    slots[s].next = free_slots;
+    free_slots = s;
+    mem_lock_release(&handle_lock);
+}
+
+
+/**
+ * Pins the block of a handle where it is, so compaction leaves it alone.
+ *
+ * @return The current address of the block, or `NULL` for 0 or a handle that is not live.
+ */
+void* mem_handle_pin(uint32_t handle){
+    mem_lock_acquire(&handle_lock);
+    uint32_t s = live_slot(handle);
+    if (s == MEM_HANDLE_NONE){
+        mem_lock_release(&handle_lock);
+        return NULL;
+    }
+    struct handle_slot* slot = &slots[s];
+    slot->pins++;
+    void* block = arena + slot->offset;
+    mem_lock_release(&handle_lock);
+    return block;
+}
+
+
+/**
+ * Takes back one pin of a handle. The block may move once its last pin is gone.
+ */
+void mem_handle_unpin(uint32_t handle){
+    mem_lock_acquire(&handle_lock);
+    uint32_t s = live_slot(handle);
+    if (s != MEM_HANDLE_NONE && slots[s].pins > 0){
+        slots[s].pins--;
+    }
+    mem_lock_release(&handle_lock);
+}
+
+
+/**
+ * Slides unpinned blocks down over the gaps below them, resuming where the last step stopped.
+ *
+ * @param budget Bytes to move in this step. Every block looked at also costs MEM_HANDLE_VISIT_COST bytes.
+ * @return 1 if there is more to do, 0 once a whole pass found every unpinned block in place.
+ *
+ * Behavior:
+ * - Moves each unpinned block down to the end of the block before it, so the gaps collect
+ *   above the last block. A pinned block stays, and the blocks after it pack up against it.
+ * - Stops once the budget is spent, which bounds how long allocations, frees and pins wait
+ *   for the lock. A block larger than what is left of the budget is still moved whole.
+ * - Blocks allocated or freed between steps are simply met, or not, by the pass in progress.
+ */
+int mem_handle_compact(size_t budget){
+    mem_lock_acquire(&handle_lock);
+    if (arena == NULL){
+        mem_lock_release(&handle_lock);
+        return 0;
+    }
+    if (!in_pass){
+        in_pass = 1;
+        cursor = head;
+        pass_moved = 0;
+    }
+
+    size_t spent = 0;
+    while (cursor != MEM_HANDLE_NONE && spent < budget){
+        struct handle_slot* slot = &slots[cursor];
+        uint32_t to = block_end(slot->prev);
+        spent += MEM_HANDLE_VISIT_COST;
+        if (slot->pins == 0 && slot->offset > to){
+            memmove(arena + to, arena + slot->offset, slot->size);
+            slot->offset = to;
+            spent += slot->size;
+            pass_moved += slot->size;
+        }
+        cursor = slot->next;
+    }
+
+    int more = 1;
+    if (cursor == MEM_HANDLE_NONE){
+        in_pass = 0;
+        more = pass_moved > 0; // Another pass only finds something if this one moved blocks
+    }
+    mem_lock_release(&handle_lock);
+    return more;
+}
+
+
+/**
+ * Reports the free space of the arena.
+ *
+ * @param free_bytes Set to the bytes in all gaps.
+ * @param largest_gap Set to the largest block that could be allocated right now.
+ */
+void mem_handle_stats(size_t* free_bytes, size_t* largest_gap){
+    size_t total = 0;
+    size_t largest = 0;
+
+    mem_lock_acquire(&handle_lock);
+    if (arena != NULL){
+        uint32_t prev = MEM_HANDLE_NONE;
+        for (uint32_t s = head; ; s = slots[s].next){
+            size_t gap = (s == MEM_HANDLE_NONE ? arena_size : slots[s].offset) - block_end(prev);
+            total += gap;
+            largest = gap > largest ? gap : largest;
+            if (s == MEM_HANDLE_NONE){
+                break;
+            }
+            prev = s;
+        }
+    }
+    mem_lock_release(&handle_lock);
+
+    *free_bytes = total;
+    *largest_gap = largest;
+}
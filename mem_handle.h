@@ -0,0 +1,79 @@
+#ifndef MEM_HANDLE_H
+#define MEM_HANDLE_H
+
+#include <stddef.h> // For size_t
+#include <stdint.h>
+
+// Share of the pool set aside as the handle arena, as a divisor of the pool size
+#define MEM_HANDLE_ARENA_DIVISOR 4
+
+// Movable blocks are rounded up to this, so they stay aligned wherever they slide to
+#define MEM_HANDLE_ALIGN 16
+
+// Handles a table has room for before it first grows
+#define MEM_HANDLE_INITIAL_SLOTS 64
+
+// Bytes of compaction budget a block costs just to be looked at, so that a step over blocks
+// that are already in place is bounded too
+#define MEM_HANDLE_VISIT_COST 64
+
+
+/**
+ * Hands the handle allocator an arena carved from the pool, dropping every handle it held before.
+ *
+ * @param arena Start of the arena, or `NULL` to turn handles off.
+ * @param size Size of the arena in bytes.
+ * @return 1 on success, 0 if the handle table could not be allocated.
+ */
+int mem_handle_init(void* arena, size_t size);
+
+/**
+ * Turns handles off and frees the handle table.
+ */
+void mem_handle_deinit();
+
+/**
+ * Allocates a movable block in the first gap of the arena that fits.
+ *
+ * @param size The size of the block to allocate.
+ * @return The handle, or 0 if no gap is large enough or the table could not grow.
+ */
+uint32_t mem_handle_alloc(size_t size);
+
+/**
+ * Frees the block of a handle and makes the handle invalid. Freeing 0, or a handle that is
+ * not live, does nothing.
+ */
+void mem_handle_free(uint32_t handle);
+
+/**
+ * Pins the block of a handle where it is, so compaction leaves it alone.
+ *
+ * @return The current address of the block, or `NULL` for 0 or a handle that is not live.
+ */
+void* mem_handle_pin(uint32_t handle);
+
+/**
+ * Takes back one pin of a handle. The block may move once its last pin is gone. Does
+ * nothing for a handle that is not live.
+ */
+void mem_handle_unpin(uint32_t handle);
+
+/**
+ * Slides unpinned blocks down over the gaps below them, resuming where the last step stopped.
+ *
+ * @param budget Bytes to move in this step, or about that. Every block looked at also
+ *               costs MEM_HANDLE_VISIT_COST bytes.
+ * @return 1 if there is more to do, 0 once a whole pass found every unpinned block in place.
+ */
+int mem_handle_compact(size_t budget);
+
+/**
+ * Reports the free space of the arena.
+ *
+ * @param free_bytes Set to the bytes in all gaps.
+ * @param largest_gap Set to the largest block that could be allocated right now.
+ */
+void mem_handle_stats(size_t* free_bytes, size_t* largest_gap);
+
+#endif // MEM_HANDLE_H
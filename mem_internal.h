@@ -0,0 +1,16 @@
+#ifndef MEM_INTERNAL_H
+#define MEM_INTERNAL_H
+
+// Parts of memory_manager.c shared with the other modules of the library.
+// Applications only include memory_manager.h.
+
+#include "memory_manager.h"
+
+/**
+ * mem_alloc and mem_free without the flat-combining front end. They take the
+ * locks of the pool regions they touch themselves.
+ */
+void* mem_pool_alloc(size_t size);
+void mem_pool_free(void* block);
+
+#endif // MEM_INTERNAL_H
@@ -0,0 +1,114 @@
+// Viktor Fransson DVAMI22h
+
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "mem_lock.h"
+
+
+/**
+ * Returns how many pauses a waiter may spin before sleeping. Spinning only helps
+ * when the holder can run at the same time, so it is skipped on a single CPU.
+ */
+static unsigned long spin_limit(){
+    static long cpus = 0; // Same value from every thread, so the racy caching is harmless
+
+    if (__atomic_load_n(&cpus, __ATOMIC_RELAXED) == 0){
+        __atomic_store_n(&cpus, sysconf(_SC_NPROCESSORS_ONLN), __ATOMIC_RELAXED);
+    }
+    return __atomic_load_n(&cpus, __ATOMIC_RELAXED) > 1 ? MEM_LOCK_SPIN_LIMIT : 0;
+}
+
+
+static void futex_wait(int* addr, int expected){
+    syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, expected, NULL, NULL, 0);
+}
+
+
+static void futex_wake(int* addr){
+    syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+
+/**
+ * Acquires the lock, spinning briefly before sleeping.
+ *
+ * @param lock The lock to acquire.
+ *
+ * Behavior:
+ * - Takes the lock with a single compare-and-swap when it is free.
+ * - Otherwise spins, doubling the pause count between attempts up to MEM_LOCK_MAX_BACKOFF,
+ *   until MEM_LOCK_SPIN_LIMIT pauses have been spent. Single CPU machines skip spinning.
+ * - Then marks the lock as having waiters and sleeps on the futex until it is handed over.
+ * - Records how the lock was acquired in the lock statistics once it is held.
+ */
+void mem_lock_acquire(struct mem_lock* lock){
+    int state = 0;
+    if (__atomic_compare_exchange_n(&lock->state, &state, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)){
+        lock->stats.acquisitions++;
+        return;
+    }
+
+    unsigned long spins = 0;
+    unsigned long limit = spin_limit();
+    unsigned int backoff = 1;
+    while (spins < limit){
+        for (unsigned int i = 0; i < backoff; i++){
+            mem_cpu_relax();
+        }
+        spins += backoff;
+        if (backoff < MEM_LOCK_MAX_BACKOFF){
+            backoff *= 2;
+        }
+
+        state = 0;
+        if (__atomic_load_n(&lock->state, __ATOMIC_RELAXED) == 0
+            && __atomic_compare_exchange_n(&lock->state, &state, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)){
+            lock->stats.acquisitions++;
+            lock->stats.contended++;
+            lock->stats.spins += spins;
+            return;
+        }
+    }
+
+    // Spinning did not pay off, sleep until the holder hands the lock over
+    unsigned long sleeps = 0;
+    while (__atomic_exchange_n(&lock->state, 2, __ATOMIC_ACQUIRE) != 0){
+        futex_wait(&lock->state, 2);
+        sleeps++;
+    }
+
+    lock->stats.acquisitions++;
+    lock->stats.contended++;
+    lock->stats.spins += spins;
+    lock->stats.sleeps += sleeps;
+}
+
+
+/**
+ * Takes the lock only if it is free right now.
+ *
+ * @param lock The lock to acquire.
+ * @return 1 if the lock is now held by the caller, 0 otherwise.
+ */
+int mem_lock_try_acquire(struct mem_lock* lock){
+    int state = 0;
+    if (__atomic_compare_exchange_n(&lock->state, &state, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)){
+        lock->stats.acquisitions++;
+        return 1;
+    }
+    return 0;
+}
+
+
+/**
+ * Releases the lock, waking one sleeping waiter if there is one.
+ *
+ * @param lock The lock to release.
+ */
+void mem_lock_release(struct mem_lock* lock){
+    if (__atomic_exchange_n(&lock->state, 0, __ATOMIC_RELEASE) == 2){
+        futex_wake(&lock->state);
+    }
+}
@@ -0,0 +1,66 @@
+#ifndef MEM_LOCK_H
+#define MEM_LOCK_H
+
+#include "memory_manager.h" // For struct mem_lock_stats
+
+// Upper bound on pause instructions spent spinning before sleeping on the futex
+#define MEM_LOCK_SPIN_LIMIT 2048
+
+// Longest single backoff between two attempts, in pause instructions
+#define MEM_LOCK_MAX_BACKOFF 256
+
+
+/**
+ * Lock guarding the allocator state. Waiters spin with `pause` and exponential
+ * backoff for a short while, since the critical sections are short, and only
+ * then sleep on a futex.
+ *
+ * `state` is 0 when unlocked, 1 when locked and 2 when locked with sleeping waiters.
+ * The statistics are only written while holding the lock.
+ */
+struct mem_lock{
+    int state;
+    struct mem_lock_stats stats;
+};
+
+#define MEM_LOCK_INITIALIZER {0, {0, 0, 0, 0}}
+
+
+/**
+ * Tells the CPU we are in a spin loop, which saves power and lets a sibling
+ * hyperthread (possibly the lock holder) run.
+ */
+static inline void mem_cpu_relax(){
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ volatile("yield" ::: "memory");
+#else
+    __asm__ volatile("" ::: "memory");
+#endif
+}
+
+
+/**
+ * Acquires the lock, spinning briefly before sleeping.
+ *
+ * @param lock The lock to acquire.
+ */
+void mem_lock_acquire(struct mem_lock* lock);
+
+/**
+ * Takes the lock only if it is free right now, without waiting.
+ *
+ * @param lock The lock to acquire.
+ * @return 1 if the lock is now held by the caller, 0 otherwise.
+ */
+int mem_lock_try_acquire(struct mem_lock* lock);
+
+/**
+ * Releases the lock, waking one sleeping waiter if there is one.
+ *
+ * @param lock The lock to release.
+ */
+void mem_lock_release(struct mem_lock* lock);
+
+#endif // MEM_LOCK_H
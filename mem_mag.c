@@ -0,0 +1,400 @@
+// Viktor Fransson DVAMI22h
+
+#define _GNU_SOURCE // For sched_getcpu
+
+#include <sched.h>
+#include <stdlib.h>
+
+#include "mem_class.h"
+#include "mem_lock.h"
+#include "mem_mag.h"
+
+
+/**
+ * A stack of free blocks of one class, `rounds` of them loaded.
+ */
+struct magazine{
+    struct magazine* next; // Link in a depot list
+    unsigned int capacity;
+    unsigned int rounds;
+    void* blocks[];
+};
+
+
+/**
+ * Magazines of one CPU. The lock is only try-acquired: it is held by another thread only
+ * when a thread was moved to another CPU in the middle of an operation, and then the
+ * caller goes straight to the class stacks instead of waiting.
+ */
+struct cpu_cache{
+    struct mem_lock lock;
+    struct magazine* loaded[MEM_CLASS_COUNT];
+    struct magazine* previous[MEM_CLASS_COUNT];
+} __attribute__((aligned(64)));
+
+
+/**
+ * Full and empty magazines of one class, shared by all CPUs.
+ *
+ * `full_idle` and `empty_idle` are the fewest magazines a list held since the last trim;
+ * that many were not needed in the meantime, so a trim gives them back.
+ */
+struct depot{
+    struct mem_lock lock;
+    struct magazine* full;
+    struct magazine* empty;
+    unsigned int full_count;
+    unsigned int empty_count;
+    unsigned int full_idle;
+    unsigned int empty_idle;
+    unsigned int capacity; // Rounds of new magazines, 0 until the first one
+    unsigned int contended; // Contended acquisitions since the magazine size last grew
+} __attribute__((aligned(64)));
+
+
+static struct cpu_cache caches[MEM_MAG_CPUS];
+static struct depot depots[MEM_CLASS_COUNT];
+static const size_t class_sizes[MEM_CLASS_COUNT] = MEM_CLASS_SIZES;
+
+
+static int class_index(size_t size){
+    for (int i = 0; i < MEM_CLASS_COUNT; i++){
+        if (size <= class_sizes[i]){
+            return i;
+        }
+    }
+    return -1;
+}
+
+
+static struct cpu_cache* this_cpu(){
+    int cpu = sched_getcpu();
+    return &caches[cpu > 0 ? cpu % MEM_MAG_CPUS : 0];
+}
+
+
+/**
+ * Locks a depot, growing the magazines of its class when the lock keeps being contended,
+ * so that CPUs come back to the depot less often.
+ */
+static void depot_lock(struct depot* depot){
+    if (mem_lock_try_acquire(&depot->lock)){
+        return;
+    }
+    mem_lock_acquire(&depot->lock);
+    if (++depot->contended >= MEM_MAG_GROW_AFTER && depot->capacity < MEM_MAG_MAX_ROUNDS){
+        depot->capacity *= 2;
+        depot->contended = 0;
+    }
+}
+
+
+static struct magazine* new_magazine(struct depot* depot){
+    if (depot->capacity == 0){
+        depot->capacity = MEM_MAG_MIN_ROUNDS;
+    }
+    struct magazine* magazine = (struct magazine*)malloc(sizeof(struct magazine) + depot->capacity * sizeof(void*));
+    if (magazine != NULL){
+        magazine->capacity = depot->capacity;
+        magazine->rounds = 0;
+    }
+    return magazine;
+}
+
+
+/**
+ * Pushes the rounds of a magazine back on the class stacks, leaving it empty.
+ */
+static void drain(struct magazine* magazine){
+    for (unsigned int i = 0; i < magazine->rounds; i++){
+        mem_class_free(magazine->blocks[i]);
+    }
+    magazine->rounds = 0;
+}
+
+
+/**
+ * Swaps the empty previous magazine of a CPU for a full one from the depot.
+ *
+ * @return 1 if the CPU now has a loaded magazine with rounds, 0 if the depot has no full magazine.
+ *
+ * Behavior:
+ * - Frees the empty magazine instead of returning it if the magazines of the class grew since
+ *   it was allocated, so the CPUs move over to the larger size.
+ */
+static int load_full(struct cpu_cache* cache, int c){
+    struct depot* depot = &depots[c];
+    struct magazine* previous = cache->previous[c]; // Empty, or NULL
+
+    depot_lock(depot);
+    struct magazine* full = depot->full;
+    if (full == NULL){
+        mem_lock_release(&depot->lock);
+        return 0;
+    }
+    depot->full = full->next;
+    if (--depot->full_count < depot->full_idle){
+        depot->full_idle = depot->full_count;
+    }
+    if (previous != NULL && previous->capacity == depot->capacity){
+        previous->next = depot->empty;
+        depot->empty = previous;
+        depot->empty_count++;
+        previous = NULL;
+    }
+    mem_lock_release(&depot->lock);
+
+    free(previous); // Smaller than the magazines grew to meanwhile, retired
+    cache->previous[c] = cache->loaded[c];
+    cache->loaded[c] = full;
+    return 1;
+}
+
+
+/**
+ * Swaps the full previous magazine of a CPU for an empty one from the depot.
+ *
+ * @return 1 if the CPU now has a loaded magazine with room, 0 if no magazine could be allocated.
+ *
+ * Behavior:
+ * - Allocates a new magazine when the depot has no empty one, which stops once the depot
+ *   has built up its spares.
+ * - Once the depot holds MEM_MAG_DEPOT_LIMIT full magazines, drains the previous magazine
+ *   into the class stacks and reuses it instead, which bounds the cached blocks.
+ */
+static int load_empty(struct cpu_cache* cache, int c){
+    struct depot* depot = &depots[c];
+    struct magazine* previous = cache->previous[c]; // Full, or NULL
+    struct magazine* empty = NULL;
+
+    depot_lock(depot);
+    if (previous == NULL || depot->full_count < MEM_MAG_DEPOT_LIMIT){
+        empty = depot->empty;
+        if (empty != NULL){
+            depot->empty = empty->next;
+            if (--depot->empty_count < depot->empty_idle){
+                depot->empty_idle = depot->empty_count;
+            }
+        }
+        else{
+            empty = new_magazine(depot);
+        }
+        if (empty != NULL && previous != NULL){
+            previous->next = depot->full;
+            depot->full = previous;
+            depot->full_count++;
+            previous = NULL;
+        }
+    }
+    mem_lock_release(&depot->lock);
+
+    if (empty == NULL){
+        if (previous == NULL){
+            return 0;
+        }
+        drain(previous);
+        empty = previous;
+    }
+    cache->previous[c] = cache->loaded[c];
+    cache->loaded[c] = empty;
+    return 1;
+}
+
+
+/**
+ * Allocates a size class block through the magazine of the calling CPU.
+ *
+ * @param size The size of the block to allocate.
+ * @return Pointer to the block, or `NULL` if the size has no class or the class arena is used up.
+ *
+ * Behavior:
+ * - Pops the loaded magazine, or the previous one if the loaded one is empty.
+ * - Otherwise swaps for a full magazine from the depot, or takes the block from the class
+ *   stack if the depot has none.
+ * - Goes straight to the class stack if the CPU cache is busy.
+ */
+void* mem_mag_alloc(size_t size){
+    int c = class_index(size);
+    if (c < 0){
+        return NULL;
+    }
+    struct cpu_cache* cache = this_cpu();
+    if (!mem_lock_try_acquire(&cache->lock)){
+        return mem_class_alloc(size);
+    }
+
+    struct magazine* loaded = cache->loaded[c];
+    if (loaded == NULL || loaded->rounds == 0){
+        struct magazine* previous = cache->previous[c];
+        if (previous != NULL && previous->rounds > 0){
+            cache->previous[c] = loaded;
+            cache->loaded[c] = previous;
+        }
+        else if (!load_full(cache, c)){
+            mem_lock_release(&cache->lock);
+            return mem_class_alloc(size);
+        }
+        loaded = cache->loaded[c];
+    }
+
+    void* block = loaded->blocks[--loaded->rounds];
+    mem_lock_release(&cache->lock);
+    return block;
+}
+
+
+/**
+ * Frees a size class block into the magazine of the calling CPU.
+ *
+ * @param block The block to free.
+ * @return 1 if the block was in the class arena, 0 if it belongs to the general pool.
+ *
+ * Behavior:
+ * - Pushes on the loaded magazine, or the previous one if the loaded one is full.
+ * - Otherwise swaps for an empty magazine from the depot.
+ * - Pushes on the class stack if the CPU cache is busy or no magazine could be allocated.
+ */
+int mem_mag_free(void* block){
+    size_t size = mem_class_size(block);
+    if (size == 0){
+        return mem_class_free(block); // Not a class block, but maybe a pointer into the arena
+    }
+    int c = class_index(size);
+    struct cpu_cache* cache = this_cpu();
+    if (!mem_lock_try_acquire(&cache->lock)){
+        return mem_class_free(block);
+    }
+
+    struct magazine* loaded = cache->loaded[c];
+    if (loaded == NULL || loaded->rounds == loaded->capacity){
+        struct magazine* previous = cache->previous[c];
+        if (previous != NULL && previous->rounds == 0){
+            cache->previous[c] = loaded;
+            cache->loaded[c] = previous;
+        }
+        else if (!load_empty(cache, c)){
+            mem_lock_release(&cache->lock);
+            return mem_class_free(block);
+        }
+        loaded = cache->loaded[c];
+    }
+
+    loaded->blocks[loaded->rounds++] = block;
+    mem_lock_release(&cache->lock);
+    return 1;
+}
+
+
+/**
+ * Takes the first `count` magazines off a depot list.
+ *
+ * @return The magazines taken, or `NULL` for none.
+ */
+static struct magazine* take(struct magazine** list, unsigned int count){
+    if (count == 0){ // Cutting after no magazine would hand out the whole list
+        return NULL;
+    }
+    struct magazine* first = *list;
+    struct magazine** link = list;
+    while (count-- > 0 && *link != NULL){
+        link = &(*link)->next;
+    }
+    *list = *link;
+    *link = NULL;
+    return first;
+}
+
+
+/**
+ * Gives the magazines the depots did not need since the last trim back.
+ *
+ * Behavior:
+ * - Drains the idle full magazines into the class stacks and frees them and the idle empty ones.
+ * - Leaves the magazines loaded in the CPU caches alone.
+ */
+void mem_mag_trim(){
+    for (int c = 0; c < MEM_CLASS_COUNT; c++){
+        struct depot* depot = &depots[c];
+
+        depot_lock(depot);
+        struct magazine* full = take(&depot->full, depot->full_idle);
+        struct magazine* empty = take(&depot->empty, depot->empty_idle);
+        depot->full_count -= depot->full_idle;
+        depot->empty_count -= depot->empty_idle;
+        depot->full_idle = depot->full_count;
+        depot->empty_idle = depot->empty_count;
+        mem_lock_release(&depot->lock);
+
+        while (full != NULL){
+            struct magazine* next = full->next;
+            drain(full);
+            free(full);
+            full = next;
+        }
+        while (empty != NULL){
+            struct magazine* next = empty->next;
+            free(empty);
+            empty = next;
+        }
+    }
+}
+
+
+static void free_list(struct magazine* magazine){
+    while (magazine != NULL){
+        struct magazine* next = magazine->next;
+        free(magazine);
+        magazine = next;
+    }
+}
+
+
+/**
+ * Forgets every magazine and the blocks in them, without pushing the blocks back.
+ */
+void mem_mag_reset(){
+    for (int cpu = 0; cpu < MEM_MAG_CPUS; cpu++){
+        for (int c = 0; c < MEM_CLASS_COUNT; c++){
+            free(caches[cpu].loaded[c]);
+            free(caches[cpu].previous[c]);
+            caches[cpu].loaded[c] = NULL;
+            caches[cpu].previous[c] = NULL;
+        }
+    }
+    for (int c = 0; c < MEM_CLASS_COUNT; c++){
+        free_list(depots[c].full);
+        free_list(depots[c].empty);
+        depots[c] = (struct depot){MEM_LOCK_INITIALIZER, NULL, NULL, 0, 0, 0, 0, 0, 0};
+    }
+}
+
+
+static size_t rounds_in(struct magazine* magazine){
+    size_t rounds = 0;
+    for (; magazine != NULL; magazine = magazine->next){
+        rounds += magazine->rounds;
+    }
+    return rounds;
+}
+
+
+/**
+ * Counts the blocks cached in magazines, taking each CPU and depot lock in turn.
+ */
+size_t mem_mag_cached(){
+    size_t cached = 0;
+    for (int cpu = 0; cpu < MEM_MAG_CPUS; cpu++){
+        mem_lock_acquire(&caches[cpu].lock);
+        for (int c = 0; c < MEM_CLASS_COUNT; c++){
+            cached += caches[cpu].loaded[c] != NULL ? caches[cpu].loaded[c]->rounds : 0;
+            cached += caches[cpu].previous[c] != NULL ? caches[cpu].previous[c]->rounds : 0;
+        }
+        mem_lock_release(&caches[cpu].lock);
+    }
+    for (int c = 0; c < MEM_CLASS_COUNT; c++){
+        mem_lock_acquire(&depots[c].lock);
+        cached += rounds_in(depots[c].full);
+        mem_lock_release(&depots[c].lock);
+    }
+    return cached;
+}
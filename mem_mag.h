@@ -0,0 +1,57 @@
+#ifndef MEM_MAG_H
+#define MEM_MAG_H
+
+#include <stddef.h> // For size_t
+
+// CPUs with a cache of their own; higher CPU numbers share caches modulo this
+#define MEM_MAG_CPUS 64
+
+// Rounds a magazine holds when a class starts out, and the most it grows to under contention
+#define MEM_MAG_MIN_ROUNDS 8
+#define MEM_MAG_MAX_ROUNDS 64
+
+// The depot of a class doubles its magazine size after this many contended acquisitions
+#define MEM_MAG_GROW_AFTER 16
+
+// Full magazines a depot keeps per class; beyond that their rounds go back to the class stacks
+#define MEM_MAG_DEPOT_LIMIT 8
+
+
+/**
+ * Allocates a size class block through the magazine of the calling CPU.
+ *
+ * Each CPU holds a loaded and a previous magazine per class. Allocations and frees only
+ * touch them, under a per-CPU lock that is only ever try-acquired, so the fast path never
+ * waits. When both are empty (or full) the CPU swaps a magazine with the depot of the
+ * class, under a short lock.
+ *
+ * @param size The size of the block to allocate.
+ * @return Pointer to the block, or `NULL` if the size has no class or the class arena is used up.
+ */
+void* mem_mag_alloc(size_t size);
+
+/**
+ * Frees a size class block into the magazine of the calling CPU.
+ *
+ * @param block The block to free.
+ * @return 1 if the block was in the class arena, 0 if it belongs to the general pool.
+ */
+int mem_mag_free(void* block);
+
+/**
+ * Gives the rounds of the full magazines in the depots back to the class stacks and frees
+ * the spare empty magazines, keeping what the CPUs have loaded.
+ */
+void mem_mag_trim();
+
+/**
+ * Forgets every magazine and the blocks in them. Must not run while other threads use the magazines.
+ */
+void mem_mag_reset();
+
+/**
+ * Counts the blocks cached in magazines, loaded or in the depots.
+ */
+size_t mem_mag_cached();
+
+#endif // MEM_MAG_H
@@ -0,0 +1,167 @@
+// Viktor Fransson DVAMI22h
+
+#include <pthread.h>
+#include <time.h>
+
+#include "mem_maint.h"
+
+
+// State of the maintenance thread, guarded by `maint_mutex`
+static pthread_mutex_t maint_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t maint_cond;
+static pthread_t maint_thread;
+static void (*maint_pass)() = NULL;
+static int stopping = 0;
+
+// Read without the mutex
+static int running = 0;
+static int pending = 0; // A pass was asked for since the last one started
+static unsigned int period_ms = MEM_MAINT_DEFAULT_PERIOD_MS;
+static unsigned int duty_percent = MEM_MAINT_DEFAULT_DUTY;
+
+
+static long long now_ns(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+
+/**
+ * Waits with `maint_mutex` held until `deadline`, until the thread is stopped or,
+ * if `wake_on_kick` is set, until a pass is asked for.
+ */
+static void wait_until(long long deadline, int wake_on_kick){
+    while (!stopping && !(wake_on_kick && __atomic_load_n(&pending, __ATOMIC_RELAXED))){
+        if (now_ns() >= deadline){
+            return;
+        }
+        struct timespec ts = {deadline / 1000000000LL, deadline % 1000000000LL};
+        pthread_cond_timedwait(&maint_cond, &maint_mutex, &ts);
+    }
+}
+
+
+/**
+ * Body of the maintenance thread.
+ *
+ * Behavior:
+ * - Runs a pass every period, or sooner when one is asked for.
+ * - Rests after each pass long enough that passes take at most the duty share of the time,
+ *   however often they are asked for.
+ */
+static void* maint_main(void* arg){
+    (void)arg;
+    pthread_mutex_lock(&maint_mutex);
+
+    while (!stopping){
+        __atomic_store_n(&pending, 0, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&maint_mutex);
+
+        long long start = now_ns();
+        maint_pass();
+        long long end = now_ns();
+
+        unsigned int duty = __atomic_load_n(&duty_percent, __ATOMIC_RELAXED);
+        long long rest = (end - start) * (100 - duty) / duty;
+        long long period = __atomic_load_n(&period_ms, __ATOMIC_RELAXED) * 1000000LL;
+
+        pthread_mutex_lock(&maint_mutex);
+        wait_until(end + rest, 0);
+        wait_until(start + period, 1);
+    }
+
+    pthread_mutex_unlock(&maint_mutex);
+    return NULL;
+}
+
+
+/**
+ * Starts the maintenance thread.
+ *
+ * @param pass The housekeeping to run.
+ * @return 1 if the thread is running, 0 if it could not be created.
+ */
+int mem_maint_start(void (*pass)()){
+    pthread_mutex_lock(&maint_mutex);
+    if (running){
+        pthread_mutex_unlock(&maint_mutex);
+        return 1;
+    }
+
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC); // Deadlines must not jump with the wall clock
+    pthread_cond_init(&maint_cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    maint_pass = pass;
+    stopping = 0;
+    if (pthread_create(&maint_thread, NULL, maint_main, NULL) != 0){
+        pthread_cond_destroy(&maint_cond);
+        pthread_mutex_unlock(&maint_mutex);
+        return 0;
+    }
+    __atomic_store_n(&running, 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&maint_mutex);
+    return 1;
+}
+
+
+/**
+ * Stops the maintenance thread and waits for it to exit.
+ *
+ * Behavior:
+ * - Wakes the thread if it is resting; a pass in progress is finished first.
+ * - Does nothing if the thread is not running.
+ */
+void mem_maint_stop(){
+    pthread_mutex_lock(&maint_mutex);
+    if (!running){
+        pthread_mutex_unlock(&maint_mutex);
+        return;
+    }
+    stopping = 1;
+    __atomic_store_n(&running, 0, __ATOMIC_RELEASE);
+    pthread_cond_signal(&maint_cond);
+    pthread_mutex_unlock(&maint_mutex);
+
+    pthread_join(maint_thread, NULL);
+    pthread_cond_destroy(&maint_cond);
+    maint_pass = NULL;
+}
+
+
+/**
+ * Asks the maintenance thread for a pass.
+ *
+ * Behavior:
+ * - Only the first request since the last pass takes the mutex to wake the thread; later ones
+ *   cost a single atomic exchange.
+ * - The thread still keeps to its duty cycle, so frequent requests cannot make it busy.
+ */
+void mem_maint_kick(){
+    if (!__atomic_load_n(&running, __ATOMIC_ACQUIRE) || __atomic_exchange_n(&pending, 1, __ATOMIC_RELAXED)){
+        return;
+    }
+    pthread_mutex_lock(&maint_mutex);
+    if (running){
+        pthread_cond_signal(&maint_cond);
+    }
+    pthread_mutex_unlock(&maint_mutex);
+}
+
+
+/**
+ * Sets how often the maintenance thread runs and how much of its time it may work.
+ *
+ * @param period Time between passes in milliseconds, clamped to at least 1.
+ * @param duty Upper bound on the share of time spent in passes in percent, clamped to 1 to 100.
+ *
+ * Behavior:
+ * - Takes effect after the pass in progress, and lasts until it is changed again.
+ */
+void mem_maint_tune(unsigned int period, unsigned int duty){
+    __atomic_store_n(&period_ms, period > 0 ? period : 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&duty_percent, duty < 1 ? 1 : duty > 100 ? 100 : duty, __ATOMIC_RELAXED);
+}
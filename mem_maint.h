@@ -0,0 +1,39 @@
+#ifndef MEM_MAINT_H
+#define MEM_MAINT_H
+
+// How often the maintenance thread runs a pass when nothing asks for one sooner
+#define MEM_MAINT_DEFAULT_PERIOD_MS 10
+
+// Share of its time the maintenance thread may spend working, in percent
+#define MEM_MAINT_DEFAULT_DUTY 5
+
+
+/**
+ * Starts the maintenance thread, which calls `pass` on a timer and whenever
+ * mem_maint_kick asks for it. A pass runs without any lock of this module held.
+ *
+ * @param pass The housekeeping to run.
+ * @return 1 if the thread is running, 0 if it could not be created.
+ */
+int mem_maint_start(void (*pass)());
+
+/**
+ * Stops the maintenance thread and waits for it to exit. Does nothing if it is not running.
+ */
+void mem_maint_stop();
+
+/**
+ * Asks the maintenance thread for a pass as soon as its duty cycle allows. Cheap enough
+ * to call from allocation paths; does nothing if the thread is not running.
+ */
+void mem_maint_kick();
+
+/**
+ * Sets how often the maintenance thread runs and how much of its time it may work.
+ *
+ * @param period_ms Time between passes when nothing asks for one sooner, at least 1.
+ * @param duty_percent Upper bound on the share of time spent in passes, 1 to 100.
+ */
+void mem_maint_tune(unsigned int period_ms, unsigned int duty_percent);
+
+#endif // MEM_MAINT_H
@@ -0,0 +1,196 @@
+// Viktor Fransson DVAMI22h
+
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "mem_segment.h"
+#include "mem_table.h"
+
+// Marks a segment that is fully set up; the last digits are the layout version
+#define MEM_SEGMENT_MAGIC 0x4d454d5345470007ULL
+
+
+/**
+ * Sets the mutex of a segment up as process-shared and robust, so the lock works across
+ * processes and a process that dies holding it does not leave the others waiting forever.
+ */
+static int init_mutex(struct mem_segment* segment){
+    pthread_mutexattr_t attr;
+    if (pthread_mutexattr_init(&attr) != 0){
+        return 0;
+    }
+    int ok = pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED) == 0
+          && pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST) == 0
+          && pthread_mutex_init(&segment->mutex, &attr) == 0;
+    pthread_mutexattr_destroy(&attr);
+    return ok;
+}
+
+
+/**
+ * Lays a new segment out in an empty file and maps it.
+ *
+ * @param fd An empty file opened for reading and writing.
+ * @param size Size of the pool in bytes.
+ * @return The segment, or `NULL` on failure.
+ *
+ * Behavior:
+ * - Gives the table one entry per MEM_SEGMENT_BYTES_PER_ENTRY bytes of pool, at least
+ *   MEM_SEGMENT_MIN_ENTRIES. A full table never grows; the allocator then leaves the
+ *   remainder of a split with the block.
+ * - Fails for empty pools and pools larger than MEM_TABLE_MAX_SIZE.
+ * - Publishes the magic number last, so processes attaching meanwhile wait for the rest.
+ */
+struct mem_segment* mem_segment_create(int fd, size_t size){
+    if (size == 0 || size > MEM_TABLE_MAX_SIZE){
+        return NULL;
+    }
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t capacity = size / MEM_SEGMENT_BYTES_PER_ENTRY;
+    capacity = capacity < MEM_SEGMENT_MIN_ENTRIES ? MEM_SEGMENT_MIN_ENTRIES : capacity;
+    size_t tables = (capacity + 1) / 2 * 2 * sizeof(uint32_t) + mem_table_anchor_count(capacity) * sizeof(uint64_t);
+    size_t pool_offset = (sizeof(struct mem_segment) + tables + page - 1) / page * page;
+    size_t length = pool_offset + size;
+
+    if (ftruncate(fd, length) != 0){
+        return NULL;
+    }
+    struct mem_segment* segment = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (segment == MAP_FAILED){
+        return NULL;
+    }
+    if (!init_mutex(segment)){
+        munmap(segment, length);
+        return NULL;
+    }
+
+    segment->length = length;
+    segment->pool_offset = pool_offset;
+    segment->pool_size = size;
+    segment->capacity = capacity;
+    struct block_table table;
+    mem_table_attach(&table, mem_segment_pool(segment), segment->entries, mem_segment_anchors(segment), capacity);
+    mem_table_reset(&table, mem_segment_pool(segment), size);
+    segment->count = table.count;
+    segment->used = 0;
+    segment->root = 0;
+    __atomic_store_n(&segment->magic, MEM_SEGMENT_MAGIC, __ATOMIC_RELEASE);
+    return segment;
+}
+
+
+/**
+ * Checks that the block table of a segment describes the whole pool: at least one and at
+ * most `capacity` entries, each starting where the one before ends, the first at the start
+ * of the pool and the last ending at its end.
+ *
+ * @return 1 if the table is consistent, 0 otherwise.
+ */
+int mem_segment_check(struct mem_segment* segment){
+    if (segment->count == 0 || segment->count > segment->capacity){
+        return 0;
+    }
+    struct block_table table;
+    mem_table_attach(&table, mem_segment_pool(segment), segment->entries, mem_segment_anchors(segment), segment->capacity);
+    table.count = segment->count;
+
+    char* end = mem_segment_pool(segment);
+    for (size_t i = 0; i < table.count; i++){
+        if (mem_table_start(&table, i) != end){
+            return 0;
+        }
+        end += mem_table_size(&table, i);
+    }
+    return end == mem_segment_pool(segment) + segment->pool_size;
+}
+
+
+/**
+ * Maps a segment that another process, or an earlier run, laid out.
+ *
+ * @param fd The file of the segment, opened for reading and writing.
+ * @param reset_lock Whether to set the mutex up again.
+ * @return The segment, or `NULL` if the file holds none or could not be mapped.
+ *
+ * Behavior:
+ * - Waits up to MEM_SEGMENT_ATTACH_TRIES milliseconds for a process that is still creating
+ *   the segment to publish it, unless `reset_lock` says no other process can be.
+ * - Rejects files whose header does not describe a mapping of the file's size.
+ * - Rejects segments marked broken by mem_segment_lock. With `reset_lock`, nobody else can be
+ *   changing the table, so it is checked in full, which also rejects one that a crash left
+ *   half updated.
+ */
+struct mem_segment* mem_segment_attach(int fd, int reset_lock){
+    int attempts = reset_lock ? 1 : MEM_SEGMENT_ATTACH_TRIES;
+    for (int tries = 0; tries < attempts; tries++){
+        if (tries > 0){
+            usleep(1000);
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0){
+            return NULL;
+        }
+        if ((size_t)st.st_size < sizeof(struct mem_segment)){
+            continue; // Not truncated to its size yet
+        }
+
+        struct mem_segment* segment = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (segment == MAP_FAILED){
+            return NULL;
+        }
+        if (__atomic_load_n(&segment->magic, __ATOMIC_ACQUIRE) != MEM_SEGMENT_MAGIC){
+            munmap(segment, st.st_size);
+            continue;
+        }
+        if (segment->length != (uint64_t)st.st_size || segment->pool_offset + segment->pool_size != segment->length
+            || segment->count == 0 || (reset_lock && (!mem_segment_check(segment) || !init_mutex(segment)))){
+            munmap(segment, st.st_size);
+            return NULL;
+        }
+        return segment;
+    }
+    return NULL;
+}
+
+
+/**
+ * Unmaps a segment, leaving the file and everything allocated in it as it is.
+ */
+void mem_segment_unmap(struct mem_segment* segment){
+    munmap(segment, segment->length);
+}
+
+
+/**
+ * Writes the whole segment back to its file and waits for the writes to finish.
+ */
+int mem_segment_sync(struct mem_segment* segment){
+    return msync(segment, segment->length, MS_SYNC) == 0;
+}
+
+
+/**
+ * Locks a segment against every process that maps it.
+ *
+ * @return 1 if the previous owner died holding the lock, 0 otherwise.
+ *
+ * Behavior:
+ * - Marks the mutex consistent again after its owner died, so the segment stays usable.
+ */
+int mem_segment_lock(struct mem_segment* segment){
+    if (pthread_mutex_lock(&segment->mutex) == EOWNERDEAD){
+        pthread_mutex_consistent(&segment->mutex);
+        return 1;
+    }
+    return 0;
+}
+
+
+/**
+ * Unlocks a segment.
+ */
+void mem_segment_unlock(struct mem_segment* segment){
+    pthread_mutex_unlock(&segment->mutex);
+}
@@ -0,0 +1,95 @@
+#ifndef MEM_SEGMENT_H
+#define MEM_SEGMENT_H
+
+#include <pthread.h>
+#include <stddef.h> // For size_t
+#include <stdint.h>
+
+// Pool bytes per block table entry a segment has room for, and the fewest entries it gets
+#define MEM_SEGMENT_BYTES_PER_ENTRY 256
+#define MEM_SEGMENT_MIN_ENTRIES 64
+
+// How often, a millisecond apart, attaching looks for a segment another process is still creating
+#define MEM_SEGMENT_ATTACH_TRIES 1000
+
+
+/**
+ * Start of a mapping that holds a pool together with everything needed to manage it, so
+ * that any process mapping it, at any address, can allocate from it. Nothing in it is a
+ * pointer: the block table anchors hold offsets from the start of the pool, which lies
+ * `pool_offset` bytes into the mapping, page aligned, after the entries and anchors.
+ */
+struct mem_segment{
+    uint64_t magic; // Written last, once the rest is set up
+    uint64_t length; // Of the whole mapping
+    uint64_t pool_offset;
+    uint64_t pool_size;
+    uint64_t capacity; // Block table entries, which never grow
+    uint64_t count; // Entries in use, stored back whenever the lock is released; 0 once marked broken
+    uint64_t used; // Bytes in allocated blocks, stored back with `count`
+    uint64_t root; // Offset of the block set by mem_set_root plus one, 0 for none
+    pthread_mutex_t mutex; // Process-shared and robust
+    uint32_t entries[]; // `capacity` of them, followed by the anchors of the table
+};
+
+
+static inline char* mem_segment_pool(struct mem_segment* segment){
+    return (char*)segment + segment->pool_offset;
+}
+
+// The anchors follow the entries, from the next 8-byte boundary
+static inline uint64_t* mem_segment_anchors(struct mem_segment* segment){
+    return (uint64_t*)(segment->entries + (segment->capacity + 1) / 2 * 2);
+}
+
+
+/**
+ * Lays a new segment out in an empty file and maps it.
+ *
+ * @param fd An empty file opened for reading and writing, such as a new shm_open object.
+ * @param size Size of the pool in bytes.
+ * @return The segment, with the whole pool as one free block, or `NULL` on failure.
+ */
+struct mem_segment* mem_segment_create(int fd, size_t size);
+
+/**
+ * Maps a segment that another process, or an earlier run, laid out.
+ *
+ * @param fd The file of the segment, opened for reading and writing.
+ * @param reset_lock Whether to set the mutex up again, for a segment no other process can hold.
+ * @return The segment, or `NULL` if the file holds none, it is broken, or could not be mapped.
+ */
+struct mem_segment* mem_segment_attach(int fd, int reset_lock);
+
+/**
+ * Checks that the block table of a segment describes the whole pool, block after block.
+ *
+ * @return 1 if the table is consistent, 0 otherwise.
+ */
+int mem_segment_check(struct mem_segment* segment);
+
+/**
+ * Unmaps a segment, leaving the file and everything allocated in it as it is.
+ */
+void mem_segment_unmap(struct mem_segment* segment);
+
+/**
+ * Writes the whole segment back to its file and waits for the writes to finish.
+ *
+ * @return 1 on success, 0 if a write failed.
+ */
+int mem_segment_sync(struct mem_segment* segment);
+
+/**
+ * Locks a segment against every process that maps it.
+ *
+ * @return 1 if the previous owner died holding the lock, so the table may be half updated; 0 otherwise.
+ */
+int mem_segment_lock(struct mem_segment* segment);
+
+/**
+ * Unlocks a segment.
+ */
+void mem_segment_unlock(struct mem_segment* segment);
+
+#endif // MEM_SEGMENT_H
@@ -0,0 +1,152 @@
+// Viktor Fransson DVAMI22h
+
+#include <stdint.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "mem_lock.h"
+#include "mem_spill.h"
+
+// Marks the header of a spilled block
+#define MEM_SPILL_MAGIC 0x5350494c4c4d454dULL
+
+
+/**
+ * Start of the mapping of a spilled block. Live blocks are linked so they can all be
+ * unmapped when the pool goes away.
+ */
+struct spill_header{
+    uint64_t magic;
+    size_t length; // Of the whole mapping
+    struct spill_header* prev;
+    struct spill_header* next;
+};
+
+_Static_assert(sizeof(struct spill_header) <= MEM_SPILL_HEADER, "spill header must fit in front of the block");
+
+
+// Live spilled blocks and the counters, guarded by `spill_lock`
+static struct mem_lock spill_lock = MEM_LOCK_INITIALIZER;
+static struct spill_header* spilled = NULL;
+static size_t spill_count = 0;
+static size_t spill_bytes = 0;
+
+
+/**
+ * Returns the header of a spilled block, or `NULL` if the pointer is not one.
+ *
+ * Behavior:
+ * - Only reads the header of pointers at MEM_SPILL_HEADER bytes into a page, where every
+ *   spilled block starts, so other pointers are rejected without being dereferenced.
+ */
+static struct spill_header* header_of(void* block){
+    uintptr_t page = sysconf(_SC_PAGESIZE);
+    if (block == NULL || ((uintptr_t)block & (page - 1)) != MEM_SPILL_HEADER){
+        return NULL;
+    }
+    struct spill_header* header = (struct spill_header*)((char*)block - MEM_SPILL_HEADER);
+    return header->magic == MEM_SPILL_MAGIC ? header : NULL;
+}
+
+
+/**
+ * Serves a request from a mapping of its own.
+ *
+ * @param size The size of the block to allocate.
+ * @return Pointer to the block, or `NULL` if the mapping failed.
+ *
+ * Behavior:
+ * - Maps the block plus its header, rounded up to whole pages by the kernel.
+ * - Counts the spill and the usable bytes, so the cost of overflowing the pool shows in the stats.
+ */
+void* mem_spill_alloc(size_t size){
+    if (size > SIZE_MAX - MEM_SPILL_HEADER){
+        return NULL;
+    }
+    size_t length = size + MEM_SPILL_HEADER;
+    struct spill_header* header = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (header == MAP_FAILED){
+        return NULL;
+    }
+    header->magic = MEM_SPILL_MAGIC;
+    header->length = length;
+    header->prev = NULL;
+
+    mem_lock_acquire(&spill_lock);
+    header->next = spilled;
+    if (spilled != NULL){
+        spilled->prev = header;
+    }
+    spilled = header;
+    spill_count++;
+    spill_bytes += size;
+    mem_lock_release(&spill_lock);
+
+    return (char*)header + MEM_SPILL_HEADER;
+}
+
+
+/**
+ * Unmaps a spilled block.
+ *
+ * @param block A pointer outside the pool.
+ * @return 1 if the block was spilled and is now freed, 0 otherwise.
+ */
+int mem_spill_free(void* block){
+    struct spill_header* header = header_of(block);
+    if (header == NULL){
+        return 0;
+    }
+
+    mem_lock_acquire(&spill_lock);
+    if (header->prev != NULL){
+        header->prev->next = header->next;
+    }
+    else{
+        spilled = header->next;
+    }
+    if (header->next != NULL){
+        header->next->prev = header->prev;
+    }
+    spill_bytes -= header->length - MEM_SPILL_HEADER;
+    mem_lock_release(&spill_lock);
+
+    munmap(header, header->length);
+    return 1;
+}
+
+
+/**
+ * Returns the usable size of a spilled block, or 0 if the block was not spilled.
+ */
+size_t mem_spill_size(void* block){
+    struct spill_header* header = header_of(block);
+    return header != NULL ? header->length - MEM_SPILL_HEADER : 0;
+}
+
+
+/**
+ * Unmaps every spilled block at once and clears the counters.
+ */
+void mem_spill_release_all(){
+    mem_lock_acquire(&spill_lock);
+    while (spilled != NULL){
+        struct spill_header* next = spilled->next;
+        munmap(spilled, spilled->length);
+        spilled = next;
+    }
+    spill_count = 0;
+    spill_bytes = 0;
+    mem_lock_release(&spill_lock);
+}
+
+
+/**
+ * Reports how often requests spilled and how much spilled memory is live.
+ */
+void mem_spill_stats(size_t* count, size_t* bytes){
+    mem_lock_acquire(&spill_lock);
+    *count = spill_count;
+    *bytes = spill_bytes;
+    mem_lock_release(&spill_lock);
+}
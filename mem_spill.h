@@ -0,0 +1,48 @@
+#ifndef MEM_SPILL_H
+#define MEM_SPILL_H
+
+#include <stddef.h> // For size_t
+
+// Bytes in front of every spilled block, which keeps it aligned to a cache line
+#define MEM_SPILL_HEADER 64
+
+
+/**
+ * Serves a request the pool could not from a mapping of its own. The mapping starts with
+ * a header that tags it, so a spilled block is recognized and freed in O(1).
+ *
+ * @param size The size of the block to allocate.
+ * @return Pointer to the block, or `NULL` if the mapping failed.
+ */
+void* mem_spill_alloc(size_t size);
+
+/**
+ * Unmaps a spilled block.
+ *
+ * @param block A pointer outside the pool.
+ * @return 1 if the block was spilled and is now freed, 0 otherwise.
+ */
+int mem_spill_free(void* block);
+
+/**
+ * Returns the usable size of a spilled block.
+ *
+ * @param block A pointer outside the pool.
+ * @return The size, or 0 if the block was not spilled.
+ */
+size_t mem_spill_size(void* block);
+
+/**
+ * Unmaps every spilled block at once.
+ */
+void mem_spill_release_all();
+
+/**
+ * Reports how often requests spilled and how much spilled memory is live.
+ *
+ * @param count Set to the number of spilled allocations since the last mem_spill_release_all.
+ * @param bytes Set to the usable bytes of the spilled blocks that are still allocated.
+ */
+void mem_spill_stats(size_t* count, size_t* bytes);
+
+#endif // MEM_SPILL_H
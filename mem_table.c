@@ -0,0 +1,489 @@
+// Viktor Fransson DVAMI22h
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mem_table.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define MEM_TABLE_X86 1
+#endif
+
+
+typedef size_t (*fit_kernel_t)(const uint32_t* entries, size_t count, uint32_t wanted);
+
+// Kernel used by mem_table_find_fit, picked once by select_kernel
+static fit_kernel_t fit_kernel = NULL;
+static pthread_once_t kernel_once = PTHREAD_ONCE_INIT;
+
+
+static size_t find_fit_plain(const uint32_t* entries, size_t count, uint32_t wanted){
+    for (size_t i = 0; i < count; i++){
+        if (entries[i] >= wanted){
+            return i;
+        }
+    }
+    return count;
+}
+
+
+#ifdef MEM_TABLE_X86
+
+__attribute__((target("avx512f")))
+static size_t find_fit_avx512(const uint32_t* entries, size_t count, uint32_t wanted){
+    __m512i limit = _mm512_set1_epi32((int)wanted);
+    size_t i = 0;
+
+    for (; i + 32 <= count; i += 32){
+        __mmask16 low = _mm512_cmpge_epu32_mask(_mm512_loadu_si512((const void*)(entries + i)), limit);
+        __mmask16 high = _mm512_cmpge_epu32_mask(_mm512_loadu_si512((const void*)(entries + i + 16)), limit);
+        unsigned int mask = low | ((unsigned int)high << 16);
+        if (mask != 0){
+            return i + __builtin_ctz(mask);
+        }
+    }
+    return i + find_fit_plain(entries + i, count - i, wanted);
+}
+
+
+/**
+ * AVX2 only compares signed 32-bit integers. Flipping the sign bit of both sides turns
+ * the unsigned `entry >= wanted` into the signed `entry ^ sign > (wanted - 1) ^ sign`.
+ */
+__attribute__((target("avx2")))
+static size_t find_fit_avx2(const uint32_t* entries, size_t count, uint32_t wanted){
+    __m256i sign = _mm256_set1_epi32((int)MEM_TABLE_FREE_BIT);
+    __m256i limit = _mm256_set1_epi32((int)((wanted - 1) ^ MEM_TABLE_FREE_BIT));
+    size_t i = 0;
+
+    for (; i + 16 <= count; i += 16){
+        __m256i low = _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)(entries + i)), sign);
+        __m256i high = _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)(entries + i + 8)), sign);
+        unsigned int mask = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(low, limit)))
+                          | (_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(high, limit))) << 8);
+        if (mask != 0){
+            return i + __builtin_ctz(mask);
+        }
+    }
+    return i + find_fit_plain(entries + i, count - i, wanted);
+}
+
+#endif // MEM_TABLE_X86
+
+
+/**
+ * Picks the widest compare the CPU and OS support.
+ */
+static void select_kernel(){
+    fit_kernel = find_fit_plain;
+
+#ifdef MEM_TABLE_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")){
+        fit_kernel = find_fit_avx512;
+    }
+    else if (__builtin_cpu_supports("avx2")){
+        fit_kernel = find_fit_avx2;
+    }
+#endif
+}
+
+
+/**
+ * Resizes the entries and anchors of a table to hold `capacity` entries.
+ *
+ * @return 1 on success, 0 if an allocation failed, leaving the table as it was.
+ */
+static int grow(struct block_table* table, size_t capacity){
+    if (table->external){
+        return 0;
+    }
+    uint32_t* entries = (uint32_t*)realloc(table->entries, capacity * sizeof(uint32_t));
+    if (entries == NULL){
+        return 0;
+    }
+    table->entries = entries;
+    uint64_t* anchors = (uint64_t*)realloc(table->anchors, mem_table_anchor_count(capacity) * sizeof(uint64_t));
+    if (anchors == NULL){
+        return 0;
+    }
+    table->anchors = anchors;
+    table->capacity = capacity;
+    return 1;
+}
+
+
+// Bytes from `base` to `ptr`, and 0 below `base`
+static size_t offset_at(const struct block_table* table, const void* ptr){
+    return (const char*)ptr > table->base ? (size_t)((const char*)ptr - table->base) : 0;
+}
+
+
+/**
+ * Allocates the entries of a table and fills it with free space.
+ *
+ * @return 1 on success, 0 if the entries or the tree could not be allocated.
+ */
+int mem_table_init(struct block_table* table, char* base, char* start, size_t size, int ordered){
+    pthread_once(&kernel_once, select_kernel);
+
+    *table = (struct block_table){0};
+    table->base = base;
+    if (!grow(table, MEM_TABLE_INITIAL_CAPACITY)){
+        mem_table_destroy(table);
+        return 0;
+    }
+    if (ordered && !mem_tree_init(&table->tree)){
+        mem_table_destroy(table);
+        return 0;
+    }
+    mem_table_reset(table, start, size);
+    return 1;
+}
+
+
+/**
+ * Makes a table of entries and anchors that live elsewhere.
+ *
+ * Behavior:
+ * - Keeps no tree, whose nodes would have to live with the entries.
+ * - Fails inserts into a full table, as if growing had failed.
+ */
+void mem_table_attach(struct block_table* table, char* base, uint32_t* entries, uint64_t* anchors, size_t capacity){
+    pthread_once(&kernel_once, select_kernel);
+
+    *table = (struct block_table){0};
+    table->base = base;
+    table->entries = entries;
+    table->anchors = anchors;
+    table->capacity = capacity;
+    table->external = 1;
+}
+
+
+/**
+ * Empties a table down to free space of `size` bytes in O(1), keeping its entries.
+ *
+ * Behavior:
+ * - Splits the space into free blocks of MEM_TABLE_MAX_BLOCK bytes and one of the rest,
+ *   at most MEM_TABLE_MAX_SPLIT of them, which fit into any table.
+ */
+void mem_table_reset(struct block_table* table, char* start, size_t size){
+    table->anchors[0] = (uint64_t)(start - table->base);
+    table->count = 0;
+    table->used = 0;
+    if (table->tree.nodes != NULL){
+        mem_tree_clear(&table->tree);
+    }
+
+    size_t offset = table->anchors[0];
+    do{
+        size_t part = size < MEM_TABLE_MAX_BLOCK ? size : MEM_TABLE_MAX_BLOCK;
+        table->entries[table->count++] = MEM_TABLE_FREE_BIT | (uint32_t)part;
+        if (table->tree.nodes != NULL){
+            mem_tree_insert(&table->tree, offset, (uint32_t)part); // The first nodes always fit
+        }
+        offset += part;
+        size -= part;
+    } while (size > 0);
+    if (table->count == MEM_TABLE_ANCHOR_STRIDE){ // Only the end of the table lies past the first anchor
+        table->anchors[1] = offset;
+    }
+}
+
+
+/**
+ * Frees the entries of a table.
+ */
+void mem_table_destroy(struct block_table* table){
+    if (!table->external){
+        free(table->entries);
+        free(table->anchors);
+    }
+    mem_tree_destroy(&table->tree);
+    *table = (struct block_table){0};
+}
+
+
+/**
+ * Updates the tree of an ordered table for an entry at `old_offset` that changes from
+ * `old_entry` to `new_entry` at `new_offset`.
+ *
+ * Behavior:
+ * - Removes the old block from the tree if it was free and adds the new one if it is free.
+ * - Drops the tree if it cannot grow, so the table falls back to scanning instead of
+ *   working from a tree that misses blocks.
+ */
+static void track(struct block_table* table, uint32_t old_entry, size_t old_offset, uint32_t new_entry, size_t new_offset){
+    if (old_entry & MEM_TABLE_FREE_BIT){
+        mem_tree_remove(&table->tree, old_offset);
+    }
+    if ((new_entry & MEM_TABLE_FREE_BIT) && !mem_tree_insert(&table->tree, new_offset, new_entry & ~MEM_TABLE_FREE_BIT)){
+        mem_tree_destroy(&table->tree);
+    }
+}
+
+
+/**
+ * Adds `bytes`, negative for a decrease, to the allocated bytes of a table.
+ */
+static void count_used(struct block_table* table, ptrdiff_t bytes){
+    table->used += bytes;
+}
+
+
+/**
+ * Writes entry `index`, keeping the tree and the counts of allocated bytes in step but not the anchors.
+ */
+static void store(struct block_table* table, size_t index, size_t old_offset, uint32_t entry, size_t offset){
+    if (table->tree.nodes != NULL){
+        track(table, table->entries[index], old_offset, entry, offset);
+    }
+    count_used(table, (ptrdiff_t)mem_table_entry_used(entry) - (ptrdiff_t)mem_table_entry_used(table->entries[index]));
+    table->entries[index] = entry;
+}
+
+
+/**
+ * Moves the anchors from group `first` to the end of the table by `delta` bytes,
+ * which wraps around for negative moves.
+ */
+static void shift_anchors(struct block_table* table, size_t first, uint64_t delta){
+    for (size_t g = first; g <= table->count / MEM_TABLE_ANCHOR_STRIDE; g++){
+        table->anchors[g] += delta;
+    }
+}
+
+
+/**
+ * Sets entry `index` to a block of `size` bytes.
+ *
+ * Behavior:
+ * - Takes `start` as the new start of the table for entry 0, and for the tree otherwise.
+ * - Moves the anchors after the entry by the change of its end, in O(count / MEM_TABLE_ANCHOR_STRIDE).
+ */
+void mem_table_put(struct block_table* table, size_t index, char* start, size_t size, int free){
+    uint32_t entry = (free ? MEM_TABLE_FREE_BIT : 0) | (uint32_t)size;
+    size_t offset = (size_t)(start - table->base);
+    size_t old_offset = index == 0 ? table->anchors[0] : offset;
+    uint64_t delta = (uint64_t)(offset + size - old_offset - mem_table_size(table, index));
+
+    store(table, index, old_offset, entry, offset);
+    if (index == 0){
+        table->anchors[0] = offset;
+    }
+    if (delta != 0){
+        shift_anchors(table, index / MEM_TABLE_ANCHOR_STRIDE + 1, delta);
+    }
+}
+
+
+/**
+ * Inserts a block before entry `index`.
+ *
+ * @return 1 on success, 0 if the table could not grow.
+ *
+ * Behavior:
+ * - Doubles the capacity when the table is full.
+ * - Moves the entries from `index` on up by one, which costs O(count - index), and the
+ *   anchors after it along with them.
+ */
+int mem_table_insert(struct block_table* table, size_t index, char* start, size_t size, int free){
+    if (table->count == table->capacity && !grow(table, table->capacity * 2)){
+        return 0;
+    }
+
+    uint32_t entry = (free ? MEM_TABLE_FREE_BIT : 0) | (uint32_t)size;
+    size_t offset = (size_t)(start - table->base);
+    size_t end = mem_table_offset(table, table->count);
+    uint64_t delta = size; // How far the entries from `index` on move
+    if (index == 0){
+        delta = offset + size - table->anchors[0];
+        table->anchors[0] = offset;
+    }
+
+    // Anchor g moves to the entry before the one it marked, which has moved by `delta`
+    size_t last = (table->count + 1) / MEM_TABLE_ANCHOR_STRIDE;
+    for (size_t g = index / MEM_TABLE_ANCHOR_STRIDE + 1; g <= last; g++){
+        size_t before = g * MEM_TABLE_ANCHOR_STRIDE - 1;
+        size_t moved = before < table->count ? table->anchors[g] - mem_table_size(table, before) : end;
+        table->anchors[g] = moved + delta;
+    }
+
+    memmove(table->entries + index + 1, table->entries + index, (table->count - index) * sizeof(uint32_t));
+    table->entries[index] = 0; // Allocated, so the tree has nothing to remove
+    table->count++;
+    store(table, index, 0, entry, offset);
+    return 1;
+}
+
+
+/**
+ * Removes `n` entries starting at `index`, moving the ones after them down.
+ */
+void mem_table_remove(struct block_table* table, size_t index, size_t n){
+    size_t offset = mem_table_offset(table, index);
+    size_t removed = 0;
+    for (size_t i = index; i < index + n; i++){
+        count_used(table, -(ptrdiff_t)mem_table_entry_used(table->entries[i]));
+        if (table->tree.nodes != NULL){
+            track(table, table->entries[i], offset + removed, 0, 0);
+        }
+        removed += mem_table_size(table, i);
+    }
+    if (index == 0){ // The table starts where the removed entries ended
+        table->anchors[0] += removed;
+        removed = 0;
+    }
+
+    // Anchor g moves to the entry `n` after the one it marked, less what was removed before it
+    size_t first = (index + MEM_TABLE_ANCHOR_STRIDE - 1) / MEM_TABLE_ANCHOR_STRIDE;
+    for (size_t g = first > 0 ? first : 1; g <= (table->count - n) / MEM_TABLE_ANCHOR_STRIDE; g++){
+        size_t moved = table->anchors[g];
+        for (size_t i = g * MEM_TABLE_ANCHOR_STRIDE; i < g * MEM_TABLE_ANCHOR_STRIDE + n; i++){
+            moved += mem_table_size(table, i);
+        }
+        table->anchors[g] = moved - removed;
+    }
+
+    memmove(table->entries + index, table->entries + index + n, (table->count - index - n) * sizeof(uint32_t));
+    table->count -= n;
+}
+
+
+/**
+ * Returns the index of the first entry starting at or after `ptr`.
+ *
+ * Behavior:
+ * - Binary searches the anchors, then sums sizes from the last one before `ptr`.
+ */
+static size_t lower_bound(const struct block_table* table, const void* ptr){
+    size_t target = offset_at(table, ptr);
+    if (table->anchors[0] >= target){
+        return 0;
+    }
+
+    size_t low = 0; // Last group known to start before `target`
+    size_t high = table->count / MEM_TABLE_ANCHOR_STRIDE + 1;
+    while (high - low > 1){
+        size_t mid = low + (high - low) / 2;
+        if (table->anchors[mid] < target){
+            low = mid;
+        }
+        else{
+            high = mid;
+        }
+    }
+
+    size_t i = low * MEM_TABLE_ANCHOR_STRIDE;
+    size_t offset = table->anchors[low];
+    while (i < table->count && offset < target){
+        offset += mem_table_size(table, i);
+        i++;
+    }
+    return i;
+}
+
+
+/**
+ * Finds the first free block of at least `size` bytes.
+ *
+ * @return Its index, or `table->count` if there is none.
+ *
+ * Behavior:
+ * - Walks the tree of an ordered table and looks the block up by address, both O(log n).
+ * - Otherwise compares 32 entries per loop iteration with AVX-512, 16 with AVX2, or one at a time.
+ */
+size_t mem_table_find_fit(const struct block_table* table, size_t size){
+    if (size > MEM_TABLE_MAX_BLOCK){
+        return table->count;
+    }
+    uint32_t wanted = (uint32_t)size;
+
+    if (table->tree.nodes != NULL){
+        uint64_t offset;
+        if (!mem_tree_first_fit(&table->tree, wanted, &offset)){
+            return table->count;
+        }
+        size_t i = lower_bound(table, table->base + offset);
+        while (i < table->count && !mem_table_is_free(table, i)){ // Zero sized blocks can share the address
+            i++;
+        }
+        return i;
+    }
+    return fit_kernel(table->entries, table->count, MEM_TABLE_FREE_BIT | wanted);
+}
+
+
+/**
+ * Finds the first free block of at least `size` bytes among the `window` entries after `ptr`.
+ *
+ * @return Its index, or `table->count` if there is none.
+ *
+ * Behavior:
+ * - Looks up the first entry starting after `ptr` through the anchors, then runs the scan kernel
+ *   over the window only, so the cost does not grow with the table. Ordered tables scan the same way.
+ */
+size_t mem_table_find_fit_after(const struct block_table* table, const void* ptr, size_t size, size_t window){
+    if (size > MEM_TABLE_MAX_BLOCK){
+        return table->count;
+    }
+
+    size_t first = lower_bound(table, (const char*)ptr + 1);
+    size_t count = table->count - first < window ? table->count - first : window;
+    size_t i = fit_kernel(table->entries + first, count, MEM_TABLE_FREE_BIT | (uint32_t)size);
+    return i < count ? first + i : table->count;
+}
+
+
+/**
+ * Finds the last free block of at least `size` bytes.
+ *
+ * @return Its index, or `table->count` if there is none.
+ *
+ * Behavior:
+ * - Scans down from the end with the same single comparison per entry as the forward scan.
+ *   Placing blocks from the top keeps them away from first fit ones, which is all it is for,
+ *   so ordered tables scan too rather than keeping a second tree.
+ */
+size_t mem_table_find_last_fit(const struct block_table* table, size_t size){
+    if (size > MEM_TABLE_MAX_BLOCK){
+        return table->count;
+    }
+
+    uint32_t wanted = MEM_TABLE_FREE_BIT | (uint32_t)size;
+    for (size_t i = table->count; i > 0; i--){
+        if (table->entries[i - 1] >= wanted){
+            return i - 1;
+        }
+    }
+    return table->count;
+}
+
+
+/**
+ * Finds the allocated block starting at `ptr`.
+ *
+ * @return Its index, or `table->count` if there is none.
+ *
+ * Behavior:
+ * - Looks up the first entry starting at `ptr`, then skips free entries,
+ *   since zero sized blocks share their start with the block after them.
+ */
+size_t mem_table_find(const struct block_table* table, const void* ptr){
+    size_t i = lower_bound(table, ptr);
+    if (i == table->count || mem_table_start(table, i) != (const char*)ptr){
+        return table->count;
+    }
+    for (; i < table->count; i++){
+        if (!mem_table_is_free(table, i)){
+            return i;
+        }
+        if (mem_table_size(table, i) != 0){ // The next entry starts later
+            break;
+        }
+    }
+    return table->count;
+}
@@ -0,0 +1,175 @@
+#ifndef MEM_TABLE_H
+#define MEM_TABLE_H
+
+#include <stddef.h> // For size_t
+#include <stdint.h>
+
+#include "mem_tree.h"
+
+// Entries a block table has room for before it first grows
+#define MEM_TABLE_INITIAL_CAPACITY 64
+
+// Largest block one entry can describe: 31 bits of size in bytes
+#define MEM_TABLE_MAX_BLOCK ((size_t)INT32_MAX)
+
+// Largest span a table can describe, which an empty table holds as this many free blocks at most
+#define MEM_TABLE_MAX_SPLIT 16
+#define MEM_TABLE_MAX_SIZE (MEM_TABLE_MAX_SPLIT * MEM_TABLE_MAX_BLOCK)
+
+// Every this many entries the table stores where the next one starts
+#define MEM_TABLE_ANCHOR_STRIDE 16
+
+#define MEM_TABLE_FREE_BIT ((uint32_t)1 << 31)
+
+
+/**
+ * The blocks of one pool region, ordered by address, packed in 4 bytes each.
+ *
+ * An entry holds the free flag in bit 31 and the size in bytes in bits 0-30. Since the flag
+ * is the top bit, "free and at least n bytes" is the single unsigned comparison
+ * `entry >= FREE_BIT | n`, which the scan does for several entries per instruction. Blocks
+ * follow each other without gaps, so an entry needs no offset: a block starts where the one
+ * before it ends. To find that without summing the whole table, `anchors` holds the byte
+ * offset from `base` of every MEM_TABLE_ANCHOR_STRIDE-th entry, the first being where the
+ * table starts, which adds half a byte per block. Free space of more than MEM_TABLE_MAX_BLOCK
+ * bytes takes several free entries in a row.
+ *
+ * An ordered table also keeps its free blocks in a tree keyed by address, which finds the
+ * first fit in O(log n) instead of scanning. All changes must then go through the functions
+ * below, which keep the tree and the anchors in step.
+ */
+struct block_table{
+    char* base; // Start of the pool, which offsets are relative to
+    uint32_t* entries;
+    uint64_t* anchors; // MEM_TABLE_ANCHOR_STRIDE entries apart, at least one even for an empty table
+    size_t count;
+    size_t capacity;
+    struct free_tree tree; // Only used while `tree.nodes` is not NULL
+    int external; // The entries belong to the caller and never grow, see mem_table_attach
+    size_t used; // Bytes in allocated blocks
+};
+
+
+// Anchors a table of `capacity` entries needs
+static inline size_t mem_table_anchor_count(size_t capacity){
+    return capacity / MEM_TABLE_ANCHOR_STRIDE + 1;
+}
+
+static inline size_t mem_table_entry_size(uint32_t entry){
+    return entry & ~MEM_TABLE_FREE_BIT;
+}
+
+static inline size_t mem_table_size(const struct block_table* table, size_t index){
+    return mem_table_entry_size(table->entries[index]);
+}
+
+static inline int mem_table_is_free(const struct block_table* table, size_t index){
+    return (table->entries[index] & MEM_TABLE_FREE_BIT) != 0;
+}
+
+// Bytes an entry adds to `used`: its size if allocated, 0 if free
+static inline size_t mem_table_entry_used(uint32_t entry){
+    return (entry & MEM_TABLE_FREE_BIT) ? 0 : mem_table_entry_size(entry);
+}
+
+/**
+ * Returns the offset from `base` where entry `index` starts, which may be `count` for the end
+ * of the table. Sums at most MEM_TABLE_ANCHOR_STRIDE - 1 sizes after the nearest anchor.
+ */
+static inline size_t mem_table_offset(const struct block_table* table, size_t index){
+    size_t offset = table->anchors[index / MEM_TABLE_ANCHOR_STRIDE];
+    for (size_t i = index - index % MEM_TABLE_ANCHOR_STRIDE; i < index; i++){
+        offset += table->entries[i] & ~MEM_TABLE_FREE_BIT;
+    }
+    return offset;
+}
+
+static inline char* mem_table_start(const struct block_table* table, size_t index){
+    return table->base + mem_table_offset(table, index);
+}
+
+/**
+ * Sets entry `index` to a block of `size` bytes, at most MEM_TABLE_MAX_BLOCK.
+ * `start` only moves the table for entry 0; any other entry starts where the one before ends.
+ * The entries after it keep their sizes and move by as much as its end does.
+ */
+void mem_table_put(struct block_table* table, size_t index, char* start, size_t size, int free);
+
+static inline void mem_table_set(struct block_table* table, size_t index, size_t size, int free){
+    mem_table_put(table, index, mem_table_start(table, index), size, free);
+}
+
+
+/**
+ * Allocates the entries of a table and fills it with free space, see mem_table_reset.
+ *
+ * @param base Start of the pool. Blocks must lie within MEM_TABLE_MAX_SIZE bytes of it.
+ * @param ordered Whether to keep the free blocks in a tree for O(log n) first fit.
+ * @return 1 on success, 0 if the entries could not be allocated.
+ */
+int mem_table_init(struct block_table* table, char* base, char* start, size_t size, int ordered);
+
+/**
+ * Makes a table of entries and anchors that live elsewhere, such as in a mapping shared with
+ * other processes. `anchors` has room for mem_table_anchor_count(capacity) of them, and
+ * `capacity` is at least MEM_TABLE_MAX_SPLIT. The table never grows past `capacity` and
+ * leaves both alone when destroyed; the caller sets `count`.
+ */
+void mem_table_attach(struct block_table* table, char* base, uint32_t* entries, uint64_t* anchors, size_t capacity);
+
+/**
+ * Empties a table down to free space of `size` bytes, at most MEM_TABLE_MAX_SIZE, keeping its
+ * entries. That is a single free block unless it is larger than MEM_TABLE_MAX_BLOCK. The running
+ * total is left alone, it is the caller's to clear.
+ */
+void mem_table_reset(struct block_table* table, char* start, size_t size);
+
+/**
+ * Frees the entries of a table.
+ */
+void mem_table_destroy(struct block_table* table);
+
+/**
+ * Inserts a block before entry `index`, growing the table if needed. As with mem_table_put,
+ * `start` only counts for entry 0, and the entries after the new one move by its size.
+ *
+ * @return 1 on success, 0 if the table could not grow.
+ */
+int mem_table_insert(struct block_table* table, size_t index, char* start, size_t size, int free);
+
+/**
+ * Removes `n` entries starting at `index`. The entries after them move down by their sizes,
+ * except when they are the first ones: then the table starts that much later instead.
+ */
+void mem_table_remove(struct block_table* table, size_t index, size_t n);
+
+/**
+ * Finds the first free block of at least `size` bytes.
+ *
+ * @return Its index, or `table->count` if there is none.
+ */
+size_t mem_table_find_fit(const struct block_table* table, size_t size);
+
+/**
+ * Finds the first free block of at least `size` bytes that starts after `ptr`, looking at
+ * no more than `window` entries.
+ *
+ * @return Its index, or `table->count` if there is none.
+ */
+size_t mem_table_find_fit_after(const struct block_table* table, const void* ptr, size_t size, size_t window);
+
+/**
+ * Finds the last free block of at least `size` bytes, scanning down from the end.
+ *
+ * @return Its index, or `table->count` if there is none.
+ */
+size_t mem_table_find_last_fit(const struct block_table* table, size_t size);
+
+/**
+ * Finds the allocated block starting at `ptr` with a binary search.
+ *
+ * @return Its index, or `table->count` if there is none.
+ */
+size_t mem_table_find(const struct block_table* table, const void* ptr);
+
+#endif // MEM_TABLE_H
@@ -0,0 +1,223 @@
+// Viktor Fransson DVAMI22h
+
+#include <stdlib.h>
+
+#include "mem_tree.h"
+
+// Nodes a tree has room for before it first grows
+#define MEM_TREE_INITIAL_CAPACITY 64
+
+
+struct tree_node{
+    uint64_t offset;
+    uint32_t size;
+    uint32_t max; // Largest size in the subtree
+    uint32_t priority; // Heap order, random so the expected depth is O(log n)
+    uint32_t left;
+    uint32_t right;
+};
+
+
+static inline uint32_t subtree_max(const struct free_tree* tree, uint32_t node){
+    return node == MEM_TREE_NONE ? 0 : tree->nodes[node].max;
+}
+
+static void update(struct free_tree* tree, uint32_t node){
+    struct tree_node* n = &tree->nodes[node];
+    uint32_t max = n->size;
+    uint32_t left = subtree_max(tree, n->left);
+    uint32_t right = subtree_max(tree, n->right);
+    if (left > max){
+        max = left;
+    }
+    if (right > max){
+        max = right;
+    }
+    n->max = max;
+}
+
+
+/**
+ * Returns the next priority from a xorshift generator.
+ */
+static uint32_t next_priority(struct free_tree* tree){
+    uint32_t x = tree->seed;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    tree->seed = x;
+    return x;
+}
+
+
+/**
+ * Splits a subtree into the nodes with offsets below `offset` and the rest.
+ */
+static void split(struct free_tree* tree, uint32_t node, uint64_t offset, uint32_t* below, uint32_t* rest){
+    if (node == MEM_TREE_NONE){
+        *below = MEM_TREE_NONE;
+        *rest = MEM_TREE_NONE;
+        return;
+    }
+
+    struct tree_node* n = &tree->nodes[node];
+    if (n->offset < offset){
+        split(tree, n->right, offset, &n->right, rest);
+        *below = node;
+    }
+    else{
+        split(tree, n->left, offset, below, &n->left);
+        *rest = node;
+    }
+    update(tree, node);
+}
+
+
+/**
+ * Joins two subtrees where every offset in `left` is below every offset in `right`.
+ */
+static uint32_t merge(struct free_tree* tree, uint32_t left, uint32_t right){
+    if (left == MEM_TREE_NONE){
+        return right;
+    }
+    if (right == MEM_TREE_NONE){
+        return left;
+    }
+
+    if (tree->nodes[left].priority > tree->nodes[right].priority){
+        tree->nodes[left].right = merge(tree, tree->nodes[left].right, right);
+        update(tree, left);
+        return left;
+    }
+    tree->nodes[right].left = merge(tree, left, tree->nodes[right].left);
+    update(tree, right);
+    return right;
+}
+
+
+/**
+ * Creates an empty tree.
+ *
+ * @return 1 on success, 0 if the node array could not be allocated.
+ */
+int mem_tree_init(struct free_tree* tree){
+    tree->nodes = (struct tree_node*)malloc(MEM_TREE_INITIAL_CAPACITY * sizeof(struct tree_node));
+    if (tree->nodes == NULL){
+        return 0;
+    }
+    tree->capacity = MEM_TREE_INITIAL_CAPACITY;
+    tree->seed = 2463534242u;
+    mem_tree_clear(tree);
+    return 1;
+}
+
+
+/**
+ * Removes every block in O(1), keeping the node array.
+ */
+void mem_tree_clear(struct free_tree* tree){
+    tree->used = 0;
+    tree->free_nodes = MEM_TREE_NONE;
+    tree->root = MEM_TREE_NONE;
+}
+
+
+/**
+ * Frees the node array.
+ */
+void mem_tree_destroy(struct free_tree* tree){
+    free(tree->nodes);
+    tree->nodes = NULL;
+    tree->capacity = 0;
+    mem_tree_clear(tree);
+}
+
+
+/**
+ * Adds a free block.
+ *
+ * @return 1 on success, 0 if the node array could not grow.
+ *
+ * Behavior:
+ * - Reuses a released node if there is one, otherwise takes the next one from the array,
+ *   doubling it when it is full.
+ */
+int mem_tree_insert(struct free_tree* tree, uint64_t offset, uint32_t size){
+    uint32_t node = tree->free_nodes;
+    if (node != MEM_TREE_NONE){
+        tree->free_nodes = tree->nodes[node].left;
+    }
+    else{
+        if (tree->used == tree->capacity){
+            struct tree_node* nodes = (struct tree_node*)realloc(tree->nodes, 2 * (size_t)tree->capacity * sizeof(struct tree_node));
+            if (nodes == NULL){
+                return 0;
+            }
+            tree->nodes = nodes;
+            tree->capacity *= 2;
+        }
+        node = tree->used++;
+    }
+
+    tree->nodes[node] = (struct tree_node){offset, size, size, next_priority(tree), MEM_TREE_NONE, MEM_TREE_NONE};
+
+    uint32_t below, rest;
+    split(tree, tree->root, offset, &below, &rest);
+    tree->root = merge(tree, merge(tree, below, node), rest);
+    return 1;
+}
+
+
+/**
+ * Removes the free block at `offset`, if there is one, and releases its node.
+ */
+void mem_tree_remove(struct free_tree* tree, uint64_t offset){
+    uint32_t below, rest, match, above;
+    split(tree, tree->root, offset, &below, &rest);
+    split(tree, rest, offset + 1, &match, &above); // Offsets are unique, so `match` is one node at most
+
+    if (match != MEM_TREE_NONE){
+        tree->nodes[match].left = tree->free_nodes;
+        tree->free_nodes = match;
+    }
+    tree->root = merge(tree, below, above);
+}
+
+
+/**
+ * Finds the free block with the lowest offset that has at least `size` bytes.
+ *
+ * @param offset Set to the offset of the block if there is one.
+ * @return 1 if a block was found, 0 otherwise.
+ *
+ * Behavior:
+ * - Walks down from the root, going left whenever the left subtree has a large enough block.
+ */
+int mem_tree_first_fit(const struct free_tree* tree, uint32_t size, uint64_t* offset){
+    uint32_t node = tree->root;
+    if (node == MEM_TREE_NONE || tree->nodes[node].max < size){
+        return 0;
+    }
+
+    while (1){
+        const struct tree_node* n = &tree->nodes[node];
+        if (n->left != MEM_TREE_NONE && tree->nodes[n->left].max >= size){
+            node = n->left;
+        }
+        else if (n->size >= size){
+            *offset = n->offset;
+            return 1;
+        }
+        else{
+            node = n->right;
+        }
+    }
+}
+
+
+/**
+ * Returns the bytes allocated for nodes, including spare room.
+ */
+size_t mem_tree_reserved_bytes(const struct free_tree* tree){
+    return (size_t)tree->capacity * sizeof(struct tree_node);
+}
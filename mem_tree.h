@@ -0,0 +1,72 @@
+#ifndef MEM_TREE_H
+#define MEM_TREE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// No node, used for empty links
+#define MEM_TREE_NONE UINT32_MAX
+
+
+struct tree_node;
+
+/**
+ * Free blocks keyed by address in a treap, each subtree knowing the largest block in it,
+ * so the free block with the lowest address that is large enough is found in O(log n).
+ *
+ * Blocks are given as 64-bit byte offsets and 32-bit sizes, like block table entries. Nodes
+ * live in one array that grows by doubling and are linked by index.
+ */
+struct free_tree{
+    struct tree_node* nodes;
+    uint32_t capacity;
+    uint32_t used; // Nodes handed out from the array so far
+    uint32_t free_nodes; // Released nodes, linked through `left`
+    uint32_t root;
+    uint32_t seed; // State of the priority generator
+};
+
+
+/**
+ * Creates an empty tree.
+ *
+ * @return 1 on success, 0 if the node array could not be allocated.
+ */
+int mem_tree_init(struct free_tree* tree);
+
+/**
+ * Removes every block, keeping the node array.
+ */
+void mem_tree_clear(struct free_tree* tree);
+
+/**
+ * Frees the node array.
+ */
+void mem_tree_destroy(struct free_tree* tree);
+
+/**
+ * Adds a free block. Offsets must be unique.
+ *
+ * @return 1 on success, 0 if the node array could not grow.
+ */
+int mem_tree_insert(struct free_tree* tree, uint64_t offset, uint32_t size);
+
+/**
+ * Removes the free block at `offset`, if there is one.
+ */
+void mem_tree_remove(struct free_tree* tree, uint64_t offset);
+
+/**
+ * Finds the free block with the lowest offset that has at least `size` bytes.
+ *
+ * @param offset Set to the offset of the block if there is one.
+ * @return 1 if a block was found, 0 otherwise.
+ */
+int mem_tree_first_fit(const struct free_tree* tree, uint32_t size, uint64_t* offset);
+
+/**
+ * Returns the bytes allocated for nodes, including spare room.
+ */
+size_t mem_tree_reserved_bytes(const struct free_tree* tree);
+
+#endif // MEM_TREE_H
@@ -1,154 +1,2106 @@
 // Viktor Fransson DVAMI22h
 
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 #include "memory_manager.h"
+#include "mem_bitmap.h"
+#include "mem_class.h"
+#include "mem_combine.h"
+#include "mem_copy.h"
+#include "mem_count.h"
+#include "mem_handle.h"
+#include "mem_internal.h"
+#include "mem_lock.h"
+#include "mem_mag.h"
+#include "mem_maint.h"
+#include "mem_segment.h"
+#include "mem_spill.h"
+#include "mem_table.h"
+
+
+// Pre-faulting splits the pool into chunks of at least this size, one per thread
+#define MEM_PREFAULT_CHUNK (4 * 1024 * 1024)
+#define MEM_PREFAULT_MAX_THREADS 16
+
+// Free space smaller than this is left inside the allocated block instead of becoming its own block
+#define MEM_MIN_SPLIT 16
+
+
+// Pool size used when the first allocation arrives before mem_init
+#ifndef MEM_DEFAULT_POOL_SIZE
+#define MEM_DEFAULT_POOL_SIZE (64 * 1024 * 1024)
+#endif
+
+// Number of regions a MEM_INIT_STRIPED pool is split into, halved until each has MEM_MIN_REGION_SIZE bytes
+#define MEM_REGIONS 16
+#define MEM_MIN_REGION_SIZE (64 * 1024)
+
+// Freed blocks of 1 to MEM_FAST_MAX_SIZE bytes are parked unmerged in fast bins 8 bytes apart
+#define MEM_FAST_MAX_SIZE 256
+#define MEM_FAST_BINS (MEM_FAST_MAX_SIZE / 8 + 1)
+#define MEM_FAST_BIN_DEPTH 16
+
+// A region consolidates its fast bins once this many blocks are parked
+#define MEM_FAST_MAX_PARKED 128
+
+// The maintenance thread gives the whole pages of free blocks at least this large back to the system
+#define MEM_PURGE_MIN_SIZE (64 * 1024)
+
+// A reservation starts this far into its pool block, so its first block never has the address of the pool block
+#define MEM_RESERVE_HEADROOM 16
+
+// mem_alloc_near looks at this many blocks after the hint, and only takes one starting this close to it
+#define MEM_NEAR_WINDOW 64
+#define MEM_NEAR_DISTANCE (64 * 1024)
+
+// MEM_INIT_HOT_ARENA sets 1/MEM_HOT_ARENA_DIVISOR of the pool aside for MEM_HOT blocks
+#define MEM_HOT_ARENA_DIVISOR 16
+#define MEM_HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+// Bytes of movable blocks a maintenance pass slides together at most
+#define MEM_COMPACT_STEP (64 * 1024)
+
+
+/**
+ * Blocks of one fast bin and their sizes. They stay allocated in the
+ * block table, so nothing merges with them until the bins are consolidated.
+ */
+struct fast_bin{
+    unsigned int count;
+    char* blocks[MEM_FAST_BIN_DEPTH];
+    uint32_t sizes[MEM_FAST_BIN_DEPTH];
+};
+
+
+/**
+ * An address range of the pool with its own lock and block list.
+ *
+ * A region covers [start, start of the next region), or up to the end of the pool for the last one.
+ * Boundaries move only while both neighbouring regions are locked: an allocation that fits in no
+ * single region takes free space from the start of the following regions, and frees hand that
+ * space back once it is free again, so regions drift back to their nominal boundaries.
+ * A region can be empty while a neighbour has borrowed all of it. Its block table lives outside
+ * the pool, so the pool holds nothing but user data.
+ */
+struct pool_region{
+    struct mem_lock lock;
+    pthread_mutex_t mutex; // Used instead of `lock` for MEM_INIT_PTHREAD_MUTEX
+    struct mem_lock_stats mutex_stats;
+
+    char* start; // Read without the lock when looking up the owner of a block
+    char* nominal_start;
+    struct block_table blocks; // Blocks of the region, in address order
+
+    struct fast_bin bins[MEM_FAST_BINS]; // Bin i holds blocks of 8 * i - 7 to 8 * i bytes
+    unsigned int parked; // Blocks in all bins
+    size_t parked_bytes; // Their bytes, which the block table still counts as allocated
+
+    int dirty; // Blocks were freed since the maintenance thread last purged the region
+    size_t purged; // Bytes given back to the system by the maintenance thread
+#ifdef MEM_LOCK_HISTOGRAMS
+    uint64_t locked_at; // Cycle count when the holder got the lock, for its hold time
+#endif
+} __attribute__((aligned(64)));
+
+
+/**
+ * Space set aside by mem_reserve. It is one allocated block of the pool with a block table of
+ * its own, so allocations from it never touch the region locks. Its lock is only contended
+ * when other threads free blocks of the reservation.
+ */
+struct mem_reservation{
+    struct mem_lock lock;
+    char* block; // The pool block holding the reservation
+    char* start;
+    char* end;
+    struct block_table blocks;
+    struct mem_reservation* next;
+};
+
+
+// Global variables for managing the memory pool and block list
+static char* memory_pool = NULL; // Pointer to memory_pool
+static size_t pool_size = 0; // Usable size of the pool
+static size_t pool_mapped = 0; // Bytes mapped at memory_pool, which munmap takes back
+static int pool_ready = 0; // Set once the pool is fully set up, memory_pool already is while it is laid out
+static struct pool_region regions[MEM_REGIONS];
+static int region_count = 0;
+
+// Serializes mem_init, mem_reset and mem_deinit
+static pthread_mutex_t init_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Used for one-time lazy initialization of the memory pool
+pthread_once_t init_once = PTHREAD_ONCE_INIT;
+
+// Set when alloc and free go through the flat-combining front end (MEM_INIT_FLAT_COMBINING)
+static int flat_combining = 0;
+
+// Set when small requests are served from the lock-free size class stacks (MEM_INIT_SIZE_CLASSES)
+static int size_classes = 0;
+
+// Set when size class blocks go through per-CPU magazines (MEM_INIT_MAGAZINES)
+static int magazines = 0;
+
+// Set when requests below MEM_BITMAP_MAX_SIZE are served from the granule bitmap (MEM_INIT_BITMAP)
+static int bitmap_granules = 0;
+
+// Set when small frees are parked in fast bins instead of merged right away (cleared by MEM_INIT_NO_FAST_BINS)
+static int fast_bins = 1;
+
+// Set when mem_halloc hands out movable blocks from the handle arena (MEM_INIT_HANDLES)
+static int handles = 0;
+
+// Set when the block tables keep their free blocks in an address ordered tree (MEM_INIT_ADDRESS_TREE)
+static int address_tree = 0;
+
+// Set when requests the pool cannot serve are mapped on their own instead of failing (MEM_INIT_SPILL)
+static int spill = 0;
+
+// Set while the maintenance thread does the housekeeping of the regions (MEM_INIT_MAINTENANCE)
+static int maintenance = 0;
+
+// Mapping the pool and its block table live in when other processes share them (mem_init_shared), or NULL
+static struct mem_segment* segment = NULL;
+
+// Bytes of the blocks the allocator took from the pool for itself, which mem_stats takes off
+// the allocated bytes of the block tables. Only arenas and reservations change it, atomically.
+static size_t internal_bytes = 0;
+
+// Most live bytes a call of mem_stats has seen since init or reset
+static size_t peak_live_bytes = 0;
+
+// File a pool from mem_init_file is mapped from, kept open to hold its lock, or -1
+static int pool_fd = -1;
+
+// Every live reservation, guarded by `reservations_lock`
+static struct mem_reservation* reservations = NULL;
+static struct mem_lock reservations_lock = MEM_LOCK_INITIALIZER;
+
+// Reservation at the start of the pool that MEM_HOT blocks come from (MEM_INIT_HOT_ARENA), or NULL
+static struct mem_reservation* hot_arena = NULL;
+
+// Per-thread budget set by mem_set_thread_quota, 0 for none. Frees credit the thread that
+// frees, so the balance of a thread that frees blocks of others can go below zero.
+static __thread size_t thread_quota = 0;
+static __thread ptrdiff_t thread_balance = 0;
+
+// Hands each thread a preferred region, round robin
+static unsigned int next_home = 0;
+static __thread unsigned int home_ticket = 0; // 0 until the thread first allocates
+
+
+/**
+ * Lock operations guarding the regions. They are picked by mem_init_flags, so a pool that is
+ * only used from one thread (MEM_INIT_SINGLE_THREAD) skips locking without testing a
+ * flag in every call. Builds with MEM_SINGLE_THREADED defined compile the locking out.
+ */
+struct lock_ops{
+    void (*lock)(struct pool_region* region);
+    void (*unlock)(struct pool_region* region);
+    struct mem_lock_stats* (*stats)(struct pool_region* region); // NULL if the lock keeps none
+};
+
+static void spin_lock(struct pool_region* region){
+    mem_lock_acquire(&region->lock);
+}
+
+static void spin_unlock(struct pool_region* region){
+    mem_lock_release(&region->lock);
+}
+
+static struct mem_lock_stats* spin_stats(struct pool_region* region){
+    return &region->lock.stats;
+}
+
+static void mutex_lock(struct pool_region* region){
+    int contended = pthread_mutex_trylock(&region->mutex) != 0;
+    if (contended){
+        pthread_mutex_lock(&region->mutex);
+    }
+    region->mutex_stats.acquisitions++;
+    region->mutex_stats.contended += contended;
+}
+
+static void mutex_unlock(struct pool_region* region){
+    pthread_mutex_unlock(&region->mutex);
+}
+
+static struct mem_lock_stats* mutex_stats(struct pool_region* region){
+    return &region->mutex_stats;
+}
+
+static void no_lock(struct pool_region* region){
+    (void)region;
+}
+
+/**
+ * Carries the entry count and allocated bytes of a table that lives in the segment over from,
+ * and back to, the segment header, where the other processes keep them.
+ */
+static inline void load_counts(struct block_table* blocks){
+    blocks->count = segment->count;
+    blocks->used = segment->used;
+}
+
+static inline void store_counts(const struct block_table* blocks){
+    segment->count = blocks->count;
+    segment->used = blocks->used;
+}
+
+/**
+ * Locks the pool of a segment. A process that died holding the lock may have left the table
+ * half updated, with no way to tell which of its blocks are allocated, so a table that no
+ * longer adds up marks the pool broken: with no entries, every process then fails to
+ * allocate and ignores frees, and no process can attach to it again.
+ */
+static void segment_lock(struct pool_region* region){
+    if (mem_segment_lock(segment) && !mem_segment_check(segment)){
+        segment->count = 0;
+        segment->used = 0;
+    }
+    load_counts(&region->blocks);
+}
+
+static void segment_unlock(struct pool_region* region){
+    store_counts(&region->blocks);
+    mem_segment_unlock(segment);
+}
+
+static const struct lock_ops spin_ops = {spin_lock, spin_unlock, spin_stats};
+static const struct lock_ops mutex_ops = {mutex_lock, mutex_unlock, mutex_stats};
+static const struct lock_ops single_thread_ops = {no_lock, no_lock, NULL};
+static const struct lock_ops segment_ops = {segment_lock, segment_unlock, NULL};
+
+static const struct lock_ops* lock_ops = &spin_ops;
+
+
+/**
+ * Locks a region. Builds with MEM_LOCK_HISTOGRAMS time the wait, and unlocking times the hold,
+ * into the histograms of the calling thread.
+ */
+static inline void region_lock(struct pool_region* region){
+#ifndef MEM_SINGLE_THREADED
+#ifdef MEM_LOCK_HISTOGRAMS
+    uint64_t asked = mem_count_clock();
+    lock_ops->lock(region);
+    region->locked_at = mem_count_clock();
+    mem_count_duration(MEM_COUNT_WAIT, region->locked_at - asked);
+#else
+    lock_ops->lock(region);
+#endif
+#else
+    (void)region;
+#endif
+}
+
+static inline void region_unlock(struct pool_region* region){
+#ifndef MEM_SINGLE_THREADED
+#ifdef MEM_LOCK_HISTOGRAMS
+    mem_count_duration(MEM_COUNT_HOLD, mem_count_clock() - region->locked_at);
+#endif
+    lock_ops->unlock(region);
+#else
+    (void)region;
+#endif
+}
+
+// Locks every region in address order, the order all code takes more than one region lock in
+static void lock_all_regions(){
+    for (int i = 0; i < region_count; i++){
+        region_lock(&regions[i]);
+    }
+}
+
+static void unlock_all_regions(){
+    for (int i = region_count - 1; i >= 0; i--){
+        region_unlock(&regions[i]);
+    }
+}
+
+
+// End of a region, which is where the next one starts
+static char* region_end(int index){
+    if (index + 1 < region_count){
+        return __atomic_load_n(&regions[index + 1].start, __ATOMIC_ACQUIRE);
+    }
+    return memory_pool + pool_size;
+}
+
+static char* nominal_end(int index){
+    return index + 1 < region_count ? regions[index + 1].nominal_start : memory_pool + pool_size;
+}
+
+
+/**
+ * Lays the regions out over the pool at their nominal boundaries, each holding a single free block.
+ *
+ * @return 1 on success, 0 if a block table could not be allocated.
+ *
+ * Behavior:
+ * - Allocates the block tables on the first call and only empties them on later ones.
+ * - Clears the bytes set aside for the allocator and the peak of the live bytes.
+ */
+static int layout_regions(){
+    size_t region_size = pool_size / region_count;
+    internal_bytes = 0;
+    peak_live_bytes = 0;
+
+    for (int i = 0; i < region_count; i++){
+        struct pool_region* region = &regions[i];
+        size_t size = (i == region_count - 1) ? pool_size - i * region_size : region_size; // Last region takes the rest
+
+        region->nominal_start = memory_pool + i * region_size;
+        __atomic_store_n(&region->start, region->nominal_start, __ATOMIC_RELEASE);
+        for (int bin = 0; bin < MEM_FAST_BINS; bin++){
+            region->bins[bin].count = 0;
+        }
+        region->parked = 0;
+        region->parked_bytes = 0;
+        region->dirty = 0;
+        if (region->blocks.capacity > 0){
+            mem_table_reset(&region->blocks, region->start, size);
+        }
+        else if (!mem_table_init(&region->blocks, memory_pool, region->start, size, address_tree)){
+            return 0;
+        }
+    }
+    return 1;
+}
+
+
+/**
+ * Gives the block tables of every region back to the system.
+ */
+static void free_regions(){
+    for (int i = 0; i < region_count; i++){
+        mem_table_destroy(&regions[i].blocks);
+        pthread_mutex_destroy(&regions[i].mutex);
+    }
+}
+
+
+// Allocate and free blocks the allocator keeps for itself, defined with mem_resize below
+static void* internal_alloc(size_t size);
+static void internal_free(void* block);
+
+
+/**
+ * Sets 1/MEM_CLASS_ARENA_DIVISOR of the pool aside as the arena of the size classes.
+ *
+ * Behavior:
+ * - Allocates the arena as one ordinary block, so the rest of the pool is managed as before.
+ * - Leaves the size classes off if the pool is too small to spare a chunk.
+ * - Empties the magazines, whose blocks belong to the previous arena.
+ */
+static void setup_size_classes(){
+    mem_mag_reset();
+    size_t size = pool_size / MEM_CLASS_ARENA_DIVISOR;
+    void* arena = size >= MEM_CLASS_CHUNK ? internal_alloc(size) : NULL;
+
+    size_classes = 0;
+    if (arena == NULL){
+        return;
+    }
+    if (!mem_class_init(arena, size)){
+        internal_free(arena);
+        return;
+    }
+    size_classes = 1;
+}
+
+
+/**
+ * Sets 1/MEM_BITMAP_ARENA_DIVISOR of the pool aside as the arena of the bitmap allocator.
+ *
+ * Behavior:
+ * - Allocates the arena as one ordinary block, so the rest of the pool is managed as before.
+ * - Leaves the bitmap allocator off if the pool is too small to spare a bitmap word of granules.
+ */
+static void setup_bitmap(){
+    size_t size = pool_size / MEM_BITMAP_ARENA_DIVISOR;
+    void* arena = size >= 64 * MEM_BITMAP_GRANULE + MEM_BITMAP_GRANULE ? internal_alloc(size) : NULL;
+
+    bitmap_granules = 0;
+    if (arena == NULL){
+        return;
+    }
+    if (!mem_bitmap_init(arena, size)){
+        internal_free(arena);
+        return;
+    }
+    bitmap_granules = 1;
+}
+
+
+/**
+ * Sets 1/MEM_HANDLE_ARENA_DIVISOR of the pool aside as the arena of the movable blocks.
+ *
+ * Behavior:
+ * - Allocates the arena as one ordinary block, so the rest of the pool is managed as before.
+ * - Leaves handles off if the arena could not be allocated.
+ */
+static void setup_handles(){
+    size_t size = pool_size / MEM_HANDLE_ARENA_DIVISOR;
+    void* arena = size >= MEM_HANDLE_ALIGN ? internal_alloc(size) : NULL;
+
+    handles = 0;
+    if (arena == NULL){
+        return;
+    }
+    if (!mem_handle_init(arena, size)){
+        internal_free(arena);
+        return;
+    }
+    handles = 1;
+}
+
+
+// Sets space aside as a reservation, defined with mem_reserve below
+static struct mem_reservation* new_reservation(size_t bytes);
+
+
+/**
+ * Sets 1/MEM_HOT_ARENA_DIVISOR of the pool aside for MEM_HOT blocks and asks for huge pages for it.
+ *
+ * Behavior:
+ * - Must run first on a fresh pool, so the arena is the block at its start, which
+ *   mem_init_flags aligned to a huge page. Its size is rounded down to whole huge pages
+ *   when it spans at least one.
+ * - Allocates the arena as a reservation, so the rest of the pool is managed as before and
+ *   hot blocks are freed with mem_free like reserved ones.
+ * - Leaves the arena off if the pool is too small to spare a page.
+ */
+static void setup_hot_arena(){
+    size_t size = pool_size / MEM_HOT_ARENA_DIVISOR;
+    if (size >= MEM_HUGE_PAGE_SIZE){
+        size -= size % MEM_HUGE_PAGE_SIZE;
+    }
+    hot_arena = size >= 4096 ? new_reservation(size - MEM_RESERVE_HEADROOM) : NULL;
+
+#ifdef MADV_HUGEPAGE
+    if (hot_arena != NULL){
+        madvise(hot_arena->block, size, MADV_HUGEPAGE); // Only a hint, the arena works without
+    }
+#endif
+}
+
+
+/**
+ * Initializes the memory pool with the specified size.
+ *
+ * @param size Size of the memory pool to allocate.
+ *
+ * Behavior:
+ * - Same as `mem_init_flags(size, 0)`.
+ */
+void mem_init(size_t size){
+    mem_init_flags(size, 0);
+}
+
+
+// Housekeeping pass of the maintenance thread, next to the fast bins it consolidates below
+static void maintain();
+
+
+/**
+ * Initializes the memory pool with the specified size and options.
+ *
+ * @param size Size of the memory pool to allocate.
+ * @param flags Bitwise OR of MEM_INIT_* options.
+ *
+ * Behavior:
+ * - Does nothing if a pool already exists; call `mem_deinit` first to change its size.
+ * - Leaves the pool empty for sizes above MEM_TABLE_MAX_SIZE, which the packed block entries cannot describe.
+ * - Maps the pool as anonymous memory, asking the kernel to populate it up front for MEM_INIT_POPULATE.
+ * - Creates the first memory block in the pool, marking the entire pool as free.
+ * - Splits the pool into up to MEM_REGIONS separately locked regions for MEM_INIT_STRIPED.
+ * - Pre-faults the whole pool from several threads for MEM_INIT_PREFAULT.
+ * - Drops locking for the lifetime of the pool for MEM_INIT_SINGLE_THREAD.
+ * - Guards the pool with pthread mutexes instead of the spinning futex locks for MEM_INIT_PTHREAD_MUTEX.
+ * - Routes allocations and frees through the flat-combining front end for MEM_INIT_FLAT_COMBINING.
+ * - Sets a share of the pool aside for lock-free size class stacks for MEM_INIT_SIZE_CLASSES.
+ * - Does the same and caches the size class blocks in per-CPU magazines for MEM_INIT_MAGAZINES.
+ * - Sets a share of the pool aside for the granule bitmap allocator for MEM_INIT_BITMAP.
+ * - Merges every freed block right away instead of parking small ones for MEM_INIT_NO_FAST_BINS.
+ * - Finds free blocks through an address ordered tree instead of scanning for MEM_INIT_ADDRESS_TREE.
+ * - Starts the maintenance thread for MEM_INIT_MAINTENANCE, unless the pool is single-threaded.
+ * - Maps requests the pool cannot serve on their own instead of failing them for MEM_INIT_SPILL.
+ * - Aligns the pool to a huge page and sets its first share aside for MEM_HOT blocks for MEM_INIT_HOT_ARENA.
+ * - Sets a share of the pool aside for movable blocks behind handles for MEM_INIT_HANDLES.
+ * - Leaves the pool empty if the mapping fails, so every allocation returns `NULL`.
+ */
+void mem_init_flags(size_t size, int flags){
+    pthread_mutex_lock(&init_mutex);
+
+    if (memory_pool != NULL || size > MEM_TABLE_MAX_SIZE){ // Already initialized, or too large for the block tables
+        pthread_mutex_unlock(&init_mutex);
+        return;
+    }
+
+    int map_flags = MAP_PRIVATE | MAP_ANONYMOUS;
+    if (flags & MEM_INIT_POPULATE){
+        map_flags |= MAP_POPULATE;
+    }
+
+    size_t map_size = size > 0 ? size : 1; // mmap refuses empty mappings
+    size_t slack = (flags & MEM_INIT_HOT_ARENA) ? MEM_HUGE_PAGE_SIZE : 0;
+    char* pool = mmap(NULL, map_size + slack, PROT_READ | PROT_WRITE, map_flags, -1, 0); // Allocate memory pool
+    if (pool == MAP_FAILED){
+        pthread_mutex_unlock(&init_mutex);
+        return;
+    }
+    if (slack > 0){ // Trim the mapping down to map_size bytes starting at a huge page boundary
+        size_t page = sysconf(_SC_PAGESIZE);
+        size_t head = (MEM_HUGE_PAGE_SIZE - (uintptr_t)pool % MEM_HUGE_PAGE_SIZE) % MEM_HUGE_PAGE_SIZE;
+        if (head > 0){
+            munmap(pool, head);
+        }
+        pool += head;
+        if (slack > head){
+            munmap(pool + (map_size + page - 1) / page * page, slack - head);
+        }
+        map_size = (map_size + page - 1) / page * page;
+    }
+
+    region_count = 1;
+    if (flags & MEM_INIT_STRIPED){
+        region_count = MEM_REGIONS;
+        while (region_count > 1 && size / region_count < MEM_MIN_REGION_SIZE){
+            region_count /= 2;
+        }
+    }
+
+    memory_pool = pool;
+    pool_size = size;
+    pool_mapped = map_size;
+    address_tree = (flags & MEM_INIT_ADDRESS_TREE) != 0;
+    for (int i = 0; i < region_count; i++){
+        regions[i].lock = (struct mem_lock)MEM_LOCK_INITIALIZER; // Statistics are per pool
+        regions[i].mutex_stats = (struct mem_lock_stats){0};
+        regions[i].purged = 0;
+        pthread_mutex_init(&regions[i].mutex, NULL);
+    }
+    if (!layout_regions()){
+        free_regions();
+        munmap(pool, map_size);
+        memory_pool = NULL;
+        pool_size = 0;
+        pool_mapped = 0;
+        region_count = 0;
+        pthread_mutex_unlock(&init_mutex);
+        return;
+    }
+
+    if (flags & MEM_INIT_SINGLE_THREAD){
+        lock_ops = &single_thread_ops;
+    }
+    else if (flags & MEM_INIT_PTHREAD_MUTEX){
+        lock_ops = &mutex_ops;
+    }
+    flat_combining = (flags & MEM_INIT_FLAT_COMBINING) && !(flags & MEM_INIT_SINGLE_THREAD);
+    fast_bins = !(flags & MEM_INIT_NO_FAST_BINS);
+    spill = (flags & MEM_INIT_SPILL) != 0;
+    if (flags & MEM_INIT_HOT_ARENA){
+        setup_hot_arena(); // First, so it is the block at the aligned start of the pool
+    }
+    if (flags & (MEM_INIT_SIZE_CLASSES | MEM_INIT_MAGAZINES)){
+        setup_size_classes();
+        magazines = size_classes && (flags & MEM_INIT_MAGAZINES);
+    }
+    if (flags & MEM_INIT_BITMAP){
+        setup_bitmap();
+    }
+    if (flags & MEM_INIT_HANDLES){
+        setup_handles();
+    }
+
+    __atomic_store_n(&memory_pool, pool, __ATOMIC_RELEASE); // Publish once everything is set up
+    __atomic_store_n(&pool_ready, 1, __ATOMIC_RELEASE);
+
+#ifdef MEM_SINGLE_THREADED
+    flags &= ~MEM_INIT_MAINTENANCE; // Without locks the thread would race with the callers
+#endif
+    if ((flags & MEM_INIT_MAINTENANCE) && !(flags & MEM_INIT_SINGLE_THREAD)){
+        maintenance = mem_maint_start(maintain);
+    }
+    pthread_mutex_unlock(&init_mutex);
+
+    if (flags & MEM_INIT_PREFAULT){
+        mem_prefault(size);
+    }
+}
+
+
+/**
+ * Makes a mapped segment the pool, as a single region whose block table lives in the segment.
+ * The caller holds `init_mutex`.
+ *
+ * Behavior:
+ * - Locks the region with the mutex of the segment, which also carries the entry count over.
+ * - Turns the fast bins off, since parked blocks would only be known to this process.
+ */
+static void adopt_segment(struct mem_segment* s){
+    char* pool = mem_segment_pool(s);
+    struct pool_region* region = &regions[0];
+
+    region_count = 1;
+    region->lock = (struct mem_lock)MEM_LOCK_INITIALIZER;
+    region->mutex_stats = (struct mem_lock_stats){0};
+    region->purged = 0;
+    pthread_mutex_init(&region->mutex, NULL); // Unused, but destroyed with the other regions
+    region->nominal_start = pool;
+    region->start = pool;
+    for (int bin = 0; bin < MEM_FAST_BINS; bin++){
+        region->bins[bin].count = 0;
+    }
+    region->parked = 0;
+    region->parked_bytes = 0;
+    region->dirty = 0;
+    mem_table_attach(&region->blocks, pool, s->entries, mem_segment_anchors(s), s->capacity);
+    segment = s;
+    load_counts(&region->blocks); // Builds with MEM_SINGLE_THREADED never lock, which would load them
+
+    pool_size = s->pool_size;
+    lock_ops = &segment_ops;
+    fast_bins = 0;
+    __atomic_store_n(&memory_pool, pool, __ATOMIC_RELEASE);
+    __atomic_store_n(&pool_ready, 1, __ATOMIC_RELEASE);
+}
+
+
+/**
+ * Creates or attaches to a pool shared between processes.
+ *
+ * @param name Name of the POSIX shared memory object, starting with a slash.
+ * @param size Size of the pool if this call creates it; ignored when attaching.
+ * @return 1 if the pool is now the shared one, 0 otherwise.
+ *
+ * Behavior:
+ * - Does nothing if a pool already exists.
+ * - Creates the shared memory object if there is none by that name and lays a segment out in it;
+ *   otherwise maps the segment another process laid out, waiting for it to be ready.
+ * - Removes a shared memory object it created again if the segment could not be set up.
+ * - Fails in builds with MEM_SINGLE_THREADED defined, where processes could not lock each other out.
+ */
+int mem_init_shared(const char* name, size_t size){
+#ifdef MEM_SINGLE_THREADED
+    (void)name;
+    (void)size;
+    return 0;
+#else
+    pthread_mutex_lock(&init_mutex);
+    if (memory_pool != NULL){
+        pthread_mutex_unlock(&init_mutex);
+        return 0;
+    }
+
+    struct mem_segment* s = NULL;
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd >= 0){
+        s = mem_segment_create(fd, size);
+        if (s == NULL){
+            shm_unlink(name);
+        }
+    }
+    else if (errno == EEXIST){
+        fd = shm_open(name, O_RDWR, 0);
+        s = fd >= 0 ? mem_segment_attach(fd, 0) : NULL;
+    }
+    if (fd >= 0){
+        close(fd); // The mapping keeps the object alive
+    }
+
+    if (s != NULL){
+        adopt_segment(s);
+    }
+    pthread_mutex_unlock(&init_mutex);
+    return s != NULL;
+#endif
+}
+
+
+/**
+ * Maps a pool from a file, laid out by an earlier run or created now.
+ *
+ * @param path The file of the pool.
+ * @param size Size of the pool if the file is new or empty; ignored otherwise.
+ * @return 1 if the file pool is in use, 0 otherwise.
+ *
+ * Behavior:
+ * - Does nothing if a pool already exists.
+ * - Takes an exclusive lock on the file for as long as the pool is mapped, and fails if
+ *   another process holds it. The mutex in the file is then set up afresh, since whoever
+ *   held it last is gone.
+ * - Uses the block table in the file as it is, so attaching costs a mapping, whatever the pool holds.
+ */
+int mem_init_file(const char* path, size_t size){
+    pthread_mutex_lock(&init_mutex);
+    if (memory_pool != NULL){
+        pthread_mutex_unlock(&init_mutex);
+        return 0;
+    }
+
+    struct mem_segment* s = NULL;
+    struct stat st;
+    int fd = open(path, O_RDWR | O_CREAT, 0600);
+    if (fd >= 0 && flock(fd, LOCK_EX | LOCK_NB) == 0 && fstat(fd, &st) == 0){
+        s = st.st_size == 0 ? mem_segment_create(fd, size) : mem_segment_attach(fd, 1);
+    }
+    if (s == NULL){
+        if (fd >= 0){
+            close(fd);
+        }
+        pthread_mutex_unlock(&init_mutex);
+        return 0;
+    }
+
+    pool_fd = fd;
+    adopt_segment(s);
+    pthread_mutex_unlock(&init_mutex);
+    return 1;
+}
+
+
+/**
+ * Stores the entry count and allocated bytes of the table back in the segment. The lock already
+ * does that after every change, except in builds with MEM_SINGLE_THREADED, which compile it out.
+ */
+static void store_segment_counts(){
+    region_lock(&regions[0]);
+    store_counts(&regions[0].blocks);
+    region_unlock(&regions[0]);
+}
+
+
+/**
+ * Writes a pool that lives in a file or shared memory object back to it.
+ *
+ * @return 1 once everything is written, 0 for other pools or if a write failed.
+ *
+ * Behavior:
+ * - Holds the pool lock while writing, so the file holds the block table as it was at one
+ *   moment, together with the blocks as they were then.
+ */
+int mem_sync(){
+    if (segment == NULL){
+        return 0;
+    }
+    region_lock(&regions[0]);
+    store_counts(&regions[0].blocks);
+    int synced = mem_segment_sync(segment);
+    region_unlock(&regions[0]);
+    return synced;
+}
+
+
+/**
+ * Records a block as the root of a file or shared pool, where mem_get_root finds it after a restart
+ * or in another process. `NULL` clears it. Does nothing for other pools.
+ */
+void mem_set_root(void* block){
+    if (segment != NULL){
+        __atomic_store_n(&segment->root, block != NULL ? mem_to_offset(block) + 1 : 0, __ATOMIC_RELEASE);
+    }
+}
+
+
+/**
+ * Returns the root block of a file or shared pool, or `NULL` if none was set or for other pools.
+ */
+void* mem_get_root(){
+    uint64_t root = segment != NULL ? __atomic_load_n(&segment->root, __ATOMIC_ACQUIRE) : 0;
+    return root != 0 ? mem_from_offset(root - 1) : NULL;
+}
+
+
+/**
+ * Returns the offset of a pointer from the start of the pool, which is the same in every
+ * process mapping a shared pool, or (size_t)-1 for pointers outside the pool.
+ */
+size_t mem_to_offset(void* block){
+    char* ptr = (char*)block;
+    if (memory_pool == NULL || ptr < memory_pool || ptr > memory_pool + pool_size){
+        return (size_t)-1;
+    }
+    return ptr - memory_pool;
+}
+
+
+/**
+ * Turns an offset from mem_to_offset back into a pointer in this process, or `NULL` if it is not in the pool.
+ */
+void* mem_from_offset(size_t offset){
+    if (memory_pool == NULL || offset > pool_size){
+        return NULL;
+    }
+    return memory_pool + offset;
+}
+
+
+/**
+ * Creates a pool of MEM_DEFAULT_POOL_SIZE bytes, run once through `init_once`.
+ */
+static void lazy_init(){
+    mem_init_flags(MEM_DEFAULT_POOL_SIZE, 0);
+}
+
+
+/**
+ * Makes sure a pool exists before it is used.
+ *
+ * Behavior:
+ * - Costs a single load once the pool exists.
+ * - Otherwise initializes a default pool exactly once, however many threads get here first.
+ * - Tests `pool_ready` rather than `memory_pool`, which is set before the regions are laid out,
+ *   so the threads that lose the race wait in pthread_once until the pool can serve them.
+ */
+static void ensure_init(){
+    if (!__atomic_load_n(&pool_ready, __ATOMIC_ACQUIRE)){
+        pthread_once(&init_once, lazy_init);
+    }
+}
+
+
+// Work handed to each pre-fault thread
+struct prefault_range{
+    char* start;
+    size_t len;
+};
+
+
+/**
+ * Faults in every page of a range for writing without changing its contents.
+ *
+ * Behavior:
+ * - Uses MADV_POPULATE_WRITE where the kernel supports it.
+ * - Otherwise adds zero to one byte per page atomically, which takes the write fault
+ *   without racing with a thread that already stores data there.
+ */
+static void* prefault_worker(void* arg){
+    struct prefault_range* range = (struct prefault_range*)arg;
+    long page = sysconf(_SC_PAGESIZE);
+
+    uintptr_t first = (uintptr_t)range->start & ~(uintptr_t)(page - 1); // madvise wants page alignment
+    size_t len = range->len + ((uintptr_t)range->start - first);
+
+#ifdef MADV_POPULATE_WRITE
+    if (madvise((void*)first, len, MADV_POPULATE_WRITE) == 0){
+        return NULL;
+    }
+#endif
+
+    for (size_t i = 0; i < len; i += page){
+        __atomic_fetch_add((char*)first + i, 0, __ATOMIC_RELAXED);
+    }
+    return NULL;
+}
+
+
+/**
+ * Pre-faults the start of the memory pool so later allocations do not stall on page faults.
+ *
+ * @param bytes Number of bytes from the start of the pool to fault in; clamped to the pool size.
+ * @return The number of bytes that were faulted in.
+ *
+ * Behavior:
+ * - Splits the range into chunks of at least MEM_PREFAULT_CHUNK bytes, one per online CPU at most.
+ * - Faults the chunks in parallel and waits for all of them.
+ * - Falls back to faulting in on the calling thread if threads cannot be created.
+ */
+size_t mem_prefault(size_t bytes){
+    if (memory_pool == NULL){
+        return 0;
+    }
+    if (bytes > pool_size){
+        bytes = pool_size;
+    }
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t num_threads = bytes / MEM_PREFAULT_CHUNK;
+    if (num_threads > (size_t)cpus){
+        num_threads = cpus;
+    }
+    if (num_threads > MEM_PREFAULT_MAX_THREADS){
+        num_threads = MEM_PREFAULT_MAX_THREADS;
+    }
+    if (num_threads < 1){
+        num_threads = 1;
+    }
+
+    pthread_t threads[MEM_PREFAULT_MAX_THREADS];
+    struct prefault_range ranges[MEM_PREFAULT_MAX_THREADS];
+    int started[MEM_PREFAULT_MAX_THREADS];
+    size_t chunk = bytes / num_threads;
+
+    for (size_t i = 0; i < num_threads; i++){
+        ranges[i].start = memory_pool + i * chunk;
+        ranges[i].len = (i == num_threads - 1) ? bytes - i * chunk : chunk; // Last thread takes the rest
+        started[i] = num_threads > 1 && pthread_create(&threads[i], NULL, prefault_worker, &ranges[i]) == 0;
+        if (!started[i]){
+            prefault_worker(&ranges[i]);
+        }
+    }
+
+    for (size_t i = 0; i < num_threads; i++){
+        if (started[i]){
+            pthread_join(threads[i], NULL);
+        }
+    }
+    return bytes;
+}
+
+
+/**
+ * Finds and locks the region a block lies in.
+ *
+ * @param block Pointer into the pool.
+ * @return The locked region, or `NULL` if the pointer is not in the pool.
+ *
+ * Behavior:
+ * - Picks the last region starting at or before the pointer, which skips empty regions.
+ * - Checks the bounds again once the region is locked, and retries if a boundary moved meanwhile.
+ */
+static struct pool_region* lock_owner(void* block){
+    char* ptr = (char*)block;
+    if (memory_pool == NULL || ptr < memory_pool || ptr > memory_pool + pool_size){
+        return NULL;
+    }
+
+    while (1){
+        int low = 0;
+        int high = region_count - 1;
+        while (low < high){
+            int mid = (low + high + 1) / 2;
+            if (__atomic_load_n(&regions[mid].start, __ATOMIC_ACQUIRE) <= ptr){
+                low = mid;
+            }
+            else{
+                high = mid - 1;
+            }
+        }
+
+        struct pool_region* region = &regions[low];
+        region_lock(region);
+        char* end = region_end(low);
+        if (region->start <= ptr && (ptr < end || (low == region_count - 1 && ptr == end))){
+            return region;
+        }
+        region_unlock(region);
+    }
+}
+
+
+/**
+ * Allocates `size` bytes at the start of free block `i` of a table whose lock the caller holds,
+ * splitting off the remainder.
+ */
+static void* take_block(struct block_table* blocks, size_t i, size_t size){
+    size_t block_size = mem_table_size(blocks, i);
+    if (block_size - size < MEM_MIN_SPLIT){ // The slack stays with the block
+        mem_table_set(blocks, i, block_size, 0);
+        return mem_table_start(blocks, i);
+    }
+
+    // Shrunk first, so the table never counts the remainder as allocated towards its peak.
+    // Without room in the table the remainder stays with the block too.
+    mem_table_set(blocks, i, size, 0);
+    if (!mem_table_insert(blocks, i + 1, mem_table_start(blocks, i) + size, block_size - size, 1)){
+        mem_table_set(blocks, i, block_size, 0);
+    }
+
+    return mem_table_start(blocks, i);
+}
+
+
+/**
+ * mem_alloc without lock, within one block table whose lock the caller holds.
+ */
+static void* no_lock_alloc(struct block_table* blocks, size_t size){
+    size_t i = mem_table_find_fit(blocks, size);
+    if (i == blocks->count){
+        return NULL;
+    }
+    return take_block(blocks, i, size);
+}
+
+
+/**
+ * Marks block `index` of a table free and merges it with free neighbours, as long as the
+ * merged block stays within MEM_TABLE_MAX_BLOCK bytes.
+ */
+static void mark_free(struct block_table* blocks, size_t index){
+    size_t first = index;
+    size_t last = index;
+    size_t merged = mem_table_size(blocks, index);
+    if (index + 1 < blocks->count && mem_table_is_free(blocks, index + 1)
+        && merged + mem_table_size(blocks, index + 1) <= MEM_TABLE_MAX_BLOCK){
+        last = index + 1;
+        merged += mem_table_size(blocks, index + 1);
+    }
+    if (index > 0 && mem_table_is_free(blocks, index - 1) && merged + mem_table_size(blocks, index - 1) <= MEM_TABLE_MAX_BLOCK){
+        first = index - 1;
+    }
+
+    // Merged before marking, so a zero sized neighbour never shares its address with another free block
+    char* start = mem_table_start(blocks, first);
+    size_t size = mem_table_start(blocks, last) + mem_table_size(blocks, last) - start;
+    mem_table_remove(blocks, first + 1, last - first);
+    mem_table_set(blocks, first, size, 1);
+}
+
+
+/**
+ * Frees and merges every block parked in the fast bins of a region, whose lock the caller holds.
+ */
+static void consolidate(struct pool_region* region){
+    struct block_table* blocks = &region->blocks;
+
+    for (int bin = 0; bin < MEM_FAST_BINS; bin++){
+        for (unsigned int j = 0; j < region->bins[bin].count; j++){
+            size_t i = mem_table_find(blocks, region->bins[bin].blocks[j]);
+            while (i < blocks->count && mem_table_size(blocks, i) != region->bins[bin].sizes[j]){ // Skip zero sized blocks at the same address
+                i++;
+            }
+            if (i < blocks->count){
+                mark_free(blocks, i);
+            }
+        }
+        region->bins[bin].count = 0;
+    }
+    region->parked = 0;
+    region->parked_bytes = 0;
+    region->dirty = 1;
+}
+
+
+/**
+ * Takes a parked block of at least `size` bytes from the fast bin for the size.
+ *
+ * @return The block, or `NULL` if the bin has none large enough.
+ */
+static void* take_parked(struct pool_region* region, size_t size){
+    if (size == 0 || size > MEM_FAST_MAX_SIZE){
+        return NULL;
+    }
+
+    struct fast_bin* bin = &region->bins[(size + 7) / 8];
+    for (unsigned int j = bin->count; j-- > 0;){ // Most recently parked first, its memory is the warmest
+        if (bin->sizes[j] >= size){
+            char* block = bin->blocks[j];
+            region->parked_bytes -= bin->sizes[j];
+            bin->count--;
+            bin->blocks[j] = bin->blocks[bin->count];
+            bin->sizes[j] = bin->sizes[bin->count];
+            region->parked--;
+            return block;
+        }
+    }
+    return NULL;
+}
+
+
+/**
+ * Parks a freed block in its fast bin instead of merging it.
+ *
+ * @return 1 if the block was parked, 0 if it has to be freed normally.
+ *
+ * Behavior:
+ * - Only parks allocated blocks of 1 to MEM_FAST_MAX_SIZE bytes, while their bin has room.
+ * - Adds the block to the parked bytes of the region, which mem_stats leaves out of the live
+ *   bytes, since the block stays allocated in the block table.
+ * - Consolidates the region once MEM_FAST_MAX_PARKED blocks are parked, so parked blocks
+ *   cannot fragment it without bound. With a maintenance thread it asks the thread to do so instead.
+ */
+static int park(struct pool_region* region, void* block){
+    struct block_table* blocks = &region->blocks;
+    size_t i = mem_table_find(blocks, block);
+    if (i == blocks->count){
+        return 0;
+    }
+
+    size_t size = mem_table_size(blocks, i);
+    if (size == 0 || size > MEM_FAST_MAX_SIZE){
+        return 0;
+    }
+    if (region->parked >= MEM_FAST_MAX_PARKED){
+        if (maintenance){ // Merging is the maintenance thread's job, this block is freed right away meanwhile
+            mem_maint_kick();
+        }
+        else{
+            consolidate(region);
+        }
+        return 0;
+    }
+
+    struct fast_bin* bin = &region->bins[(size + 7) / 8];
+    if (bin->count == MEM_FAST_BIN_DEPTH){
+        return 0;
+    }
+    bin->sizes[bin->count] = (uint32_t)size;
+    bin->blocks[bin->count++] = block;
+    region->parked++;
+    region->parked_bytes += size;
+    return 1;
+}
+
+
+/**
+ * Allocates from one region whose lock the caller holds.
+ *
+ * Behavior:
+ * - Reuses a parked block of a fitting size without touching the block table.
+ * - Otherwise searches the table, and consolidates the fast bins and searches again on a miss.
+ */
+static void* region_alloc(struct pool_region* region, size_t size){
+    void* ptr = take_parked(region, size);
+    if (ptr != NULL){
+        return ptr;
+    }
+
+    ptr = no_lock_alloc(&region->blocks, size);
+    if (ptr == NULL && region->parked > 0){
+        consolidate(region);
+        ptr = no_lock_alloc(&region->blocks, size);
+    }
+    return ptr;
+}
+
+
+/**
+ * Gives the whole pages inside large free blocks of a region, whose lock the caller holds,
+ * back to the system. They read as zeros and are faulted in again when next used.
+ */
+static void purge(struct pool_region* region){
+    struct block_table* blocks = &region->blocks;
+    uintptr_t page = sysconf(_SC_PAGESIZE);
+
+    for (size_t i = 0; i < blocks->count; i++){
+        if (!mem_table_is_free(blocks, i) || mem_table_size(blocks, i) < MEM_PURGE_MIN_SIZE){
+            continue;
+        }
+        uintptr_t first = ((uintptr_t)mem_table_start(blocks, i) + page - 1) & ~(page - 1);
+        uintptr_t last = ((uintptr_t)mem_table_start(blocks, i) + mem_table_size(blocks, i)) & ~(page - 1);
+        if (last > first && madvise((void*)first, last - first, MADV_DONTNEED) == 0){
+            region->purged += last - first;
+        }
+    }
+}
+
+
+/**
+ * One pass of the maintenance thread over every region.
+ *
+ * Behavior:
+ * - Consolidates the fast bins, so callers find merged blocks instead of merging on a miss.
+ * - Purges regions that had blocks freed since their last purge.
+ * - Gives the magazines the depots did not need since the last pass back to the size classes.
+ * - Slides up to MEM_COMPACT_STEP bytes of unpinned movable blocks together.
+ * - Holds one region lock at a time, so callers only ever wait for a single region.
+ */
+static void maintain(){
+    for (int i = 0; i < region_count; i++){
+        struct pool_region* region = &regions[i];
+        region_lock(region);
+        if (region->parked > 0){
+            consolidate(region);
+        }
+        if (region->dirty){
+            purge(region);
+            region->dirty = 0;
+        }
+        region_unlock(region);
+    }
+    if (magazines){
+        mem_mag_trim();
+    }
+    if (handles){
+        mem_handle_compact(MEM_COMPACT_STEP);
+    }
+}
+
+
+/**
+ * Sets how often the maintenance thread runs and how much of its time it may spend working.
+ *
+ * @param period_ms Time between passes when nothing asks for one sooner, at least 1.
+ * @param duty_percent Upper bound on the share of time the thread works, 1 to 100.
+ *
+ * Behavior:
+ * - Applies to the running thread and to threads of later pools.
+ */
+void mem_tune_maintenance(unsigned int period_ms, unsigned int duty_percent){
+    mem_maint_tune(period_ms, duty_percent);
+}
+
+
+/**
+ * Moves the free block at the start of region `from` to the end of region `to`, which come
+ * one after the other apart from empty regions in between. Both locks and all in between are held.
+ *
+ * @return 1 on success, 0 if the table of region `to` could not grow.
+ */
+static int move_head_block(int to, int from){
+    struct block_table* src = &regions[from].blocks;
+    struct block_table* dst = &regions[to].blocks;
+    char* start = mem_table_start(src, 0);
+    size_t size = mem_table_size(src, 0);
+
+    if (dst->count > 0 && mem_table_is_free(dst, dst->count - 1) && mem_table_size(dst, dst->count - 1) + size <= MEM_TABLE_MAX_BLOCK){
+        mem_table_set(dst, dst->count - 1, mem_table_size(dst, dst->count - 1) + size, 1);
+    }
+    else if (!mem_table_insert(dst, dst->count, start, size, 1)){
+        return 0;
+    }
+    mem_table_remove(src, 0, 1);
+
+    for (int i = to + 1; i <= from; i++){ // Empty regions in between move along
+        __atomic_store_n(&regions[i].start, start + size, __ATOMIC_RELEASE);
+    }
+    return 1;
+}
+
+
+/**
+ * Serves a request that fits in no single region by letting one region take over free space
+ * at the start of the regions after it. Coalescing across region boundaries only happens here.
+ *
+ * @param size The size of the block to allocate.
+ * @return Pointer to the allocated memory, or `NULL` if no run of free space is large enough.
+ *
+ * Behavior:
+ * - Locks all regions, in address order.
+ * - Tries every region on its own again, since other threads may have freed memory meanwhile.
+ * - Consolidates the fast bins of every region.
+ * - Otherwise looks for a region whose free tail, together with the free heads of the regions
+ *   after it (whole regions if they are entirely free), is large enough, and moves those boundaries.
+ */
+static void* spanning_alloc(size_t size){
+    void* ptr = NULL;
+    lock_all_regions();
+
+    for (int i = 0; i < region_count && ptr == NULL; i++){
+        ptr = region_alloc(&regions[i], size);
+    }
+    for (int i = 0; i < region_count; i++){
+        consolidate(&regions[i]); // Parked blocks would keep boundaries from moving
+    }
+
+    for (int i = 0; i < region_count && ptr == NULL; i++){
+        struct block_table* blocks = &regions[i].blocks;
+        size_t tail = blocks->count - 1;
+        size_t run = (blocks->count > 0 && mem_table_is_free(blocks, tail)) ? mem_table_size(blocks, tail) : 0;
+        int last = i;
+
+        for (int j = i + 1; j < region_count && run < size; j++){
+            struct block_table* next = &regions[j].blocks;
+            if (next->count == 0){ // Empty, already lent out
+                continue;
+            }
+            if (!mem_table_is_free(next, 0)){
+                break;
+            }
+            run += mem_table_size(next, 0);
+            last = j;
+            if (next->count > 1){ // Free space does not reach past this region
+                break;
+            }
+        }
+
+        if (run >= size && last > i){
+            for (int j = i + 1; j <= last; j++){
+                if (regions[j].blocks.count > 0 && !move_head_block(i, j)){
+                    break;
+                }
+            }
+            ptr = no_lock_alloc(&regions[i].blocks, size);
+        }
+    }
+
+    unlock_all_regions();
+    return ptr;
+}
+
+
+/**
+ * Moves the free tail of region `index` that lies past its nominal end to the start of the next region.
+ * The caller holds the locks of both regions.
+ *
+ * @return 1 if the space was handed over, 0 if there was none or the next table could not grow.
+ */
+static int give_back_tail(int index){
+    struct block_table* blocks = &regions[index].blocks;
+    struct block_table* next = &regions[index + 1].blocks;
+    char* end = region_end(index);
+    char* nominal = nominal_end(index);
+
+    size_t tail = blocks->count - 1;
+    if (end <= nominal || blocks->count == 0 || !mem_table_is_free(blocks, tail)){
+        return 0;
+    }
+
+    char* cut = mem_table_start(blocks, tail) > nominal ? mem_table_start(blocks, tail) : nominal;
+    size_t size = end - cut;
+
+    if (next->count > 0 && mem_table_is_free(next, 0) && mem_table_size(next, 0) + size <= MEM_TABLE_MAX_BLOCK){ // Grow the free block at the start of the next region
+        mem_table_put(next, 0, cut, mem_table_size(next, 0) + size, 1);
+    }
+    else if (!mem_table_insert(next, 0, cut, size, 1)){
+        return 0;
+    }
+
+    if (cut == mem_table_start(blocks, tail)){ // The whole tail goes
+        mem_table_remove(blocks, tail, 1);
+    }
+    else{
+        mem_table_set(blocks, tail, mem_table_size(blocks, tail) - size, 1);
+    }
+    __atomic_store_n(&regions[index + 1].start, cut, __ATOMIC_RELEASE);
+    return 1;
+}
+
+
+/**
+ * Hands space a region borrowed from the regions after it back once it is free again.
+ * The caller holds the lock of region `index`.
+ *
+ * Behavior:
+ * - Gives the free space past the nominal end to the next region, which may pass it on in turn
+ *   if it was lent out too. Locks are taken hand over hand, in address order.
+ */
+static void return_borrowed(int index){
+    int held = index;
+
+    while (held + 1 < region_count && region_end(held) > nominal_end(held)){
+        region_lock(&regions[held + 1]); // Borrowing only ever happens from later regions
+        int moved = give_back_tail(held);
+        if (held != index){
+            region_unlock(&regions[held]);
+        }
+        held++;
+        if (!moved){
+            break;
+        }
+    }
+
+    if (held != index){
+        region_unlock(&regions[held]);
+    }
+}
+
+
+/**
+ * Returns the index of the calling thread's preferred region.
+ */
+static int home_region(){
+    if (home_ticket == 0){
+        home_ticket = __atomic_add_fetch(&next_home, 1, __ATOMIC_RELAXED);
+    }
+    return home_ticket % region_count;
+}
+
+
+/**
+ * Allocates a block, taking the region locks it needs.
+ *
+ * Behavior:
+ * - Tries the calling thread's preferred region first, then steals from the other regions in turn.
+ * - Falls back to letting a region grow into its neighbours when no single region has room.
+ */
+void* mem_pool_alloc(size_t size){
+    if (region_count == 1){
+        region_lock(&regions[0]);
+        void* ptr = region_alloc(&regions[0], size);
+        region_unlock(&regions[0]);
+        return ptr;
+    }
+
+    int home = home_region();
+    for (int i = 0; i < region_count; i++){
+        struct pool_region* region = &regions[(home + i) % region_count];
+        region_lock(region);
+        void* ptr = region_alloc(region, size);
+        region_unlock(region);
+        if (ptr != NULL){
+            return ptr;
+        }
+    }
+    return spanning_alloc(size);
+}
+
+
+/**
+ * Tells whether a pointer lies outside the pool, which spilled blocks always do.
+ */
+static inline int outside_pool(void* block){
+    return block != NULL && ((char*)block < memory_pool || (char*)block >= memory_pool + pool_size);
+}
+
+
+// Looks up the size of a block outside reservations, defined with mem_resize below
+static size_t pool_block_size(void* block);
+
+
+/**
+ * Checks a request against the quota of the calling thread, if it has one.
+ */
+static inline int within_quota(size_t size){
+    return thread_quota == 0 || thread_balance + (ptrdiff_t)size <= (ptrdiff_t)thread_quota;
+}
+
+
+/**
+ * Charges a new block to, or credits a freed one (with `sign` -1) to, the quota of the calling thread.
+ * Blocks inside a reservation count as 0, since the reservation as a whole is charged.
+ */
+static inline void charge(void* block, int sign){
+    if (thread_quota != 0 && block != NULL){
+        thread_balance += sign * (ptrdiff_t)pool_block_size(block);
+    }
+}
+
+
+/**
+ * Counts an allocation for mem_stats, as failed if it returned `NULL`.
+ */
+static inline void* counted(void* ptr){
+    mem_count(ptr != NULL ? MEM_COUNT_ALLOCS : MEM_COUNT_FAILED);
+    return ptr;
+}
+
+
+/**
+ * Hands a request to the allocator that serves it, see mem_alloc.
+ */
+static void* route_alloc(size_t size){
+    if (size_classes && size <= MEM_CLASS_MAX_SIZE){
+        void* ptr = magazines ? mem_mag_alloc(size) : mem_class_alloc(size);
+        if (ptr != NULL){
+            mem_count_add(MEM_COUNT_HELD_BYTES, mem_class_size(ptr));
+            return ptr;
+        }
+    }
+    if (bitmap_granules && size < MEM_BITMAP_MAX_SIZE){
+        void* ptr = mem_bitmap_alloc(size);
+        if (ptr != NULL){
+            mem_count_add(MEM_COUNT_HELD_BYTES, mem_bitmap_size(ptr));
+            return ptr;
+        }
+    }
+    void* ptr = flat_combining ? mem_combine(MEM_COMBINE_ALLOC, size, NULL) : mem_pool_alloc(size);
+    if (ptr == NULL && spill){
+        ptr = mem_spill_alloc(size);
+    }
+    return ptr;
+}
+
+
+/**
+ * Allocates a block of memory of the requested size from the pool.
+ *
+ * @param size The size of the block to allocate.
+ * @return Pointer to the allocated memory, or `NULL` if allocation fails.
+ *
+ * Behavior:
+ * - Creates a default sized pool first if `mem_init` has not been called.
+ * - Fails without touching the pool if the block would exceed the quota of the calling thread.
+ * - Pops a block off the size class stack for requests of at most MEM_CLASS_MAX_SIZE bytes
+ *   if the pool was initialized with MEM_INIT_SIZE_CLASSES, falling back to the pool when the class runs dry.
+ *   With MEM_INIT_MAGAZINES the block comes from the magazine of the calling CPU first.
+ * - Takes requests below MEM_BITMAP_MAX_SIZE from the granule bitmap if the pool was initialized
+ *   with MEM_INIT_BITMAP, falling back to the pool when no run of granules is long enough.
+ * - Hands the request to the flat-combining front end if the pool was initialized with MEM_INIT_FLAT_COMBINING.
+ * - Searches for a free memory block large enough to satisfy the request.
+ * - Maps a block of its own if the pool has none large enough and was initialized with MEM_INIT_SPILL.
+ * - If a suitable block is found, it is split into two blocks: one for the allocated memory,
+ *   and the remaining part becomes a new free block.
+ * - The function returns a pointer to the allocated memory or `NULL` if no suitable block is found.
+ */
+void* mem_alloc(size_t size){
+    ensure_init();
+
+    if (thread_quota == 0){
+        return counted(route_alloc(size));
+    }
+    if (!within_quota(size)){
+        return counted(NULL);
+    }
+    void* ptr = route_alloc(size);
+    charge(ptr, 1);
+    return counted(ptr);
+}
+
+
+/**
+ * Allocates a block close after another one, so that data used together shares pages and cache lines.
+ *
+ * @param hint A block that is used together with the new one, or `NULL`.
+ * @param size The size of the block to allocate.
+ * @return Pointer to the allocated memory, or `NULL` if allocation fails.
+ *
+ * Behavior:
+ * - Takes the first free block large enough among the MEM_NEAR_WINDOW blocks after the hint in
+ *   its region, if it starts within MEM_NEAR_DISTANCE bytes of the hint.
+ * - Otherwise, and for hints outside the pool, allocates as mem_alloc does.
+ * - Bypasses the size classes, the bitmap and the fast bins, whose blocks are not placed by address.
+ */
+void* mem_alloc_near(void* hint, size_t size){
+    ensure_init();
+    if (!within_quota(size)){
+        return counted(NULL);
+    }
+
+    void* ptr = NULL;
+    struct pool_region* region = lock_owner(hint);
+    if (region != NULL){
+        struct block_table* blocks = &region->blocks;
+        size_t i = mem_table_find_fit_after(blocks, hint, size, MEM_NEAR_WINDOW);
+        if (i < blocks->count && mem_table_start(blocks, i) - (char*)hint <= MEM_NEAR_DISTANCE){
+            ptr = take_block(blocks, i, size);
+        }
+        region_unlock(region);
+    }
+
+    if (ptr == NULL){
+        ptr = route_alloc(size);
+    }
+    charge(ptr, 1);
+    return counted(ptr);
+}
+
+
+/**
+ * Allocates `size` bytes at the end of free block `i` of a table whose lock the caller holds,
+ * leaving the start of the block free.
+ */
+static void* take_tail(struct block_table* blocks, size_t i, size_t size){
+    char* start = mem_table_start(blocks, i);
+    size_t block_size = mem_table_size(blocks, i);
+
+    // Without room in the table, or for a remainder too small to split off, the whole block is taken
+    if (block_size - size < MEM_MIN_SPLIT || !mem_table_insert(blocks, i + 1, start + block_size - size, size, 0)){
+        mem_table_set(blocks, i, block_size, 0);
+        return start;
+    }
+    mem_table_set(blocks, i, block_size - size, 1);
+    return start + block_size - size;
+}
+
+
+/**
+ * Allocates a block from the top of the pool, scanning the regions from the last one down.
+ *
+ * @return Pointer to the block, or `NULL` if no region has a free block large enough.
+ */
+static void* cold_alloc(size_t size){
+    for (int r = region_count - 1; r >= 0; r--){
+        struct pool_region* region = &regions[r];
+        region_lock(region);
+        size_t i = mem_table_find_last_fit(&region->blocks, size);
+        void* ptr = i < region->blocks.count ? take_tail(&region->blocks, i, size) : NULL;
+        region_unlock(region);
+        if (ptr != NULL){
+            return ptr;
+        }
+    }
+    return NULL;
+}
+
+
+/**
+ * Allocates a block placed by how often it will be touched.
+ *
+ * @param size The size of the block to allocate.
+ * @param flags MEM_HOT, MEM_COLD, or 0 for mem_alloc placement.
+ * @return Pointer to the allocated memory, or `NULL` if allocation fails.
+ *
+ * Behavior:
+ * - Takes MEM_HOT blocks first fit from the hot arena if the pool was initialized with
+ *   MEM_INIT_HOT_ARENA, which keeps them packed on a few huge pages. Like blocks of a
+ *   reservation they are not charged to the quota of the calling thread.
+ * - Takes MEM_COLD blocks from the end of the highest free block large enough, away from the
+ *   first fit blocks at the start of the pool and their pages.
+ * - MEM_HOT wins if both are given. Falls back to mem_alloc placement when the arena or the
+ *   pool has no room, so a placement flag never makes allocation fail.
+ * - The block is freed with mem_free like any other.
+ */
+void* mem_alloc_flags(size_t size, int flags){
+    ensure_init();
+    if (!within_quota(size)){
+        return counted(NULL);
+    }
+
+    void* ptr = NULL;
+    struct mem_reservation* arena = hot_arena;
+    if ((flags & MEM_HOT) && arena != NULL){
+        mem_lock_acquire(&arena->lock);
+        ptr = no_lock_alloc(&arena->blocks, size);
+        mem_lock_release(&arena->lock);
+    }
+    else if (flags & MEM_COLD){
+        ptr = cold_alloc(size);
+    }
+
+    if (ptr == NULL){
+        ptr = route_alloc(size);
+    }
+    charge(ptr, 1);
+    return counted(ptr);
+}
+
+
+/**
+ * mem_free without lock, within one region whose lock the caller holds.
+ *
+ * @return 1 if the block was found and freed, 0 otherwise.
+ */
+static int no_lock_free(struct pool_region* region, void* block){
+    struct block_table* blocks = &region->blocks;
+    size_t i = mem_table_find(blocks, block);
+    if (i == blocks->count){
+        return 0;
+    }
+
+    mark_free(blocks, i);
+    region->dirty = 1;
+    return 1;
+}
+
+
+/**
+ * Finds the reservation a pointer lies in and locks it. The caller holds `reservations_lock`.
+ *
+ * @return The locked reservation, or `NULL` if the pointer is in none.
+ */
+static struct mem_reservation* lock_reservation(void* block){
+    for (struct mem_reservation* r = reservations; r != NULL; r = r->next){
+        if ((char*)block >= r->start && (char*)block < r->end){
+            mem_lock_acquire(&r->lock);
+            return r;
+        }
+    }
+    return NULL;
+}
+
+
+/**
+ * Frees a block that lies inside a reservation rather than being a block of a region.
+ */
+static void reserved_free(void* block){
+    mem_lock_acquire(&reservations_lock);
+    struct mem_reservation* r = lock_reservation(block);
+    if (r != NULL){
+        size_t i = mem_table_find(&r->blocks, block);
+        if (i < r->blocks.count){
+            mark_free(&r->blocks, i);
+        }
+        mem_lock_release(&r->lock);
+    }
+    mem_lock_release(&reservations_lock);
+}
 
-// Mutex for synchronizing memory allocation operations
-pthread_mutex_t memory_mutex = PTHREAD_MUTEX_INITIALIZER;
 
-// // Used for one-time initialization of the memory pool
-// pthread_once_t init_once = PTHREAD_ONCE_INIT;
+/**
+ * Returns the size of a block that lies inside a reservation, or 0 if it is not one.
+ */
+static size_t reserved_size(void* block){
+    size_t size = 0;
+    mem_lock_acquire(&reservations_lock);
+    struct mem_reservation* r = lock_reservation(block);
+    if (r != NULL){
+        size_t i = mem_table_find(&r->blocks, block);
+        size = i < r->blocks.count ? mem_table_size(&r->blocks, i) : 0;
+        mem_lock_release(&r->lock);
+    }
+    mem_lock_release(&reservations_lock);
+    return size;
+}
 
 
 /**
- * Defines a block of memory in the custom memory manager.
+ * Frees a block, taking the region locks it needs.
  *
- * Each block contains a pointer to the memory it manages, the size of the block, 
- * a flag indicating if it's free or in use, and a pointer to the next memory block.
+ * Behavior:
+ * - Locks only the region the block lies in.
+ * - Parks small blocks in a fast bin, unmerged, so the next request of the same size reuses them.
+ * - Hands space the region borrowed from its neighbour back if the free made it available.
+ * - Frees the block from its reservation if it is not a block of the region but lies inside one.
  */
-struct memory_block{
-    void* ptr; // Point to memory
-    size_t size;
-    int free;
+void mem_pool_free(void* block){
+    struct pool_region* region = lock_owner(block);
+    if (region == NULL){
+        return;
+    }
 
-    struct memory_block* next; // Point to next block
-};
+    if (fast_bins && park(region, block)){
+        region_unlock(region);
+        return;
+    }
+    int freed = no_lock_free(region, block);
+    if (freed && region_count > 1){
+        return_borrowed(region - regions);
+    }
+    region_unlock(region);
+
+    if (!freed && __atomic_load_n(&reservations, __ATOMIC_RELAXED) != NULL){
+        reserved_free(block);
+    }
+}
 
 
-// Global variables for managing the memory pool and block list
-static char* memory_pool = NULL; // Pointer to memory_pool
-static struct memory_block* first_block = NULL; // Pointer to first block in pool
+/**
+ * Frees a previously allocated block of memory, making it available for reuse.
+ *
+ * @param block Pointer to the block of memory to free.
+ *
+ * Behavior:
+ * - Credits the block to the quota of the calling thread, if it has one.
+ * - Unmaps blocks that spilled out of the pool, recognized by their address and header in O(1).
+ * - Pushes blocks of the size class arena back on their stack, without any lock, or into the
+ *   magazine of the calling CPU for MEM_INIT_MAGAZINES.
+ * - Clears the bits of blocks of the bitmap arena, without any lock.
+ * - Hands the request to the flat-combining front end if the pool was initialized with MEM_INIT_FLAT_COMBINING.
+ * - Marks the block as free in the memory manager.
+ * - If adjacent memory blocks are also free, they are merged to form a larger block.
+ */
+void mem_free(void* block){
+    if (block != NULL){
+        mem_count(MEM_COUNT_FREES);
+    }
+    charge(block, -1);
+
+    if (spill && outside_pool(block) && mem_spill_free(block)){
+        return;
+    }
+    if (size_classes){
+        size_t size = mem_class_size(block); // Looked up first, another thread can reuse the block once freed
+        if (magazines ? mem_mag_free(block) : mem_class_free(block)){
+            mem_count_add(MEM_COUNT_HELD_BYTES, (size_t)0 - size);
+            return;
+        }
+    }
+    if (bitmap_granules){
+        size_t size = mem_bitmap_size(block); // 0 for pointers into the arena it ignores
+        if (mem_bitmap_free(block)){
+            mem_count_add(MEM_COUNT_HELD_BYTES, (size_t)0 - size);
+            return;
+        }
+    }
+    if (flat_combining){
+        mem_combine(MEM_COMBINE_FREE, 0, block);
+        return;
+    }
+    mem_pool_free(block);
+}
 
 
 /**
- * Creates a new memory block in the memory manager.
+ * Sets space aside that only allocations through the returned token can use.
  *
- * @param ptr Pointer to the start of the memory block.
- * @param size Size of the memory block in bytes.
- * @param free Indicates whether the block is free (1) or in use (0).
- * @param next Pointer to the next memory block.
- * @return Pointer to the newly created memory block.
+ * @param bytes Bytes to set aside.
+ * @return The reservation, or `NULL` if the pool has no free block of `bytes` bytes.
  *
  * Behavior:
- * - Allocates memory for a new memory block structure.
- * - Initializes the block with the provided values for `ptr`, `size`, `free`, and `next`.
+ * - Takes the space from the pool as one block and gives it a block table of its own.
+ * - Charges the quota of the calling thread for the whole reservation, if it has one.
  */
-struct memory_block* make_block(void* ptr, size_t size, int free, struct memory_block* next){ // Makes a new block and room for its header
-    struct memory_block* new_block = (struct memory_block*)malloc(sizeof(struct memory_block));
-    *new_block = (struct memory_block){ptr, size, free, next};
+struct mem_reservation* mem_reserve(size_t bytes){
+    ensure_init();
+    if (!within_quota(bytes)){
+        return NULL;
+    }
 
-    return new_block;
+    struct mem_reservation* r = new_reservation(bytes);
+    if (r != NULL){
+        charge(r->block, 1);
+    }
+    return r;
 }
 
 
 /**
- * Initializes the memory pool with the specified size.
+ * mem_reserve without the quota, which the MEM_INIT_HOT_ARENA arena is not charged to.
+ */
+static struct mem_reservation* new_reservation(size_t bytes){
+    if (bytes > MEM_TABLE_MAX_BLOCK - MEM_RESERVE_HEADROOM){
+        return NULL;
+    }
+
+    struct mem_reservation* r = (struct mem_reservation*)malloc(sizeof(struct mem_reservation));
+    if (r == NULL){
+        return NULL;
+    }
+    r->block = internal_alloc(bytes + MEM_RESERVE_HEADROOM);
+    if (r->block == NULL){
+        free(r);
+        return NULL;
+    }
+    r->start = r->block + MEM_RESERVE_HEADROOM;
+    r->end = r->start + bytes;
+    if (!mem_table_init(&r->blocks, memory_pool, r->start, bytes, 0)){
+        internal_free(r->block);
+        free(r);
+        return NULL;
+    }
+    r->lock = (struct mem_lock)MEM_LOCK_INITIALIZER;
+
+    mem_lock_acquire(&reservations_lock);
+    r->next = reservations;
+    __atomic_store_n(&reservations, r, __ATOMIC_RELAXED);
+    mem_lock_release(&reservations_lock);
+    return r;
+}
+
+
+/**
+ * Allocates a block from a reservation.
  *
- * @param size Size of the memory pool to allocate.
+ * @param token The reservation from mem_reserve, or `NULL` for the pool.
+ * @param size The size of the block to allocate.
+ * @return Pointer to the allocated memory, or `NULL` if allocation fails.
  *
  * Behavior:
- * - Allocates memory of the specified size for the pool.
- * - Creates the first memory block in the pool, marking the entire pool as free.
+ * - Only takes the lock of the reservation, which no other allocation contends for.
+ * - Does not charge the quota of the calling thread again; the reservation already was.
+ * - Falls back to mem_alloc when the reservation has no free block large enough.
+ * - The block is freed with mem_free like any other.
  */
-void mem_init(size_t size){
-    memory_pool = malloc(size); // Allocate memory pool
-    first_block = make_block(memory_pool, size, 1, NULL); // Make header for first block pointing to the pool
+void* mem_alloc_reserved(struct mem_reservation* token, size_t size){
+    if (token == NULL){
+        return mem_alloc(size);
+    }
+
+    mem_lock_acquire(&token->lock);
+    void* ptr = no_lock_alloc(&token->blocks, size);
+    mem_lock_release(&token->lock);
+    return ptr != NULL ? counted(ptr) : mem_alloc(size);
 }
 
 
 /**
- * mem_alloc without lock
+ * Unlinks a reservation, whose lock the caller holds together with `reservations_lock`,
+ * and frees its table.
  */
-void* no_lock_alloc(size_t size){
-    struct memory_block* current = first_block;
+static void drop_reservation(struct mem_reservation* r){
+    struct mem_reservation** link = &reservations;
+    while (*link != r){
+        link = &(*link)->next;
+    }
+    __atomic_store_n(link, r->next, __ATOMIC_RELAXED);
+    mem_table_destroy(&r->blocks);
+}
 
-    while (current != NULL) {
-        if (current->free && current->size >= size) {
-            
-            current->free = 0;
-            
-            struct memory_block* new_block = make_block((char*)current->ptr + size, current->size - size, 1, current->next);
-            
-            current->size = size;
-            current->next = new_block;
 
-            return current->ptr; // Return pointer to the data part
-        }
-        current = current->next;
+/**
+ * Gives a reservation back to the pool.
+ *
+ * @param token The reservation from mem_reserve.
+ *
+ * Behavior:
+ * - Frees every block still allocated from it at once.
+ * - Credits the quota of the calling thread for the whole reservation, if it has one.
+ */
+void mem_unreserve(struct mem_reservation* token){
+    if (token == NULL){
+        return;
     }
-    return NULL;
+
+    mem_lock_acquire(&reservations_lock);
+    mem_lock_acquire(&token->lock);
+    drop_reservation(token);
+    mem_lock_release(&token->lock);
+    mem_lock_release(&reservations_lock);
+
+    charge(token->block, -1);
+    internal_free(token->block);
+    free(token);
 }
 
 
 /**
- * Allocates a block of memory of the requested size from the pool.
+ * Forgets every reservation, for mem_reset and mem_deinit, which drop their space with the rest of the pool.
+ */
+static void free_reservations(){
+    mem_lock_acquire(&reservations_lock);
+    while (reservations != NULL){
+        struct mem_reservation* r = reservations;
+        drop_reservation(r);
+        free(r);
+    }
+    hot_arena = NULL;
+    mem_lock_release(&reservations_lock);
+}
+
+
+/**
+ * Allocates a movable block from the handle arena.
  *
  * @param size The size of the block to allocate.
- * @return Pointer to the allocated memory, or `NULL` if allocation fails.
+ * @return The handle, or 0 if the pool was not initialized with MEM_INIT_HANDLES or the arena has no gap large enough.
  *
  * Behavior:
- * - Searches for a free memory block large enough to satisfy the request.
- * - If a suitable block is found, it is split into two blocks: one for the allocated memory, 
- *   and the remaining part becomes a new free block.
- * - The function returns a pointer to the allocated memory or `NULL` if no suitable block is found.
+ * - The arena is managed apart from the regions, so blocks there can move without any
+ *   pointer into them going stale: only pinned blocks have addresses handed out.
+ * - Handles are not charged to the quota of the calling thread.
  */
-void* mem_alloc(size_t size){
-    pthread_mutex_lock(&memory_mutex);
-    void* ptr = no_lock_alloc(size);
-    pthread_mutex_unlock(&memory_mutex);
-    return ptr;
+mem_handle mem_halloc(size_t size){
+    ensure_init();
+    return handles ? mem_handle_alloc(size) : 0;
 }
 
 
-void no_lock_free(void* block){
-    struct memory_block* current = first_block;
-    struct memory_block* prev = NULL;
+/**
+ * Pins a movable block and returns its address, valid until the matching mem_hunlock.
+ * Returns `NULL` without handles, such as for a handle kept past mem_deinit or mem_reset.
+ */
+void* mem_hlock(mem_handle handle){
+    return handles ? mem_handle_pin(handle) : NULL;
+}
 
-    while (current != NULL){
-        
-        if (current->ptr == block){
-            current->free = 1;
-            if (current->next != NULL && current->next->free == 1){
-                struct memory_block* next = current->next;
-                current->next = next->next;
-                current->size += next->size;
-                free(next);
-            }
-            if (prev != NULL && prev->free == 1){
-                prev->next = current->next;
-                prev->size += current->size;
-                free(current);
-            }
-            return;
-        }
-        prev = current;
-        current = current->next;
+
+/**
+ * Unpins a movable block, after which it may move.
+ */
+void mem_hunlock(mem_handle handle){
+    if (handles){
+        mem_handle_unpin(handle);
     }
 }
 
 
 /**
- * Frees a previously allocated block of memory, making it available for reuse.
+ * Frees a movable block, pinned or not.
+ */
+void mem_hfree(mem_handle handle){
+    if (handles){
+        mem_handle_free(handle);
+    }
+}
+
+
+/**
+ * Runs one bounded step of compacting the movable blocks.
  *
- * @param block Pointer to the block of memory to free.
+ * @param budget Roughly the bytes to move in this step.
+ * @return 1 if there is more to do, 0 once the unpinned blocks are packed.
+ */
+int mem_hcompact(size_t budget){
+    return handles ? mem_handle_compact(budget) : 0;
+}
+
+
+/**
+ * Limits how many bytes the calling thread may have allocated at once.
+ *
+ * @param bytes The quota, or 0 for none.
  *
  * Behavior:
- * - Marks the block as free in the memory manager.
- * - If adjacent memory blocks are also free, they are merged to form a larger block.
+ * - Starts counting from zero, so blocks allocated before are not charged.
+ * - Only the calling thread is affected; the counters are thread-local, so checking the quota
+ *   touches no shared memory.
  */
-void mem_free(void* block){
-    pthread_mutex_lock(&memory_mutex);
-    no_lock_free(block);
-    pthread_mutex_unlock(&memory_mutex);
+void mem_set_thread_quota(size_t bytes){
+    thread_quota = bytes;
+    thread_balance = 0;
+}
+
+
+/**
+ * Returns the bytes charged to the quota of the calling thread, 0 if it has none.
+ */
+size_t mem_thread_usage(){
+    return thread_balance > 0 ? (size_t)thread_balance : 0;
+}
+
+
+/**
+ * Looks up an allocated block of the block table of a region and returns its size.
+ *
+ * @return The size of the block, or 0 if `block` is not one.
+ */
+static size_t region_block_size(void* block){
+    struct pool_region* region = lock_owner(block);
+    if (region == NULL){
+        return 0;
+    }
+
+    size_t i = mem_table_find(&region->blocks, block);
+    size_t size = i < region->blocks.count ? mem_table_size(&region->blocks, i) : 0;
+
+    region_unlock(region);
+    return size;
+}
+
+
+/**
+ * Looks up an allocated block and returns its size, not counting blocks inside reservations.
+ *
+ * @return The size of the block, or 0 if `block` is not an allocated block of the pool.
+ */
+static size_t pool_block_size(void* block){
+    if (spill && outside_pool(block)){
+        return mem_spill_size(block);
+    }
+    if (size_classes){
+        size_t class_size = mem_class_size(block);
+        if (class_size > 0){
+            return class_size;
+        }
+    }
+    if (bitmap_granules){
+        size_t bitmap_size = mem_bitmap_size(block);
+        if (bitmap_size > 0){
+            return bitmap_size;
+        }
+    }
+
+    return region_block_size(block);
+}
+
+
+/**
+ * Allocates a block of the pool for the allocator's own use, such as an arena or a reservation,
+ * and leaves it out of the bytes mem_stats reports as live.
+ *
+ * Behavior:
+ * - Adds the size to `internal_bytes` before the table adds the block, and the slack after,
+ *   so mem_stats never counts the block as live in between.
+ */
+static void* internal_alloc(size_t size){
+    __atomic_add_fetch(&internal_bytes, size, __ATOMIC_RELAXED);
+    void* block = mem_pool_alloc(size);
+    size_t block_size = block != NULL ? region_block_size(block) : 0;
+    __atomic_add_fetch(&internal_bytes, block_size - size, __ATOMIC_RELAXED); // Wraps around to take the size off on failure
+    return block;
+}
+
+
+/**
+ * Frees a block from internal_alloc, taking its size off `internal_bytes` only once the table
+ * has taken it off.
+ */
+static void internal_free(void* block){
+    size_t size = region_block_size(block);
+    mem_pool_free(block);
+    __atomic_sub_fetch(&internal_bytes, size, __ATOMIC_RELAXED);
+}
+
+
+/**
+ * Looks up an allocated block, also inside reservations, and returns its size.
+ *
+ * @return The size of the block, or 0 if `block` is not an allocated block of the pool.
+ */
+static size_t allocated_size(void* block){
+    size_t size = pool_block_size(block);
+    if (size == 0 && block != NULL && __atomic_load_n(&reservations, __ATOMIC_RELAXED) != NULL){
+        return reserved_size(block);
+    }
+    return size;
 }
 
 
@@ -161,58 +2113,342 @@ void mem_free(void* block){
  *
  * Behavior:
  * - If the block is large enough for the new size, the function returns the same block.
- * - If the block is too small, a new block is allocated, and the contents of the old block are copied to the new one.
- * - The old block is freed after the data is copied.
+ * - If the block is too small, a new block is allocated, the contents are copied with no lock
+ *   held, and the old block is freed afterwards.
+ * - Both blocks belong to the caller during the copy, so no other thread can touch them.
  */
 void* mem_resize(void* block, size_t size){
-    pthread_mutex_lock(&memory_mutex);
-
-    struct memory_block* current_block = first_block;
-
-    while (current_block != NULL){
-        if (current_block->ptr == block){
-            break;
-        }
-        current_block = current_block->next;
+    if (block == NULL){
+        return mem_alloc(size);
     }
+    mem_count(MEM_COUNT_RESIZES);
 
-    if (current_block->size >= size){
-        pthread_mutex_unlock(&memory_mutex);
+    // Zero for blocks that are not from this pool, which then fail below
+    size_t old_size = allocated_size(block);
+
+    if (old_size >= size && old_size > 0){
         return block;
     };
+    if (old_size == 0 && size > 0){
+        return NULL;
+    }
 
-    char* new_ptr = no_lock_alloc(size); // Allocate new block with new size
+    char* new_ptr = mem_alloc(size); // Allocate new block with new size
 
     if (new_ptr != NULL){
-    
-        memcpy(new_ptr, block, current_block->size); 
-        no_lock_free(block); // Free old block
+        mem_copy(new_ptr, block, old_size);
+        mem_free(block); // Free old block
     }
 
-    pthread_mutex_unlock(&memory_mutex);
     return new_ptr;
 }
 
 
+/**
+ * Returns the number of bytes that can be used in an allocated block.
+ *
+ * @param block Pointer to an allocated block.
+ * @return The capacity of the block, or 0 if `block` is NULL or not from the pool.
+ *
+ * Behavior:
+ * - The capacity includes any slack that was too small to split off when the block was allocated,
+ *   so it can be larger than the size that was requested.
+ */
+size_t mem_usable_size(void* block){
+    if (block == NULL){
+        return 0;
+    }
+    return allocated_size(block);
+}
+
+
+/**
+ * Returns the capacity a request of the given size is guaranteed to get.
+ *
+ * @param size The size a caller is about to request.
+ * @return The capacity of the block `mem_alloc(size)` would return, not counting placement slack.
+ *
+ * Behavior:
+ * - Blocks are sized to the byte, so this is `size` itself. Slack below MEM_MIN_SPLIT depends on
+ *   which free block is picked and is only known afterwards through `mem_usable_size`.
+ */
+size_t mem_good_size(size_t size){
+    return size;
+}
+
+
+/**
+ * Copies the contention statistics of the locks guarding the pool.
+ *
+ * @param stats Where to store the statistics.
+ *
+ * Behavior:
+ * - Sums the statistics of all regions, reading each under its lock.
+ * - Reports all zeros when the pool is not locked at all (MEM_INIT_SINGLE_THREAD).
+ * - Only `acquisitions` and `contended` are kept for MEM_INIT_PTHREAD_MUTEX.
+ */
+void mem_lock_stats(struct mem_lock_stats* stats){
+    *stats = (struct mem_lock_stats){0};
+    if (lock_ops->stats == NULL){
+        return;
+    }
+
+    for (int i = 0; i < region_count; i++){
+        region_lock(&regions[i]);
+        struct mem_lock_stats* region_stats = lock_ops->stats(&regions[i]);
+        stats->acquisitions += region_stats->acquisitions;
+        stats->contended += region_stats->contended;
+        stats->spins += region_stats->spins;
+        stats->sleeps += region_stats->sleeps;
+        region_unlock(&regions[i]);
+    }
+}
+
+
+/**
+ * Copies the wait and hold time histograms of the pool locks.
+ *
+ * @param hist Where to store the histograms.
+ * @return 1 for builds with MEM_LOCK_HISTOGRAMS, 0 otherwise.
+ *
+ * Behavior:
+ * - Adds up the histograms of every thread, see mem_count_read.
+ * - Zeroes `hist` for builds without histograms.
+ */
+int mem_lock_histogram(struct mem_lock_histogram* hist){
+    *hist = (struct mem_lock_histogram){0};
+#ifdef MEM_LOCK_HISTOGRAMS
+    size_t counts[MEM_COUNT_KINDS];
+    mem_count_read(counts);
+    for (int b = 0; b < MEM_LOCK_HISTOGRAM_BUCKETS; b++){
+        hist->wait[b] = counts[MEM_COUNT_WAIT + b];
+        hist->hold[b] = counts[MEM_COUNT_HOLD + b];
+    }
+    return 1;
+#else
+    return 0;
+#endif
+}
+
+
+/**
+ * Prints the lock histograms as a table with a row per non-empty bucket.
+ *
+ * Behavior:
+ * - Labels each row with the lowest cycle count of its bucket.
+ * - Prints a single line saying so for builds without histograms.
+ */
+void mem_lock_histogram_dump(FILE* out){
+    struct mem_lock_histogram hist;
+    if (!mem_lock_histogram(&hist)){
+        fprintf(out, "lock histograms not built in, see MEM_LOCK_HISTOGRAMS\n");
+        return;
+    }
+
+    fprintf(out, "%14s %12s %12s\n", "cycles >=", "waits", "holds");
+    for (int b = 0; b < MEM_LOCK_HISTOGRAM_BUCKETS; b++){
+        if (hist.wait[b] > 0 || hist.hold[b] > 0){
+            unsigned long from = b == 0 ? 0 : 1UL << (b - 1);
+            fprintf(out, "%14lu %12lu %12lu\n", from, hist.wait[b], hist.hold[b]);
+        }
+    }
+}
+
+
+/**
+ * Reports how many blocks the pool has and how much metadata describes them.
+ *
+ * @param stats Where to store the statistics.
+ *
+ * Behavior:
+ * - Walks the block table of every region under its lock, so the counts of different regions
+ *   can be from slightly different moments.
+ * - Counts blocks of the general pool. A size class or bitmap arena counts as one live block,
+ *   and its own metadata is not included.
+ * - Counts blocks parked in fast bins separately; they are neither live nor part of `free_bytes`.
+ * - Adds the live bytes up from the allocated bytes of every block table, less parked blocks
+ *   and the blocks the allocator holds for itself, the bytes of size class and bitmap blocks
+ *   every thread counts as it allocates and frees them, and the spilled bytes. Nothing is
+ *   shared between the allocations of different regions and threads, so they are only added
+ *   up here, and their peak is the most that any call has seen.
+ * - Adds the operation counts of every thread up, see mem_count_read.
+ */
+void mem_stats(struct mem_stats* stats){
+    *stats = (struct mem_stats){0};
+    stats->pool_size = pool_size;
+    size_t table_bytes = 0; // Allocated in the block tables and not parked
+
+    for (int i = 0; i < region_count; i++){
+        struct block_table* blocks = &regions[i].blocks;
+        region_lock(&regions[i]);
+        stats->parked_blocks += regions[i].parked;
+        for (size_t j = 0; j < blocks->count; j++){
+            if (mem_table_is_free(blocks, j)){
+                stats->free_blocks++;
+                stats->free_bytes += mem_table_size(blocks, j);
+                if (mem_table_size(blocks, j) > stats->largest_free_block){
+                    stats->largest_free_block = mem_table_size(blocks, j);
+                }
+            }
+            else{
+                stats->live_blocks++;
+            }
+        }
+        stats->metadata_bytes += blocks->count * sizeof(uint32_t) + mem_table_anchor_count(blocks->count) * sizeof(uint64_t);
+        stats->reserved_metadata_bytes += blocks->capacity * sizeof(uint32_t) + mem_table_anchor_count(blocks->capacity) * sizeof(uint64_t)
+                                        + mem_tree_reserved_bytes(&blocks->tree);
+        stats->purged_bytes += regions[i].purged;
+        table_bytes += blocks->used - regions[i].parked_bytes;
+        region_unlock(&regions[i]);
+    }
+
+    mem_lock_acquire(&reservations_lock);
+    for (struct mem_reservation* r = reservations; r != NULL; r = r->next){
+        mem_lock_acquire(&r->lock);
+        table_bytes += r->blocks.used;
+        mem_lock_release(&r->lock);
+    }
+    mem_lock_release(&reservations_lock);
+
+    mem_spill_stats(&stats->spilled_blocks, &stats->spilled_bytes);
+    if (magazines){
+        stats->cached_blocks = mem_mag_cached();
+    }
+    stats->live_blocks -= stats->parked_blocks; // Parked blocks are still marked allocated in the tables
+
+    size_t counts[MEM_COUNT_KINDS];
+    mem_count_read(counts);
+    stats->internal_bytes = __atomic_load_n(&internal_bytes, __ATOMIC_RELAXED);
+    // Runs ahead of the tables while an arena is set aside, the sum is then short rather than over
+    table_bytes = table_bytes > stats->internal_bytes ? table_bytes - stats->internal_bytes : 0;
+    stats->live_bytes = table_bytes + counts[MEM_COUNT_HELD_BYTES] + stats->spilled_bytes;
+
+    size_t peak = __atomic_load_n(&peak_live_bytes, __ATOMIC_RELAXED);
+    while (stats->live_bytes > peak && !__atomic_compare_exchange_n(&peak_live_bytes, &peak, stats->live_bytes, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)){
+    }
+    stats->peak_live_bytes = stats->live_bytes > peak ? stats->live_bytes : peak;
+
+    if (stats->live_blocks > 0){
+        stats->overhead_per_block = (stats->metadata_bytes + stats->live_blocks - 1) / stats->live_blocks;
+    }
+    if (stats->free_bytes > 0){
+        stats->fragmentation = 1.0 - (double)stats->largest_free_block / stats->free_bytes;
+    }
+
+    stats->alloc_count = counts[MEM_COUNT_ALLOCS];
+    stats->free_count = counts[MEM_COUNT_FREES];
+    stats->resize_count = counts[MEM_COUNT_RESIZES];
+    stats->failed_allocs = counts[MEM_COUNT_FAILED];
+}
+
+
+/**
+ * Returns the whole pool to a single free block, keeping the pool mapped.
+ *
+ * Behavior:
+ * - Ends every reservation; their tokens must not be used afterwards.
+ * - Unmaps the blocks that spilled out of the pool.
+ * - Forgets every allocation at once: the block tables are emptied as a whole, not block by block,
+ *   so the cost depends on the number of regions only.
+ * - Puts every region back at its nominal boundaries and sets new size class and bitmap arenas aside.
+ * - Keeps the pool mapping and the block tables for the allocations that follow.
+ * - Starts the operation counts and peak of mem_stats from zero.
+ * - Stops the maintenance thread for the duration, since its passes work on the magazines and
+ *   arenas that are set up again, and starts it once they are.
+ * - Does nothing if there is no pool.
+ */
+void mem_reset(){
+    pthread_mutex_lock(&init_mutex);
+
+    if (memory_pool != NULL){
+        int had_hot_arena = hot_arena != NULL;
+        if (maintenance){
+            mem_maint_stop();
+        }
+        free_reservations();
+        mem_spill_release_all();
+        lock_all_regions();
+        layout_regions(); // Tables are only emptied, which cannot fail
+        unlock_all_regions();
+
+        if (had_hot_arena){
+            setup_hot_arena();
+        }
+        if (size_classes){
+            setup_size_classes();
+        }
+        if (bitmap_granules){
+            setup_bitmap();
+        }
+        if (handles){
+            setup_handles();
+        }
+        mem_count_reset();
+        if (maintenance){
+            maintenance = mem_maint_start(maintain);
+        }
+    }
+
+    pthread_mutex_unlock(&init_mutex);
+}
+
+
 /**
  * Deinitializes the memory pool and frees all memory.
  *
  * Behavior:
- * - Frees the entire memory pool.
- * - Resets the pointers for the memory pool and the first block to `NULL`.
+ * - Stops the maintenance thread, if there is one, and ends every reservation.
+ * - Unmaps the blocks that spilled out of the pool.
+ * - Unmaps the entire memory pool and frees the block tables, without visiting each block.
+ *   A shared or file pool is only unmapped, and what is allocated in it stays for the other
+ *   processes or the next run.
+ * - Resets the pointers for the memory pool and the regions to `NULL`.
+ * - Re-arms the lazy initialization, so the next allocation creates a new default pool.
  */
 void mem_deinit(){
-    pthread_mutex_lock(&memory_mutex);
+    pthread_mutex_lock(&init_mutex);
 
-    struct memory_block* current = first_block;
-    while (current != NULL) {
-        struct memory_block* next = current->next;
-        free(current); // Free the current block
-        current = next; // Move to the next block
-    };
+    mem_maint_stop(); // Before the regions it works on go away
+    maintenance = 0;
+    if (segment != NULL){
+        store_segment_counts();
+    }
+    free_reservations();
+    mem_spill_release_all();
+    spill = 0;
+    free_regions();
+    region_count = 0;
+    mem_mag_reset();
+    magazines = 0;
+    mem_class_deinit();
+    size_classes = 0;
+    mem_bitmap_deinit();
+    bitmap_granules = 0;
+    mem_handle_deinit();
+    handles = 0;
+
+    if (segment != NULL){
+        mem_segment_unmap(segment); // What is allocated in it stays for the other processes
+        segment = NULL;
+        if (pool_fd >= 0){
+            close(pool_fd); // Releases the lock on the file
+            pool_fd = -1;
+        }
+    }
+    else if (memory_pool != NULL){
+        munmap(memory_pool, pool_mapped);
+    }
+    __atomic_store_n(&pool_ready, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&memory_pool, NULL, __ATOMIC_RELEASE);
+    pool_size = 0;
+    pool_mapped = 0;
+    mem_count_reset(); // The next pool counts its operations from zero
+
+    // No thread may use the manager during mem_deinit, so nobody can be inside pthread_once here
+    init_once = (pthread_once_t)PTHREAD_ONCE_INIT;
 
-    free(memory_pool);
-    memory_pool = NULL;
-    first_block = NULL;
-    pthread_mutex_unlock(&memory_mutex);
+    lock_ops = &spin_ops; // The next pool starts out with the default lock again
+    flat_combining = 0;
+    fast_bins = 1;
+    pthread_mutex_unlock(&init_mutex);
 }
@@ -19,10 +19,171 @@ extern "C"
      * The memory pool could be any data structure, for instance, a large array
      * or a similar contiguous block of memory.
      *
+     * Calling mem_init is optional: the first allocation creates a default sized pool
+     * if there is none. While a pool exists, further calls do nothing. Pools are limited to
+     * 32 GiB - 16 bytes; larger sizes leave the pool empty so every allocation fails. A single
+     * block of the pool holds at most 2 GiB - 1 bytes.
+     *
      * @param size The size of the memory pool to initialize.
      */
     void mem_init(size_t size);
 
+// Options for mem_init_flags
+#define MEM_INIT_POPULATE 0x1 // Have the kernel populate the whole pool when it is mapped
+#define MEM_INIT_PREFAULT 0x2 // Pre-fault the whole pool from several threads during init
+#define MEM_INIT_SINGLE_THREAD 0x4 // The pool is only used from one thread, skip all locking
+#define MEM_INIT_PTHREAD_MUTEX 0x8 // Guard the pool with a pthread mutex instead of the spinning futex lock
+#define MEM_INIT_FLAT_COMBINING 0x10 // Batch allocations and frees of all threads through one combining thread
+#define MEM_INIT_STRIPED 0x20 // Split the pool into regions with a lock each, so threads allocate side by side
+#define MEM_INIT_SIZE_CLASSES 0x40 // Serve requests of up to 128 bytes from lock-free per-size stacks
+#define MEM_INIT_BITMAP 0x80 // Serve requests below 1 KiB from 16-byte granules tracked by a bitmap
+#define MEM_INIT_NO_FAST_BINS 0x100 // Merge every freed block with its neighbours right away
+#define MEM_INIT_ADDRESS_TREE 0x200 // Find free blocks through a tree keyed by address instead of a scan
+#define MEM_INIT_MAINTENANCE 0x400 // Merge fast bins and give free pages back from a background thread
+#define MEM_INIT_MAGAZINES 0x800 // Like MEM_INIT_SIZE_CLASSES, with the blocks cached in per-CPU magazines
+#define MEM_INIT_SPILL 0x1000 // Map requests the pool cannot serve on their own instead of returning NULL
+#define MEM_INIT_HOT_ARENA 0x2000 // Set a huge-page-backed share of the pool aside for MEM_HOT blocks
+#define MEM_INIT_HANDLES 0x4000 // Set a quarter of the pool aside for movable blocks behind mem_halloc handles
+
+// Placement options for mem_alloc_flags
+#define MEM_HOT 0x1 // Touched often: pack with other hot blocks
+#define MEM_COLD 0x2 // Touched rarely: keep away from the blocks that are
+
+    /**
+     * Initializes the memory manager like mem_init, with extra options. Use MEM_INIT_POPULATE
+     * or MEM_INIT_PREFAULT to take the page faults of the pool during startup instead of
+     * on the first allocations that touch each page. Use MEM_INIT_SINGLE_THREAD when
+     * the pool is only ever used from one thread, to skip locking in every call. Use
+     * MEM_INIT_STRIPED when many threads allocate at once: each thread prefers its own
+     * region of the pool and only locks that region. Use MEM_INIT_SIZE_CLASSES when most
+     * requests are small: a quarter of the pool is set aside for blocks of 56, 64 and
+     * 128 bytes, which are allocated and freed with a single compare-and-swap. Use
+     * MEM_INIT_BITMAP for many small blocks of assorted sizes: a quarter of the pool is
+     * packed in 16-byte granules whose metadata never touches the blocks themselves.
+     * Freed blocks of up to 256 bytes are parked unmerged so the next request of the same
+     * size reuses them at once; they are merged when a request misses. MEM_INIT_NO_FAST_BINS
+     * merges every block as soon as it is freed instead. Use MEM_INIT_ADDRESS_TREE for
+     * long running pools with many free blocks: the lowest addressed block that fits is
+     * found in O(log n) instead of by a linear scan, with the same placement. Use
+     * MEM_INIT_MAINTENANCE to move housekeeping off the allocating threads: a background
+     * thread merges parked blocks and gives the pages of large free blocks back to the
+     * system, which also undoes pre-faulting for them. See mem_tune_maintenance. Use
+     * MEM_INIT_MAGAZINES instead of MEM_INIT_SIZE_CLASSES when many CPUs allocate small
+     * blocks: each CPU keeps two magazines of blocks per class and trades them with a
+     * shared depot, so most requests touch no shared cache line at all. Magazines grow
+     * when the depot is contended, and at most a few are kept per CPU and class. Use
+     * MEM_INIT_SPILL when running out of pool must not fail: requests the pool cannot serve
+     * get a mapping of their own, which is slower but counted in mem_stats. Use
+     * MEM_INIT_HOT_ARENA with mem_alloc_flags: the pool is aligned to a huge page and its
+     * first sixteenth, asked to be backed by huge pages, only holds MEM_HOT blocks. Use
+     * MEM_INIT_HANDLES for long-lived data that can be reached through handles: a quarter
+     * of the pool is set aside for mem_halloc, whose blocks are slid together to undo
+     * fragmentation, by the maintenance thread if there is one.
+     *
+     * @param size The size of the memory pool to initialize.
+     * @param flags Bitwise OR of MEM_INIT_* options, or 0.
+     */
+    void mem_init_flags(size_t size, int flags);
+
+    /**
+     * Initializes the memory manager with a pool that several processes share. The first
+     * process to use a name creates a POSIX shared memory object of that name holding the
+     * pool and its block table; later ones attach to it. Every process can then free and
+     * resize what any of them allocated. Nothing shared is a pointer, so the pool may sit at
+     * a different address in each process: pass blocks to other processes as offsets, see
+     * mem_to_offset. A process-shared robust mutex guards the pool, so a process that dies
+     * while allocating does not block the others forever. If it left the block table half
+     * updated, the next process to take the lock finds out and marks the pool broken: from
+     * then on allocations fail, frees are ignored and attaching fails, while the blocks
+     * already allocated stay readable. The mem_init_flags options are not available, and reservations
+     * are only known to the process that made them. mem_deinit unmaps the pool and leaves
+     * the object; remove it with shm_unlink once no process needs it.
+     *
+     * @param name Name of the shared memory object, such as "/my_pool".
+     * @param size The size of the memory pool, used only by the process that creates it.
+     * @return 1 if the shared pool is in use, 0 if a pool already existed or the object could
+     *         not be created or attached.
+     */
+    int mem_init_shared(const char *name, size_t size);
+
+    /**
+     * Initializes the memory manager with a pool kept in a file, for restarts that find
+     * everything where it was left. The file holds the pool and its block table, and nothing
+     * in it is a pointer, so after a restart the pool is usable as soon as the file is
+     * mapped, wherever it lands: use mem_set_root and mem_get_root to find the data again,
+     * and store offsets rather than pointers in it, see mem_to_offset. Everything written
+     * reaches the file when the process exits, even by a crash; mem_sync also makes it
+     * survive a crash of the system. Only one process can use the file at a time. Like
+     * mem_init_shared, it does not take the mem_init_flags options.
+     *
+     * @param path Path of the file, which is created if it does not exist.
+     * @param size The size of the memory pool, used only if the file is new or empty.
+     * @return 1 if the file pool is in use, 0 if a pool already existed, another process
+     *         holds the file, or the file could not be created or does not hold a pool,
+     *         including one whose block table a crash left half updated.
+     */
+    int mem_init_file(const char *path, size_t size);
+
+    /**
+     * Writes a pool from mem_init_file back to its file and waits until it is on disk.
+     * Allocations wait meanwhile, so the file captures one consistent state.
+     *
+     * @return 1 on success, 0 if the pool is not file-backed or shared, or a write failed.
+     */
+    int mem_sync();
+
+    /**
+     * Records the block that the data of a file or shared pool can be found from, for the
+     * next run or another process to get with mem_get_root. Other pools ignore it.
+     *
+     * @param block A block of the pool, or NULL to clear the root.
+     */
+    void mem_set_root(void *block);
+
+    /**
+     * Returns the block last recorded with mem_set_root in a file or shared pool.
+     *
+     * @return The block, or NULL if no root is set or the pool is neither file-backed nor shared.
+     */
+    void *mem_get_root();
+
+    /**
+     * Returns the offset of a block from the start of the pool, which is the same in every
+     * process sharing the pool.
+     *
+     * @param block A pointer into the pool.
+     * @return The offset, or (size_t)-1 if the pointer is not in the pool.
+     */
+    size_t mem_to_offset(void *block);
+
+    /**
+     * Turns an offset from mem_to_offset into a pointer in the calling process.
+     *
+     * @param offset An offset into the pool.
+     * @return The pointer, or NULL if the offset is not in the pool.
+     */
+    void *mem_from_offset(size_t offset);
+
+    /**
+     * Sets how often the MEM_INIT_MAINTENANCE thread runs and how much of its time it may
+     * spend working. The defaults are a pass every 10 ms and at most 5% of the time. A pass
+     * also runs early when many small blocks wait to be merged, within the same duty cycle.
+     *
+     * @param period_ms Time between passes in milliseconds.
+     * @param duty_percent Upper bound on the share of time spent in passes, 1 to 100.
+     */
+    void mem_tune_maintenance(unsigned int period_ms, unsigned int duty_percent);
+
+    /**
+     * Faults in the first `bytes` of the memory pool, spread over several threads, without
+     * changing its contents. Services can call this during startup to warm the pool before
+     * latency-critical allocations touch it.
+     *
+     * @param bytes The number of bytes to fault in, from the start of the pool.
+     * @return The number of bytes faulted in (clamped to the pool size), or 0 without a pool.
+     */
+    size_t mem_prefault(size_t bytes);
+
     /**
      * Allocates a block of memory of the specified size. This function finds a
      * suitable block in the pool, marks it as allocated, and returns a pointer
@@ -33,6 +194,30 @@ extern "C"
      */
     void *mem_alloc(size_t size);
 
+    /**
+     * Allocates a block close after `hint`, so that data walked together, like the nodes
+     * of a list, shares pages and cache lines. Looks only a short way past the hint and
+     * otherwise allocates as mem_alloc does, so a hint never makes allocation fail.
+     *
+     * @param hint A block the new one is used together with, or NULL for no preference.
+     * @param size The size of the memory block to allocate.
+     * @return A pointer to the allocated memory block, or NULL if allocation fails.
+     */
+    void *mem_alloc_near(void *hint, size_t size);
+
+    /**
+     * Allocates a block placed by how often it is touched, so that frequently used metadata
+     * does not share pages and cache lines with rarely read bulk data. MEM_HOT blocks are
+     * packed into the arena of MEM_INIT_HOT_ARENA, and MEM_COLD blocks are taken from the
+     * top of the pool, away from ordinary blocks. Without room there, or without the arena,
+     * it allocates as mem_alloc does.
+     *
+     * @param size The size of the memory block to allocate.
+     * @param flags MEM_HOT, MEM_COLD, or 0.
+     * @return A pointer to the allocated memory block, or NULL if allocation fails.
+     */
+    void *mem_alloc_flags(size_t size, int flags);
+
     /**
      * Frees the specified block of memory. This function marks the block as free
      * within the memory manager's data structure.
@@ -51,6 +236,238 @@ extern "C"
      */
     void *mem_resize(void *block, size_t size);
 
+    /**
+     * Returns the usable capacity of an allocated block. This can be larger than the
+     * size that was requested, since free space too small to split off is kept with the block.
+     * Growing within this capacity with mem_resize never moves the block.
+     *
+     * @param block A pointer to an allocated memory block.
+     * @return The usable size of the block, or 0 if the block is NULL or unknown.
+     */
+    size_t mem_usable_size(void *block);
+
+    /**
+     * Returns the capacity that a request of the given size is rounded up to, so callers
+     * can size their buffers to what the allocator hands out anyway.
+     *
+     * @param size The size of a prospective allocation.
+     * @return The capacity a block allocated with this size is guaranteed to have.
+     */
+    size_t mem_good_size(size_t size);
+
+    /**
+     * Contention statistics of the locks guarding the memory pool, counted since mem_init.
+     */
+    struct mem_lock_stats
+    {
+        unsigned long acquisitions; // Times the lock was taken
+        unsigned long contended;    // Acquisitions that found the lock held
+        unsigned long spins;        // Pause instructions spent waiting before acquiring
+        unsigned long sleeps;       // Times a waiter went to sleep in the kernel
+    };
+
+    /**
+     * Copies the contention statistics of the locks guarding the memory pool, summed over
+     * all regions for MEM_INIT_STRIPED.
+     *
+     * @param stats Where to store the statistics.
+     */
+    void mem_lock_stats(struct mem_lock_stats *stats);
+
+// Buckets of a lock histogram: bucket 0 counts durations of 0 cycles, bucket b durations of
+// 2^(b-1) to 2^b - 1 cycles, and the last bucket everything longer
+#define MEM_LOCK_HISTOGRAM_BUCKETS 32
+
+    /**
+     * How long threads waited for the locks guarding the memory pool and how long they held
+     * them, in cycles of the time stamp counter, since init or reset.
+     */
+    struct mem_lock_histogram
+    {
+        unsigned long wait[MEM_LOCK_HISTOGRAM_BUCKETS]; // Acquisitions by how long they waited for the lock
+        unsigned long hold[MEM_LOCK_HISTOGRAM_BUCKETS]; // Acquisitions by how long the lock was held
+    };
+
+    /**
+     * Copies the wait and hold time histograms of the locks guarding the memory pool. They
+     * are only kept by builds with MEM_LOCK_HISTOGRAMS defined (`make LOCK_HISTOGRAMS=1`);
+     * other builds have no timing code around the locks at all.
+     *
+     * Each thread records its own acquisitions with `rdtsc` into histograms of its own, which
+     * are added up here. Every acquisition of a region lock is recorded, including the ones
+     * mem_stats and the maintenance thread make.
+     *
+     * @param hist Where to store the histograms; zeroed by builds without them.
+     * @return 1 if the build keeps the histograms, 0 otherwise.
+     */
+    int mem_lock_histogram(struct mem_lock_histogram *hist);
+
+    /**
+     * Prints the lock histograms as a table with a row per non-empty bucket.
+     *
+     * @param out Where to print, such as `stderr`.
+     */
+    void mem_lock_histogram_dump(FILE *out);
+
+    /**
+     * Space set aside by mem_reserve for one owner.
+     */
+    struct mem_reservation;
+
+    /**
+     * Sets `bytes` of the pool aside, so that allocations through the returned token succeed
+     * up to that amount however much other threads allocate meanwhile, and without
+     * contending with them. The space is set aside as one block, so a reservation needs a
+     * free block of its size. Blocks from a reservation are freed with mem_free; mem_unreserve
+     * frees the rest at once. mem_reset and mem_deinit end every reservation.
+     *
+     * @param bytes The number of bytes to set aside.
+     * @return The token, or `NULL` if the space could not be set aside.
+     */
+    struct mem_reservation *mem_reserve(size_t bytes);
+
+    /**
+     * Allocates from a reservation like mem_alloc, falling back to the pool when the
+     * reservation has no room left.
+     *
+     * @param token The token from mem_reserve.
+     * @param size The size of the block to allocate.
+     * @return Pointer to the allocated memory, or `NULL` if allocation fails.
+     */
+    void *mem_alloc_reserved(struct mem_reservation *token, size_t size);
+
+    /**
+     * Gives a reservation back to the pool, freeing every block still allocated from it.
+     *
+     * @param token The token from mem_reserve.
+     */
+    void mem_unreserve(struct mem_reservation *token);
+
+    /**
+     * Refers to a movable block from mem_halloc. 0 is never a valid handle.
+     */
+    typedef uint32_t mem_handle;
+
+    /**
+     * Allocates a block that the manager may move to undo fragmentation. Its address is
+     * only known while it is locked with mem_hlock, and stays put until mem_hunlock.
+     * Handles need a pool initialized with MEM_INIT_HANDLES and are not charged to
+     * thread quotas. Use mem_hfree, not mem_free, to free them.
+     *
+     * @param size The size of the memory block to allocate.
+     * @return The handle, or 0 if allocation fails.
+     */
+    mem_handle mem_halloc(size_t size);
+
+    /**
+     * Pins the block of a handle. Locks nest: the block stays put until every mem_hlock
+     * has been matched by a mem_hunlock.
+     *
+     * @param handle A handle from mem_halloc.
+     * @return The address of the block, or NULL for handle 0 and for handles that were
+     *         freed or belong to an earlier pool.
+     */
+    void *mem_hlock(mem_handle handle);
+
+    /**
+     * Unpins the block of a handle, after which addresses from mem_hlock must not be used.
+     *
+     * @param handle A handle from mem_halloc.
+     */
+    void mem_hunlock(mem_handle handle);
+
+    /**
+     * Frees the block of a handle, locked or not, and makes the handle invalid.
+     *
+     * @param handle A handle from mem_halloc, or 0.
+     */
+    void mem_hfree(mem_handle handle);
+
+    /**
+     * Runs one step of compaction, sliding unlocked handle blocks down over the gaps below
+     * them, and returns within a time bounded by the budget. The MEM_INIT_MAINTENANCE
+     * thread runs a step every pass; without it, call this when idle.
+     *
+     * @param budget About how many bytes the step may move.
+     * @return 1 if there is more to do, 0 once the unlocked blocks are packed.
+     */
+    int mem_hcompact(size_t budget);
+
+    /**
+     * Limits the bytes the calling thread may have allocated at once, so one greedy thread
+     * cannot starve the others. Allocations beyond the quota return `NULL`. Blocks are
+     * charged to the thread that allocates them and credited to the thread that frees them;
+     * the counters are thread-local, so the check touches no shared memory. A reservation
+     * is charged as a whole when it is made.
+     *
+     * @param bytes The quota, or 0 to remove it.
+     */
+    void mem_set_thread_quota(size_t bytes);
+
+    /**
+     * Returns the bytes charged to the quota of the calling thread.
+     *
+     * @return The bytes charged, or 0 if the thread has no quota.
+     */
+    size_t mem_thread_usage();
+
+    /**
+     * Block and metadata counts of the memory pool.
+     */
+    struct mem_stats
+    {
+        size_t pool_size;               // Usable size of the pool
+        size_t live_blocks;             // Allocated blocks
+        size_t free_blocks;             // Free blocks, which fragmentation leaves apart
+        size_t free_bytes;              // Bytes in free blocks
+        size_t largest_free_block;      // Size of the largest free block; its share of free_bytes shows fragmentation
+        size_t parked_blocks;           // Freed small blocks kept unmerged for reuse, see MEM_INIT_NO_FAST_BINS
+        size_t metadata_bytes;          // Bytes of block entries in use, 4 per block and 8 per 16 blocks
+        size_t reserved_metadata_bytes; // Bytes allocated for block entries and address trees, including spare room
+        size_t overhead_per_block;      // metadata_bytes per live block, rounded up
+        size_t purged_bytes;            // Bytes of free pages given back to the system, see MEM_INIT_MAINTENANCE
+        size_t cached_blocks;           // Free size class blocks held in magazines, see MEM_INIT_MAGAZINES
+        size_t spilled_blocks;          // Requests served outside the pool since init or reset, see MEM_INIT_SPILL
+        size_t spilled_bytes;           // Bytes of spilled blocks still allocated
+        size_t live_bytes;              // Bytes in blocks callers hold, including slack too small to split off, see mem_stats
+        size_t peak_live_bytes;         // Most live_bytes any call of mem_stats has seen since init or reset
+        size_t internal_bytes;          // Bytes of the pool set aside as arenas by MEM_INIT_ flags and as reservations
+        double fragmentation;           // 1 - largest_free_block / free_bytes: 0 when the free space is one block, near 1 when it is in crumbs
+        size_t alloc_count;             // Successful allocations since init or reset
+        size_t free_count;              // Calls to mem_free with a block since init or reset
+        size_t resize_count;            // Calls to mem_resize with a block since init or reset
+        size_t failed_allocs;           // Allocations that returned `NULL` since init or reset
+    };
+
+    /**
+     * Reports how many blocks the pool has, how much metadata they cost and how much the
+     * allocator has been used. Every block is described by a 4-byte entry kept outside the
+     * pool, so none of the pool goes to headers.
+     *
+     * The operation counts are kept per thread, each thread in a cache line of its own, and
+     * only added up here, so counting costs allocations no shared writes. A resize that
+     * moves the block also counts as an allocation and a free. `live_bytes` covers the
+     * blocks callers hold in the pool, reservations included, in the size class and bitmap
+     * arenas and spilled out of the pool. Each region keeps the bytes of its own block table
+     * and each thread those of the size class and bitmap blocks it allocates and frees, and
+     * they are only added up here, so allocating writes no shared counter. The sum is read
+     * region by region while other threads go on allocating, so it is not one instant's total.
+     * For the same reason the peak is not tracked as blocks change: `peak_live_bytes` is the
+     * most `live_bytes` any call has seen, a peak between two calls goes unnoticed. Arenas and
+     * reservations are in `internal_bytes` instead. Blocks of the handle arena are not counted,
+     * since callers hold handles rather than blocks.
+     *
+     * @param stats Where to store the statistics.
+     */
+    void mem_stats(struct mem_stats *stats);
+
+    /**
+     * Returns the whole memory pool to free blocks in constant time, invalidating
+     * every outstanding allocation. Unlike mem_deinit followed by mem_init, the pool stays
+     * mapped and its pages stay faulted in.
+     */
+    void mem_reset();
+
     /**
      * Frees up the entire memory pool that was initially allocated by mem_init.
      * This function should be called to clean up the memory manager resources before
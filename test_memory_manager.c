@@ -11,7 +11,12 @@
 #include <dlfcn.h>
 #include <sys/mman.h>
 #include <fcntl.h>
+#include <sys/stat.h>
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
 #include "common_defs.h"
+#include "mem_segment.h" // To die holding the lock of a shared pool
 
 #include <unistd.h>
 
@@ -42,6 +47,7 @@ typedef struct
     int num_blocks;
     size_t block_size;
     bool simulate_work;
+    int init_flags; // Options passed to mem_init_flags by tests that support them
 } TestParams;
 
 // Function to calculate memory allocations for threads based on redistribution logic
@@ -174,6 +180,28 @@ void run_concurrent_test(void *(*test_func)(void *), TestParams params, char *fu
     printf_green("[PASS].\n");
 }
 
+// Short description of the pool options a test runs with
+const char *mode_name(int init_flags)
+{
+    if (init_flags & MEM_INIT_FLAT_COMBINING)
+        return "flat combining";
+    if (init_flags & MEM_INIT_STRIPED)
+        return "striped";
+    if (init_flags & MEM_INIT_MAGAZINES)
+        return "magazines";
+    if (init_flags & MEM_INIT_SIZE_CLASSES)
+        return "size classes";
+    if (init_flags & MEM_INIT_BITMAP)
+        return "granule bitmap";
+    if (init_flags & MEM_INIT_ADDRESS_TREE)
+        return "address tree";
+    if (init_flags & MEM_INIT_MAINTENANCE)
+        return "maintenance thread";
+    if (init_flags & MEM_INIT_PTHREAD_MUTEX)
+        return "pthread mutex";
+    return "spin/futex lock";
+}
+
 void sanityCheck(size_t size, char *block, char expected_value)
 {
     if (block == NULL)
@@ -262,13 +290,13 @@ void *thread_alloc_free(void *arg)
 
 void test_random_blocks_multithread(TestParams params)
 {
-    printf_yellow("  Testing \"mem_alloc\" and mem_free for random blocks (threads: %d, max_block_size: %zu) ---> ", params.num_threads, params.block_size);
+    printf_yellow("  Testing \"mem_alloc\" and mem_free for random blocks (threads: %d, max_block_size: %zu, %s) ---> ", params.num_threads, params.block_size, mode_name(params.init_flags));
     srand(time(NULL)); // Initialize random seed
 
     int total_blocks = 1000 + rand() % 10000;
     int mem_size = total_blocks * params.block_size;
 
-    mem_init(mem_size);
+    mem_init_flags(mem_size, params.init_flags);
 
     pthread_t threads[params.num_threads];
     thread_data_t thread_data[params.num_threads];
@@ -372,6 +400,1329 @@ void test_resize_multithread(TestParams params)
     }
 }
 
+/*
+ * This function tests that a resize which has to move a large block (using the streaming copy path)
+ * preserves the contents of the block.
+ */
+void test_resize_large_copy()
+{
+    printf_yellow("  Testing \"mem_resize\" relocating a large block ---> ");
+
+    size_t initial_size = 4 * 1024 * 1024 + 13; // Odd size to exercise the unaligned head and tail
+    size_t new_size = 2 * initial_size;
+
+    mem_init(4 * initial_size);
+
+    unsigned char *block = mem_alloc(initial_size);
+    my_assert(block != NULL);
+    void *blocker = mem_alloc(64); // Keep the block from growing in place
+    my_assert(blocker != NULL);
+
+    for (size_t i = 0; i < initial_size; i++)
+        block[i] = (unsigned char)(i * 31 + 7);
+
+    unsigned char *resized_block = mem_resize(block, new_size);
+    my_assert(resized_block != NULL);
+
+    int mismatches = 0;
+    for (size_t i = 0; resized_block != NULL && i < initial_size; i++)
+    {
+        if (resized_block[i] != (unsigned char)(i * 31 + 7))
+            mismatches++;
+    }
+    my_assert(mismatches == 0);
+
+    mem_free(resized_block);
+    mem_free(blocker);
+    mem_deinit();
+
+    if (mismatches == 0)
+    {
+        printf_green("[PASS].\n");
+    }
+    else
+    {
+        printf_red("[FAIL]: %d bytes differ after the move.\n", mismatches);
+    }
+}
+
+/*
+ * This function tests that the usable size of a block reports the slack left in it,
+ * and that growing within the usable size does not move the block.
+ */
+void test_usable_size()
+{
+    printf_yellow("  Testing \"mem_usable_size\" and \"mem_good_size\" ---> ");
+
+    mem_init(100);
+
+    my_assert(mem_good_size(90) >= 90);
+
+    void *block = mem_alloc(90); // The remaining 10 bytes are too small to split off
+    my_assert(block != NULL);
+    size_t usable = mem_usable_size(block);
+    my_assert(usable == 100);
+    my_assert(mem_resize(block, usable) == block);
+
+    my_assert(mem_usable_size(NULL) == 0);
+    mem_free(block);
+    mem_deinit();
+
+    printf_green("[PASS].\n");
+}
+
+/*
+ * This function tests that pre-faulting makes the pool resident without changing data already stored in it.
+ */
+void test_prefault()
+{
+    printf_yellow("  Testing \"mem_prefault\" and pre-faulting init flags ---> ");
+
+    size_t pool_size = 16 * 1024 * 1024;
+    long page = sysconf(_SC_PAGESIZE);
+    size_t pages = pool_size / page;
+    unsigned char *resident = malloc(pages);
+
+    mem_init(pool_size);
+    char *block = mem_alloc(pool_size);
+    my_assert(block != NULL);
+    memset(block, 0x5A, 100); // Data written before pre-faulting must survive it
+
+    my_assert(mem_prefault(2 * pool_size) == pool_size); // Clamped to the pool size
+    my_assert(mincore(block, pool_size, resident) == 0);
+    int missing = 0;
+    for (size_t i = 0; i < pages; i++)
+        missing += !(resident[i] & 1);
+    my_assert(missing == 0);
+    sanityCheck(100, block, 0x5A);
+    mem_free(block);
+    mem_deinit();
+
+    mem_init_flags(pool_size, MEM_INIT_POPULATE | MEM_INIT_PREFAULT);
+    block = mem_alloc(pool_size);
+    my_assert(block != NULL);
+    my_assert(mincore(block, pool_size, resident) == 0);
+    missing = 0;
+    for (size_t i = 0; i < pages; i++)
+        missing += !(resident[i] & 1);
+    my_assert(missing == 0);
+    mem_free(block);
+    mem_deinit();
+
+    my_assert(mem_prefault(page) == 0); // No pool to fault in
+    free(resident);
+    printf_green("[PASS].\n");
+}
+
+/*
+ * This function tests that the pool is created on first use, that a second mem_init leaves
+ * the existing pool alone, and that mem_reset hands back the whole pool.
+ */
+void *thread_lazy_alloc(void *arg)
+{
+    return mem_alloc(64);
+}
+
+void test_lazy_init_and_reset(TestParams params)
+{
+    printf_yellow("  Testing lazy init and \"mem_reset\" (threads: %d) ---> ", params.num_threads);
+
+    pthread_t threads[params.num_threads];
+    void *blocks[params.num_threads];
+
+    // No mem_init: the first allocations race to create the pool
+    for (int i = 0; i < params.num_threads; i++)
+        pthread_create(&threads[i], NULL, thread_lazy_alloc, NULL);
+    for (int i = 0; i < params.num_threads; i++)
+    {
+        pthread_join(threads[i], &blocks[i]);
+        my_assert(blocks[i] != NULL);
+    }
+    for (int i = 0; i < params.num_threads; i++)
+        mem_free(blocks[i]);
+    mem_deinit();
+
+    mem_init(1024);
+    void *block = mem_alloc(1000);
+    my_assert(block != NULL);
+    mem_init(1024); // Already initialized, must not drop the allocation
+    my_assert(mem_alloc(100) == NULL);
+
+    for (int i = 0; i < 1000; i++)
+    {
+        mem_reset();
+        my_assert(mem_alloc(1024) != NULL); // The whole pool is free again
+    }
+    mem_deinit();
+
+    printf_green("[PASS].\n");
+}
+
+/*
+ * This function runs an allocation pattern on a pool initialized without locking and compares
+ * its time with the same pattern on a normal pool.
+ */
+long time_single_thread_pattern(int flags, int rounds)
+{
+    struct timeval start_time, end_time;
+    void *blocks[64];
+
+    mem_init_flags(64 * 128, flags);
+    gettimeofday(&start_time, NULL);
+    for (int r = 0; r < rounds; r++)
+    {
+        for (int i = 0; i < 64; i++)
+        {
+            blocks[i] = mem_alloc(128);
+            my_assert(blocks[i] != NULL);
+        }
+        for (int i = 63; i >= 0; i--)
+            mem_free(blocks[i]);
+    }
+    gettimeofday(&end_time, NULL);
+    mem_deinit();
+
+    return (end_time.tv_sec - start_time.tv_sec) * 1000000 + (end_time.tv_usec - start_time.tv_usec);
+}
+
+// Allocates, fills and frees blocks, checking that no other thread wrote to them meanwhile
+void *fill_and_free_worker(void *arg)
+{
+    char tag = (char)(size_t)arg;
+    for (int i = 0; i < 1000; i++)
+    {
+        char *block = mem_alloc(64);
+        my_assert(block != NULL);
+        memset(block, tag, 64);
+        my_assert(block[0] == tag && block[63] == tag);
+        mem_free(block);
+    }
+    return NULL;
+}
+
+void test_single_thread_mode()
+{
+    printf_yellow("  Testing \"MEM_INIT_SINGLE_THREAD\" ---> ");
+
+    long locked = time_single_thread_pattern(0, 1000);
+    long unlocked = time_single_thread_pattern(MEM_INIT_SINGLE_THREAD, 1000);
+
+    // The single-thread pool takes no lock, so there is nothing to count
+    struct mem_lock_stats lock_stats;
+    mem_init_flags(64 * 1024, MEM_INIT_SINGLE_THREAD);
+    mem_free(mem_alloc(16));
+    mem_lock_stats(&lock_stats);
+    my_assert(lock_stats.acquisitions == 0);
+    mem_deinit();
+
+#ifndef MEM_SINGLE_THREADED // Builds without locks have no default lock to put back
+    // mem_deinit puts the default lock back, which the next pool counts and threads can rely on
+    mem_init(64 * 1024);
+    pthread_t threads[4];
+    for (size_t i = 0; i < 4; i++)
+        pthread_create(&threads[i], NULL, fill_and_free_worker, (void *)(i + 1));
+    for (int i = 0; i < 4; i++)
+        pthread_join(threads[i], NULL);
+    mem_lock_stats(&lock_stats);
+    my_assert(lock_stats.acquisitions >= 8000);
+    struct mem_stats stats;
+    mem_stats(&stats);
+    my_assert(stats.live_blocks == 0);
+    mem_deinit();
+#endif
+
+    printf_yellow("Locked: %ld microseconds, single-thread: %ld microseconds.\t", locked, unlocked);
+    printf_green("[PASS].\n");
+}
+
+void test_striped_spanning()
+{
+    printf_yellow("  Testing allocations across regions with \"MEM_INIT_STRIPED\" ---> ");
+    size_t pool = 1024 * 1024;
+    mem_init_flags(pool, MEM_INIT_STRIPED);
+
+    // Larger than any single region, so it has to borrow from the following ones
+    char *whole = mem_alloc(pool);
+    my_assert(whole != NULL);
+    memset(whole, 0xAB, pool);
+    my_assert(mem_alloc(1) == NULL);
+    mem_free(whole);
+
+    // The borrowed space went back, so every region serves its own share again
+    char *quarters[4];
+    for (int i = 0; i < 4; i++)
+    {
+        quarters[i] = mem_alloc(pool / 4);
+        my_assert(quarters[i] != NULL);
+    }
+    my_assert(mem_alloc(1) == NULL);
+    mem_free(quarters[1]);
+    mem_free(quarters[2]);
+
+    // Two freed neighbours make room for one block spanning both
+    char *half = mem_alloc(pool / 2);
+    my_assert(half == quarters[1]);
+    mem_free(half);
+    mem_free(quarters[0]);
+    mem_free(quarters[3]);
+
+    my_assert(mem_alloc(pool) == whole);
+    mem_deinit();
+    printf_green("[PASS].\n");
+}
+
+void *thread_size_classes(void *arg)
+{
+    size_t sizes[] = {56, 64, 128, 40, 100};
+    unsigned char *blocks[500];
+    unsigned char tag = (unsigned char)(size_t)arg;
+
+    for (int round = 0; round < 20; round++)
+    {
+        for (int i = 0; i < 500; i++)
+        {
+            blocks[i] = mem_alloc(sizes[i % 5]);
+            my_assert(blocks[i] != NULL);
+            memset(blocks[i], tag, sizes[i % 5]);
+        }
+        for (int i = 0; i < 500; i++)
+        {
+            for (size_t j = 0; j < sizes[i % 5]; j++)
+                if (blocks[i][j] != tag)
+                {
+                    my_assert(blocks[i][j] == tag);
+                    break;
+                }
+            mem_free(blocks[i]);
+        }
+    }
+    return NULL;
+}
+
+void test_size_classes(TestParams params)
+{
+    printf_yellow("  Testing \"MEM_INIT_SIZE_CLASSES\" (threads: %d) ---> ", params.num_threads);
+    mem_init_flags(1024 * 1024, MEM_INIT_SIZE_CLASSES);
+
+    void *small = mem_alloc(40);
+    my_assert(mem_usable_size(small) == 56);
+    void *grown = mem_resize(small, 64);
+    my_assert(grown != NULL && mem_usable_size(grown) == 64);
+    mem_free(grown);
+
+    pthread_t threads[params.num_threads];
+    for (int i = 0; i < params.num_threads; i++)
+        pthread_create(&threads[i], NULL, thread_size_classes, (void *)(size_t)(i + 1));
+    for (int i = 0; i < params.num_threads; i++)
+        pthread_join(threads[i], NULL);
+
+    // More 128 byte blocks than the class arena holds, the rest come from the pool
+    int count = 4096;
+    void **blocks = malloc(count * sizeof(void *));
+    for (int i = 0; i < count; i++)
+    {
+        blocks[i] = mem_alloc(128);
+        my_assert(blocks[i] != NULL);
+    }
+    for (int i = 0; i < count; i++)
+        mem_free(blocks[i]);
+    free(blocks);
+
+    mem_deinit();
+    printf_green("[PASS].\n");
+}
+
+void test_magazines(TestParams params)
+{
+    printf_yellow("  Testing \"MEM_INIT_MAGAZINES\" (threads: %d) ---> ", params.num_threads);
+    struct mem_stats stats;
+    mem_init_flags(1024 * 1024, MEM_INIT_MAGAZINES);
+
+    // A freed block is cached and handed straight back on the same CPU
+    void *block = mem_alloc(64);
+    mem_free(block);
+    mem_stats(&stats);
+    my_assert(stats.cached_blocks == 1);
+    my_assert(mem_alloc(60) == block);
+    mem_free(block);
+
+    // The depot keeps a bounded number of magazines, the rest go back to the class stacks
+    int count = 2000;
+    void **blocks = malloc(count * sizeof(void *));
+    for (int i = 0; i < count; i++)
+        blocks[i] = mem_alloc(128);
+    for (int i = 0; i < count; i++)
+        mem_free(blocks[i]);
+    free(blocks);
+    mem_stats(&stats);
+    my_assert(stats.cached_blocks > 0 && stats.cached_blocks < count / 2);
+
+    pthread_t threads[params.num_threads];
+    for (int i = 0; i < params.num_threads; i++)
+        pthread_create(&threads[i], NULL, thread_size_classes, (void *)(size_t)(i + 1));
+    for (int i = 0; i < params.num_threads; i++)
+        pthread_join(threads[i], NULL);
+
+    mem_reset();
+    mem_stats(&stats);
+    my_assert(stats.cached_blocks == 0);
+    mem_deinit();
+    printf_green("[PASS].\n");
+}
+
+void *thread_bitmap(void *arg)
+{
+    unsigned int seed = (unsigned int)(size_t)arg;
+    unsigned char tag = (unsigned char)seed;
+    unsigned char *blocks[200];
+    size_t sizes[200];
+
+    for (int round = 0; round < 20; round++)
+    {
+        for (int i = 0; i < 200; i++)
+        {
+            sizes[i] = rand_r(&seed) % 1024;
+            blocks[i] = mem_alloc(sizes[i]);
+            my_assert(blocks[i] != NULL);
+            memset(blocks[i], tag, sizes[i]);
+        }
+        for (int i = 0; i < 200; i++)
+        {
+            for (size_t j = 0; j < sizes[i]; j++)
+                if (blocks[i][j] != tag)
+                {
+                    my_assert(blocks[i][j] == tag);
+                    break;
+                }
+            mem_free(blocks[i]);
+        }
+    }
+    return NULL;
+}
+
+void test_bitmap_allocator(TestParams params)
+{
+    printf_yellow("  Testing \"MEM_INIT_BITMAP\" (threads: %d) ---> ", params.num_threads);
+    mem_init_flags(1024 * 1024, MEM_INIT_BITMAP);
+
+    // Blocks are whole 16 byte granules, packed back to back
+    char *a = mem_alloc(1);
+    char *b = mem_alloc(17);
+    my_assert(mem_usable_size(a) == 16);
+    my_assert(mem_usable_size(b) == 32);
+    my_assert(b == a + 16);
+
+    // A run that does not fit in what is left of the first bitmap word continues into the next
+    char *c = mem_alloc(58 * 16);
+    char *d = mem_alloc(100);
+    my_assert(c == b + 32 && d == c + 58 * 16);
+    my_assert(mem_usable_size(d) == 112);
+
+    mem_free(a);
+    my_assert(mem_alloc(16) == a);
+    mem_free(a);
+    mem_free(b);
+    mem_free(c);
+    mem_free(d);
+    my_assert(mem_usable_size(d) == 0);
+
+    pthread_t threads[params.num_threads];
+    for (int i = 0; i < params.num_threads; i++)
+        pthread_create(&threads[i], NULL, thread_bitmap, (void *)(size_t)(i + 1));
+    for (int i = 0; i < params.num_threads; i++)
+        pthread_join(threads[i], NULL);
+
+    // More 1000 byte blocks than the bitmap arena holds, the rest come from the pool
+    void *blocks[400];
+    for (int i = 0; i < 400; i++)
+    {
+        blocks[i] = mem_alloc(1000);
+        my_assert(blocks[i] != NULL);
+    }
+    for (int i = 0; i < 400; i++)
+        mem_free(blocks[i]);
+
+    mem_deinit();
+    printf_green("[PASS].\n");
+}
+
+// Block list laid out like the linked headers the pool used before its block tables
+struct linked_block
+{
+    void *ptr;
+    size_t size;
+    int free;
+    struct linked_block *next;
+};
+
+struct linked_block *linked_first_fit(struct linked_block *current, size_t size)
+{
+    while (current != NULL && !(current->free && current->size >= size))
+        current = current->next;
+    return current;
+}
+
+void test_scan_benchmark(int num_blocks, int rounds)
+{
+    printf_yellow("  Benchmarking the first-fit scan over %d blocks ---> ", num_blocks);
+    size_t block_size = 32;
+    size_t tail_size = 4096;
+    mem_init(num_blocks * block_size + tail_size);
+
+    // Every other block freed: the free blocks are all too small, only the tail fits
+    void **blocks = malloc(num_blocks * sizeof(void *));
+    for (int i = 0; i < num_blocks; i++)
+        blocks[i] = mem_alloc(block_size);
+    for (int i = 0; i < num_blocks; i += 2)
+        mem_free(blocks[i]);
+
+    struct timeval start_time, end_time;
+    gettimeofday(&start_time, NULL);
+    for (int i = 0; i < rounds; i++)
+    {
+        void *block = mem_alloc(2 * block_size);
+        my_assert(block == (char *)blocks[num_blocks - 1] + block_size);
+        mem_free(block);
+    }
+    gettimeofday(&end_time, NULL);
+    long table_time = (end_time.tv_sec - start_time.tv_sec) * 1000000 + (end_time.tv_usec - start_time.tv_usec);
+
+    // The same layout as a linked list, one malloc per node
+    struct linked_block *first = NULL;
+    struct linked_block **link = &first;
+    for (int i = 0; i <= num_blocks; i++)
+    {
+        *link = malloc(sizeof(struct linked_block));
+        **link = (struct linked_block){(char *)blocks[0] + i * block_size, i < num_blocks ? block_size : tail_size, i < num_blocks ? i % 2 == 0 : 1, NULL};
+        link = &(*link)->next;
+    }
+
+    gettimeofday(&start_time, NULL);
+    for (int i = 0; i < rounds; i++)
+    {
+        struct linked_block *found = linked_first_fit(first, 2 * block_size);
+        my_assert(found != NULL && found->size == tail_size);
+    }
+    gettimeofday(&end_time, NULL);
+    long linked_time = (end_time.tv_sec - start_time.tv_sec) * 1000000 + (end_time.tv_usec - start_time.tv_usec);
+
+    while (first != NULL)
+    {
+        struct linked_block *next = first->next;
+        free(first);
+        first = next;
+    }
+    free(blocks);
+    mem_deinit();
+
+    printf_yellow("Table: %ld microseconds, linked list: %ld microseconds.\t", table_time, linked_time);
+    printf_green("[PASS].\n");
+}
+
+void test_block_stats()
+{
+    printf_yellow("  Testing \"mem_stats\" ---> ");
+    mem_init_flags(4096, MEM_INIT_NO_FAST_BINS); // Every free merges, so the counts are exact
+
+    void *blocks[100];
+    for (int i = 0; i < 100; i++)
+        blocks[i] = mem_alloc(16);
+
+    // 4 bytes of entry per block and 8 bytes of anchor per 16 entries
+    struct mem_stats stats;
+    mem_stats(&stats);
+    my_assert(stats.live_blocks == 100 && stats.free_blocks == 1);
+    my_assert(stats.metadata_bytes == 4 * 101 + 8 * (101 / 16 + 1));
+    my_assert(stats.overhead_per_block < 8);
+    printf_yellow("Overhead: %zu bytes per live block.\t", stats.overhead_per_block);
+
+    for (int i = 0; i < 100; i += 2)
+        mem_free(blocks[i]);
+    mem_stats(&stats);
+    my_assert(stats.pool_size == 4096);
+    my_assert(stats.live_blocks == 50);
+    my_assert(stats.free_blocks == 51); // The freed blocks and the rest of the pool
+    my_assert(stats.free_bytes == 4096 - 50 * 16);
+    my_assert(stats.metadata_bytes == 4 * 101 + 8 * (101 / 16 + 1));
+    my_assert(stats.reserved_metadata_bytes >= stats.metadata_bytes);
+
+    for (int i = 1; i < 100; i += 2)
+        mem_free(blocks[i]);
+    mem_stats(&stats);
+    my_assert(stats.live_blocks == 0 && stats.free_blocks == 1 && stats.overhead_per_block == 0);
+    mem_deinit();
+
+    // Pools past 2 GiB hold their free space in several entries, so all of it can be allocated
+    mem_init((size_t)3 * 1024 * 1024 * 1024);
+    mem_stats(&stats);
+    my_assert(stats.pool_size == (size_t)3 * 1024 * 1024 * 1024 && stats.free_blocks == 2);
+    my_assert(mem_alloc((size_t)2 * 1024 * 1024 * 1024) == NULL); // Larger than one entry can describe
+    void *big = mem_alloc((size_t)2 * 1024 * 1024 * 1024 - 1);
+    void *rest = mem_alloc((size_t)1024 * 1024 * 1024 + 1);
+    my_assert(big != NULL && rest != NULL && mem_alloc(1) == NULL);
+    mem_free(big);
+    mem_free(rest);
+    mem_stats(&stats);
+    my_assert(stats.free_bytes == (size_t)3 * 1024 * 1024 * 1024 && stats.largest_free_block == (size_t)2 * 1024 * 1024 * 1024 - 1);
+    mem_deinit();
+
+    // Larger than the packed block entries can describe
+    mem_init((size_t)33 * 1024 * 1024 * 1024);
+    mem_stats(&stats);
+    my_assert(stats.pool_size == 0);
+    mem_deinit();
+    printf_green("[PASS].\n");
+}
+
+void test_fast_bins()
+{
+    printf_yellow("  Testing fast bins ---> ");
+    struct mem_stats stats;
+    mem_init(1024);
+
+    // A small free is parked unmerged and handed straight back
+    char *a = mem_alloc(100);
+    char *b = mem_alloc(100);
+    mem_free(a);
+    mem_stats(&stats);
+    my_assert(stats.parked_blocks == 1 && stats.live_blocks == 1);
+    my_assert(mem_alloc(97) == a);
+
+    // Parked blocks are merged once a request misses
+    mem_free(a);
+    mem_free(b);
+    char *whole = mem_alloc(1024);
+    my_assert(whole == a);
+    mem_stats(&stats);
+    my_assert(stats.parked_blocks == 0 && stats.live_blocks == 1 && stats.free_blocks == 0);
+    mem_free(whole);
+    mem_deinit();
+
+    // Without fast bins the freed block merges with the free rest of the pool right away
+    mem_init_flags(1024, MEM_INIT_NO_FAST_BINS);
+    a = mem_alloc(100);
+    mem_free(a);
+    mem_stats(&stats);
+    my_assert(stats.parked_blocks == 0 && stats.free_blocks == 1);
+    mem_deinit();
+    printf_green("[PASS].\n");
+}
+
+void test_address_tree()
+{
+    printf_yellow("  Testing the address ordered tree ---> ");
+    struct mem_stats stats;
+    mem_init_flags(4096, MEM_INIT_ADDRESS_TREE | MEM_INIT_NO_FAST_BINS);
+
+    char *blocks[8];
+    for (int i = 0; i < 8; i++)
+        blocks[i] = mem_alloc(64);
+    mem_free(blocks[1]);
+    mem_free(blocks[3]);
+    mem_free(blocks[4]); // Merges with block 3
+    mem_free(blocks[6]);
+
+    // The lowest addressed block that fits, like the scan
+    my_assert(mem_alloc(100) == blocks[3]);
+    my_assert(mem_alloc(64) == blocks[1]);
+    my_assert(mem_alloc(64) == blocks[6]);
+    my_assert(mem_alloc(64) == blocks[7] + 64);
+    my_assert(mem_alloc(0) != NULL);
+    my_assert(mem_alloc(4096) == NULL);
+
+    mem_reset();
+    mem_stats(&stats);
+    my_assert(stats.free_blocks == 1 && stats.largest_free_block == 4096);
+    my_assert(mem_alloc(4096) == blocks[0]);
+    mem_deinit();
+    printf_green("[PASS].\n");
+}
+
+// Polls the pool statistics until `done` holds for them, for up to a second
+int wait_for_stats(int (*done)(struct mem_stats *))
+{
+    struct mem_stats stats;
+    for (int i = 0; i < 1000; i++)
+    {
+        mem_stats(&stats);
+        if (done(&stats))
+            return 1;
+        usleep(1000);
+    }
+    return 0;
+}
+
+int nothing_parked(struct mem_stats *stats) { return stats->parked_blocks == 0; }
+size_t purged_before = 0;
+int pool_purged(struct mem_stats *stats) { return stats->purged_bytes >= purged_before + stats->pool_size - 4096; }
+
+void test_maintenance()
+{
+    printf_yellow("  Testing the maintenance thread ---> ");
+    mem_init_flags(1024 * 1024, MEM_INIT_MAINTENANCE);
+    mem_tune_maintenance(1, 50);
+
+    // Parked blocks get merged without another allocation coming along
+    void *blocks[8];
+    for (int i = 0; i < 8; i++)
+        blocks[i] = mem_alloc(64);
+    for (int i = 0; i < 8; i++)
+        mem_free(blocks[i]);
+    my_assert(wait_for_stats(nothing_parked));
+
+    // The pages of a large free block go back to the system and come back zeroed
+    char *large = mem_alloc(512 * 1024);
+    memset(large, 0x5A, 512 * 1024);
+    struct mem_stats stats;
+    mem_stats(&stats);
+    purged_before = stats.purged_bytes;
+    mem_free(large);
+    my_assert(wait_for_stats(pool_purged)); // Only the large block merged with the rest of the pool is that large
+    large = mem_alloc(512 * 1024);
+    my_assert(large != NULL && large[256 * 1024] == 0);
+    mem_free(large);
+
+    mem_tune_maintenance(10, 5);
+    mem_deinit(); // Stops the thread
+
+    // A pass right after the depots filled up trims nothing, the magazines only became idle since
+    mem_tune_maintenance(1, 50);
+    mem_init_flags(1024 * 1024, MEM_INIT_MAGAZINES | MEM_INIT_MAINTENANCE);
+    usleep(20000);
+    mem_tune_maintenance(60000, 5); // No pass on the timer once the one after this is done
+    usleep(20000);
+    int count = 2000;
+    void **cached = malloc(count * sizeof(void *));
+    for (int i = 0; i < count; i++)
+        cached[i] = mem_alloc(128);
+    for (int i = 0; i < count; i++)
+        mem_free(cached[i]);
+    free(cached);
+    mem_stats(&stats);
+    size_t cached_before = stats.cached_blocks;
+    void *parked[129];
+    for (int i = 0; i < 129; i++)
+        parked[i] = mem_alloc(136 + 8 * (i % 16)); // Eight per fast bin, which fills the bins exactly
+    for (int i = 0; i < 129; i++)
+        mem_free(parked[i]); // The last one finds the bins full and asks for a pass
+    my_assert(wait_for_stats(nothing_parked));
+    mem_stats(&stats);
+    my_assert(cached_before > 0 && stats.cached_blocks == cached_before);
+    mem_deinit();
+
+    // Resetting stops the thread while the magazines and arenas are set up again
+    mem_tune_maintenance(1, 100);
+    mem_init_flags(1024 * 1024, MEM_INIT_MAGAZINES | MEM_INIT_MAINTENANCE | MEM_INIT_HANDLES);
+    for (int round = 0; round < 200; round++)
+    {
+        void *small[32];
+        for (int i = 0; i < 32; i++)
+            small[i] = mem_alloc(64);
+        for (int i = 0; i < 32; i++)
+            mem_free(small[i]);
+        my_assert(mem_halloc(256) != 0);
+        mem_reset();
+    }
+    mem_stats(&stats);
+    my_assert(stats.cached_blocks == 0);
+    mem_tune_maintenance(10, 5);
+    mem_deinit();
+    printf_green("[PASS].\n");
+}
+
+// Runs random allocations and frees for a long time and reports how fragmented the free space gets
+void test_fragmentation_benchmark(int init_flags, int rounds, int ops_per_round)
+{
+    printf_yellow("  Benchmarking long-run fragmentation (%s):\n", mode_name(init_flags));
+    size_t pool = 4 * 1024 * 1024;
+    int num_slots = 4096;
+    mem_init_flags(pool, init_flags);
+
+    void **slots = calloc(num_slots, sizeof(void *));
+    unsigned int seed = 12345; // Same sequence in every mode
+    struct timeval start_time, now;
+    gettimeofday(&start_time, NULL);
+
+    for (int round = 1; round <= rounds; round++)
+    {
+        for (int op = 0; op < ops_per_round; op++)
+        {
+            int slot = rand_r(&seed) % num_slots;
+            if (slots[slot] != NULL)
+            {
+                mem_free(slots[slot]);
+                slots[slot] = NULL;
+            }
+            else
+            {
+                // Mostly small blocks with an occasional large one, which is what splinters a pool
+                size_t size = rand_r(&seed) % 8 == 0 ? 1024 + rand_r(&seed) % 8192 : 16 + rand_r(&seed) % 512;
+                slots[slot] = mem_alloc(size);
+            }
+        }
+
+        struct mem_stats stats;
+        mem_stats(&stats);
+        gettimeofday(&now, NULL);
+        long elapsed = (now.tv_sec - start_time.tv_sec) * 1000 + (now.tv_usec - start_time.tv_usec) / 1000;
+        double ratio = stats.free_bytes > 0 ? (double)stats.largest_free_block / stats.free_bytes : 1.0;
+        printf("    %8d ops, %6ld ms: %6zu free blocks, largest/total free %.3f\n", round * ops_per_round, elapsed, stats.free_blocks, ratio);
+    }
+
+    free(slots);
+    mem_deinit();
+}
+
+void *greedy_alloc(void *arg)
+{
+    size_t quota = (size_t)arg;
+    mem_set_thread_quota(quota);
+    size_t total = 0;
+    while (mem_alloc(16) != NULL) // Leaked on purpose, mem_deinit takes it back
+        total += 16;
+    my_assert(quota == 0 || (total <= quota && mem_thread_usage() == total));
+    return NULL;
+}
+
+void test_reservations()
+{
+    printf_yellow("  Testing \"mem_reserve\" and thread quotas ---> ");
+    mem_init_flags(4096, MEM_INIT_NO_FAST_BINS);
+
+    // A greedy thread takes everything but the reservation
+    struct mem_reservation *token = mem_reserve(1024);
+    my_assert(token != NULL);
+    pthread_t greedy;
+    pthread_create(&greedy, NULL, greedy_alloc, (void *)0);
+    pthread_join(greedy, NULL);
+    my_assert(mem_alloc(16) == NULL);
+
+    char *blocks[8];
+    for (int i = 0; i < 8; i++)
+    {
+        blocks[i] = mem_alloc_reserved(token, 128);
+        my_assert(blocks[i] != NULL);
+        memset(blocks[i], i, 128);
+    }
+    my_assert(mem_alloc_reserved(token, 128) == NULL); // Used up, and the pool is full
+    my_assert(mem_usable_size(blocks[3]) == 128);
+    mem_free(blocks[3]);
+    my_assert(mem_alloc_reserved(token, 100) == blocks[3]);
+    my_assert(blocks[7][127] == 7);
+    mem_unreserve(token);
+    my_assert(mem_alloc(1000) != NULL); // The reservation went back to the pool
+    mem_deinit();
+
+    // With a quota the greedy thread leaves room for everybody else
+    mem_init(4096);
+    pthread_create(&greedy, NULL, greedy_alloc, (void *)1024);
+    pthread_join(greedy, NULL);
+    my_assert(mem_alloc(2500) != NULL);
+
+    mem_set_thread_quota(256);
+    void *block = mem_alloc(200);
+    my_assert(block != NULL && mem_thread_usage() == 200);
+    my_assert(mem_alloc(100) == NULL);
+    mem_free(block);
+    my_assert(mem_thread_usage() == 0);
+    my_assert(mem_reserve(512) == NULL); // Reservations count against the quota as well
+    mem_set_thread_quota(0);
+    mem_deinit();
+    printf_green("[PASS].\n");
+}
+
+void test_spill()
+{
+    printf_yellow("  Testing \"MEM_INIT_SPILL\" ---> ");
+    struct mem_stats stats;
+    mem_init_flags(4096, MEM_INIT_SPILL);
+
+    char *pooled = mem_alloc(4000);
+    char *spilled = mem_alloc(1000); // The pool is out of room
+    my_assert(pooled != NULL && spilled != NULL);
+    memset(spilled, 0x7E, 1000);
+    my_assert(mem_usable_size(spilled) == 1000);
+    mem_stats(&stats);
+    my_assert(stats.spilled_blocks == 1 && stats.spilled_bytes == 1000);
+
+    char *grown = mem_resize(spilled, 3000);
+    my_assert(grown != NULL && grown[999] == 0x7E);
+    mem_stats(&stats);
+    my_assert(stats.spilled_blocks == 2 && stats.spilled_bytes == 3000);
+    mem_free(grown);
+    mem_stats(&stats);
+    my_assert(stats.spilled_bytes == 0);
+
+    // Freed pool memory is used again before spilling
+    mem_free(pooled);
+    my_assert(mem_alloc(4096) == pooled);
+    my_assert(mem_alloc(1) != NULL);
+    mem_deinit(); // Unmaps the spilled block too
+
+    mem_init(4096);
+    my_assert(mem_alloc(4096) != NULL && mem_alloc(1) == NULL);
+    mem_deinit();
+    printf_green("[PASS].\n");
+}
+
+void test_alloc_near()
+{
+    printf_yellow("  Testing \"mem_alloc_near\" ---> ");
+    mem_init_flags(4096, MEM_INIT_NO_FAST_BINS);
+
+    char *a = mem_alloc(100);
+    char *b = mem_alloc(100);
+    char *c = mem_alloc(100);
+    char *d = mem_alloc(100);
+    mem_free(b);
+
+    // The hole before the hint is skipped for the space right after it
+    char *near = mem_alloc_near(c, 50);
+    my_assert(near == d + 100);
+    my_assert(mem_alloc(50) == b);
+    my_assert(mem_alloc_near(NULL, 50) == b + 50);
+
+    // Without room after the hint it allocates as usual
+    my_assert(mem_alloc(4096 - 450) != NULL);
+    mem_free(a);
+    my_assert(mem_alloc_near(d, 100) == a);
+    my_assert(mem_alloc_near(d, 1) == NULL);
+    mem_deinit();
+    printf_green("[PASS].\n");
+}
+
+void test_hot_cold()
+{
+    printf_yellow("  Testing \"mem_alloc_flags\" ---> ");
+    size_t pool = 1024 * 1024;
+    mem_init_flags(pool, MEM_INIT_HOT_ARENA | MEM_INIT_NO_FAST_BINS);
+
+    // The arena is the first sixteenth of a huge page aligned pool, past the reservation header
+    char *hot = mem_alloc_flags(64, MEM_HOT);
+    char *base = hot - 16;
+    my_assert(hot != NULL && (uintptr_t)base % (2 * 1024 * 1024) == 0);
+    my_assert(mem_alloc_flags(64, MEM_HOT) == hot + 64);
+    char *plain = mem_alloc(64);
+    my_assert(plain >= base + pool / 16);
+    char *cold = mem_alloc_flags(1000, MEM_COLD);
+    my_assert(cold == base + pool - 1000);
+    my_assert(mem_usable_size(hot) == 64 && mem_usable_size(cold) == 1000);
+
+    // Freed blocks go back where they came from
+    mem_free(cold);
+    my_assert(mem_alloc_flags(1000, MEM_COLD) == cold);
+    mem_free(hot);
+    my_assert(mem_alloc_flags(64, MEM_HOT) == hot);
+
+    // A full arena falls back to the pool, and mem_reset sets up a new one
+    char *big = mem_alloc_flags(pool / 16, MEM_HOT);
+    my_assert(big != NULL && big >= base + pool / 16);
+    mem_reset();
+    my_assert(mem_alloc_flags(64, MEM_HOT) == hot);
+    mem_deinit();
+
+    // Without an arena hot blocks are placed like any other, and cold ones still come from the top
+    mem_init(4096);
+    char *first = mem_alloc_flags(100, MEM_HOT);
+    my_assert(first != NULL && mem_alloc_flags(100, MEM_COLD) == first + 4096 - 100);
+    mem_deinit();
+    printf_green("[PASS].\n");
+}
+
+void test_handles()
+{
+    printf_yellow("  Testing \"mem_halloc\" and compaction ---> ");
+    size_t pool = 64 * 1024;
+    size_t arena = pool / 4;
+    mem_init_flags(pool, MEM_INIT_HANDLES);
+
+    // Fill the arena with 1 KiB blocks and free every other one: half is free, in 1 KiB holes
+    mem_handle blocks[16];
+    for (int i = 0; i < 16; i++)
+    {
+        blocks[i] = mem_halloc(1024);
+        my_assert(blocks[i] != 0);
+        memset(mem_hlock(blocks[i]), i, 1024);
+        mem_hunlock(blocks[i]);
+    }
+    my_assert(mem_halloc(1) == 0);
+    for (int i = 0; i < 16; i += 2)
+        mem_hfree(blocks[i]);
+    my_assert(mem_halloc(arena / 2) == 0);
+
+    // A locked block stays put while the others slide around it
+    char *pinned = mem_hlock(blocks[9]);
+    int steps = 0;
+    while (mem_hcompact(2048))
+        steps++;
+    my_assert(steps > 1); // Bounded steps, not one long pause
+    my_assert(mem_hlock(blocks[9]) == pinned);
+    mem_hunlock(blocks[9]);
+    mem_hunlock(blocks[9]);
+    for (int i = 1; i < 16; i += 2)
+    {
+        char *block = mem_hlock(blocks[i]);
+        my_assert(block[0] == i && block[1023] == i);
+        mem_hunlock(blocks[i]);
+    }
+    while (mem_hcompact(2048))
+        ;
+    mem_handle big = mem_halloc(arena / 2);
+    my_assert(big != 0);
+    my_assert((char *)mem_hlock(big) == (char *)mem_hlock(blocks[1]) + arena / 2);
+
+    mem_reset(); // Drops every handle
+    my_assert(mem_halloc(arena) != 0);
+    mem_deinit();
+
+    mem_handle stale = mem_halloc(16);
+    mem_hfree(stale);
+    mem_hfree(stale); // Freed twice, or never handed out, a handle is ignored
+    my_assert(mem_hlock(stale) == NULL && mem_hlock(stale + 1000) == NULL);
+    mem_deinit();
+
+    // Handles kept past mem_deinit into a pool without handles do nothing
+    mem_init(4096);
+    my_assert(mem_halloc(16) == 0 && mem_hlock(0) == NULL);
+    my_assert(mem_hlock(big) == NULL);
+    mem_hunlock(big);
+    mem_hfree(big);
+    mem_deinit();
+    printf_green("[PASS].\n");
+}
+
+void test_shared_pool()
+{
+    printf_yellow("  Testing \"mem_init_shared\" across processes ---> ");
+    char name[64];
+    snprintf(name, sizeof(name), "/mm_test_%d", (int)getpid());
+    shm_unlink(name);
+    my_assert(mem_init_shared(name, 64 * 1024) == 1);
+    my_assert(mem_init_shared(name, 64 * 1024) == 0); // A pool already exists
+
+    size_t *mailbox = mem_alloc(sizeof(size_t)); // First, so it is aligned
+    char *greeting = mem_alloc(100);
+    strcpy(greeting, "from parent");
+    *mailbox = 0;
+    size_t greeting_offset = mem_to_offset(greeting);
+    size_t mailbox_offset = mem_to_offset(mailbox);
+
+    fflush(stdout);
+    pid_t child = fork();
+    if (child == 0)
+    {
+        // Attach afresh, as an unrelated process would
+        mem_deinit();
+        int ok = mem_init_shared(name, 0) == 1;
+        char *seen = mem_from_offset(greeting_offset);
+        ok = ok && strcmp(seen, "from parent") == 0;
+        mem_free(seen);
+        char *reply = mem_alloc(200);
+        ok = ok && reply != NULL;
+        if (ok)
+        {
+            strcpy(reply, "from child");
+            *(size_t *)mem_from_offset(mailbox_offset) = mem_to_offset(reply);
+        }
+        mem_deinit();
+        _exit(ok ? 0 : 1);
+    }
+    int status = 0;
+    waitpid(child, &status, 0);
+    my_assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+    char *reply = mem_from_offset(*mailbox);
+    my_assert(*mailbox != 0 && strcmp(reply, "from child") == 0);
+    my_assert(reply == greeting); // The child freed the greeting and reused its space
+    mem_free(reply);
+    mem_free(mailbox);
+    my_assert(mem_alloc(64 * 1024) != NULL); // Nothing else is left allocated
+    mem_deinit();
+    shm_unlink(name);
+    printf_green("[PASS].\n");
+}
+
+// Forks a process that takes the lock of a shared pool and dies holding it, after moving the
+// first block table entry up by one like an insert cut short, if `corrupt` is set
+void die_holding_pool_lock(const char *name, int corrupt)
+{
+    fflush(stdout);
+    pid_t child = fork();
+    if (child == 0)
+    {
+        int fd = shm_open(name, O_RDWR, 0);
+        struct stat st;
+        fstat(fd, &st);
+        struct mem_segment *segment = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        pthread_mutex_lock(&segment->mutex);
+        if (corrupt)
+            segment->entries[1] = segment->entries[0];
+        _exit(0);
+    }
+    waitpid(child, NULL, 0);
+}
+
+void test_shared_pool_owner_died()
+{
+    printf_yellow("  Testing a process dying inside a shared pool ---> ");
+    char name[64];
+    snprintf(name, sizeof(name), "/mm_test_dead_%d", (int)getpid());
+    shm_unlink(name);
+    my_assert(mem_init_shared(name, 64 * 1024) == 1);
+    char *kept = mem_alloc(100);
+    strcpy(kept, "kept");
+
+    // A process that dies between changes leaves a table that still adds up
+    die_holding_pool_lock(name, 0);
+    char *block = mem_alloc(100);
+    my_assert(block != NULL);
+    mem_free(block);
+
+    // One that dies halfway through a change breaks the pool for everybody
+    die_holding_pool_lock(name, 1);
+    my_assert(mem_alloc(100) == NULL);
+    mem_free(kept);
+    my_assert(strcmp(kept, "kept") == 0);
+    mem_deinit();
+    my_assert(mem_init_shared(name, 0) == 0);
+    shm_unlink(name);
+    printf_green("[PASS].\n");
+}
+
+void test_file_pool()
+{
+    printf_yellow("  Testing \"mem_init_file\" across restarts ---> ");
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/mm_test_%d.pool", (int)getpid());
+    unlink(path);
+
+    my_assert(mem_init_file(path, 64 * 1024) == 1);
+    my_assert(mem_get_root() == NULL);
+    char *list = mem_alloc(2 * sizeof(size_t));
+    char *text = mem_alloc(100);
+    strcpy(text, "kept");
+    ((size_t *)list)[0] = mem_to_offset(text);
+    mem_set_root(list);
+    my_assert(mem_sync() == 1);
+    mem_deinit();
+
+    // A restart finds the root, the data and the block table as they were
+    my_assert(mem_init_file(path, 0) == 1);
+    size_t *root = mem_get_root();
+    my_assert(root != NULL && strcmp(mem_from_offset(root[0]), "kept") == 0);
+    struct mem_stats stats;
+    mem_stats(&stats);
+    my_assert(stats.pool_size == 64 * 1024 && stats.live_blocks == 2 && stats.free_blocks == 1);
+    mem_free(mem_from_offset(root[0]));
+    mem_deinit();
+
+    my_assert(mem_init_file(path, 0) == 1);
+    mem_stats(&stats);
+    my_assert(stats.live_blocks == 1);
+    mem_deinit();
+    unlink(path);
+
+    // A file that holds no pool is refused
+    FILE *junk = fopen(path, "w");
+    for (int i = 0; i < 64; i++)
+        fputs("not a pool ", junk);
+    fclose(junk);
+    my_assert(mem_init_file(path, 0) == 0 && mem_sync() == 0);
+    unlink(path);
+    printf_green("[PASS].\n");
+}
+
+void *stats_worker(void *arg)
+{
+    for (int i = 0; i < 100; i++)
+        mem_free(mem_alloc(32));
+    return NULL;
+}
+
+void *hold_worker(void *arg)
+{
+    return mem_alloc(32);
+}
+
+void test_runtime_stats()
+{
+    printf_yellow("  Testing runtime statistics ---> ");
+    mem_init_flags(64 * 1024, MEM_INIT_NO_FAST_BINS);
+    struct mem_stats stats;
+    mem_stats(&stats);
+    my_assert(stats.alloc_count == 0 && stats.live_bytes == 0 && stats.fragmentation == 0.0);
+
+    char *a = mem_alloc(1000);
+    char *b = mem_alloc(1000);
+    char *c = mem_alloc(1000);
+    mem_stats(&stats); // The peak is the most live bytes a call has seen
+    my_assert(stats.live_bytes == 3000);
+    mem_free(b);
+    my_assert(mem_alloc(1024 * 1024) == NULL);
+    my_assert(mem_resize(a, 500) == a);
+    mem_stats(&stats);
+    my_assert(stats.alloc_count == 3 && stats.free_count == 1 && stats.resize_count == 1 && stats.failed_allocs == 1);
+    my_assert(stats.live_bytes == 2000 && stats.peak_live_bytes == 3000);
+    my_assert(stats.fragmentation > 0.0 && stats.fragmentation < 0.1); // The hole of b next to the rest
+
+    // Every thread counts in its own shard, and all of them show up in the totals
+    pthread_t threads[4];
+    for (int i = 0; i < 4; i++)
+        pthread_create(&threads[i], NULL, stats_worker, NULL);
+    for (int i = 0; i < 4; i++)
+        pthread_join(threads[i], NULL);
+    mem_stats(&stats);
+    my_assert(stats.alloc_count == 403 && stats.free_count == 401 && stats.live_bytes == 2000);
+
+    mem_free(c);
+    mem_reset();
+    mem_stats(&stats);
+    my_assert(stats.alloc_count == 0 && stats.free_count == 0 && stats.peak_live_bytes == 0 && stats.live_bytes == 0);
+    mem_deinit();
+
+    // Arenas and reservations are the allocator's, only the blocks in a reservation are the caller's
+    mem_init_flags(1024 * 1024, MEM_INIT_SIZE_CLASSES | MEM_INIT_NO_FAST_BINS);
+    mem_stats(&stats);
+    my_assert(stats.live_bytes == 0 && stats.peak_live_bytes == 0 && stats.internal_bytes > 0);
+    size_t arenas = stats.internal_bytes;
+    struct mem_reservation *token = mem_reserve(4096);
+    char *reserved = mem_alloc_reserved(token, 1000);
+    mem_stats(&stats);
+    my_assert(stats.live_bytes == 1000 && stats.internal_bytes == arenas + 4096 + 16);
+    mem_unreserve(token);
+    mem_stats(&stats);
+    my_assert(reserved != NULL && stats.live_bytes == 0 && stats.internal_bytes == arenas);
+
+    // Size class blocks are live too, also when another thread frees them than allocated them
+    void *small;
+    pthread_create(&threads[0], NULL, hold_worker, NULL);
+    pthread_join(threads[0], &small);
+    mem_stats(&stats);
+    my_assert(stats.live_bytes == mem_usable_size(small) && stats.live_bytes >= 32);
+    mem_free(small);
+    mem_stats(&stats);
+    my_assert(stats.live_bytes == 0);
+    mem_deinit();
+
+    // Blocks that never lived at once do not add up to the peak even though each thread, one
+    // after the other, allocates from a region of its own
+    mem_init_flags(1024 * 1024, MEM_INIT_STRIPED | MEM_INIT_NO_FAST_BINS);
+    for (int i = 0; i < 4; i++)
+    {
+        void *held;
+        pthread_create(&threads[i], NULL, hold_worker, NULL);
+        pthread_join(threads[i], &held);
+        mem_stats(&stats);
+        my_assert(stats.live_bytes == 32);
+        mem_free(held);
+    }
+    mem_stats(&stats);
+    my_assert(stats.live_bytes == 0 && stats.peak_live_bytes == 32);
+    mem_deinit();
+    printf_green("[PASS].\n");
+}
+
+void test_lock_histogram()
+{
+    printf_yellow("  Testing lock wait and hold histograms ---> ");
+    mem_init(64 * 1024);
+    pthread_t threads[4];
+    for (int i = 0; i < 4; i++)
+        pthread_create(&threads[i], NULL, stats_worker, NULL);
+    for (int i = 0; i < 4; i++)
+        pthread_join(threads[i], NULL);
+
+    // Every acquisition is timed once waiting and once holding; builds without the histograms report nothing
+    struct mem_lock_histogram hist;
+    int built_in = mem_lock_histogram(&hist);
+    unsigned long waits = 0, holds = 0;
+    for (int b = 0; b < MEM_LOCK_HISTOGRAM_BUCKETS; b++)
+    {
+        waits += hist.wait[b];
+        holds += hist.hold[b];
+    }
+    my_assert(waits == holds && (built_in ? waits >= 800 : waits == 0));
+
+    FILE *out = fopen("/dev/null", "w");
+    mem_lock_histogram_dump(out);
+    fclose(out);
+    mem_deinit();
+    my_assert(mem_lock_histogram(&hist) == built_in && hist.wait[0] + hist.hold[0] == 0);
+    printf_green("[PASS].\n");
+}
+
+// Opens a counter of the calling thread for a hardware cache event, or returns -1 where perf is not allowed
+int open_cache_counter(uint64_t config)
+{
+    struct perf_event_attr attr = {0};
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HW_CACHE;
+    attr.config = config;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+long long read_counter(int fd)
+{
+    long long count = -1;
+    if (fd < 0 || read(fd, &count, sizeof(count)) != sizeof(count))
+        return -1;
+    return count;
+}
+
+// Walks small hot headers whose large cold payloads are allocated next to them, then the
+// same with MEM_HOT headers and MEM_COLD payloads, and reports the time and misses per header
+void test_hot_cold_benchmark(int num_objects, int rounds)
+{
+    printf_yellow("  Benchmarking hot/cold placement (%d headers of 32 bytes, payloads of 4000 bytes):\n", num_objects);
+    uint64_t dtlb = PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    uint64_t l1d = PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+
+    for (int segregated = 0; segregated < 2; segregated++)
+    {
+        mem_init_flags((size_t)num_objects * 4096 + 16 * 1024 * 1024, MEM_INIT_HOT_ARENA);
+        long **headers = malloc(num_objects * sizeof(long *));
+        for (int i = 0; i < num_objects; i++)
+        {
+            headers[i] = mem_alloc_flags(32, segregated ? MEM_HOT : 0);
+            char *payload = mem_alloc_flags(4000, segregated ? MEM_COLD : 0);
+            memset(payload, 0, 4000);
+            headers[i][0] = i;
+            headers[i][1] = (long)payload;
+        }
+
+        int tlb_fd = open_cache_counter(dtlb);
+        int l1_fd = open_cache_counter(l1d);
+        long long tlb_before = read_counter(tlb_fd);
+        long long l1_before = read_counter(l1_fd);
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        volatile long sum = 0;
+        for (int r = 0; r < rounds; r++)
+            for (int i = 0; i < num_objects; i++)
+                sum += headers[i][0];
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        long long tlb_misses = read_counter(tlb_fd) - tlb_before;
+        long long l1_misses = read_counter(l1_fd) - l1_before;
+
+        double walks = (double)num_objects * rounds;
+        double ns = ((end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec)) / walks;
+        printf("    %-10s %6.2f ns/header", segregated ? "hot/cold:" : "mixed:", ns);
+        if (tlb_fd >= 0 && l1_fd >= 0)
+            printf(", %.4f dTLB and %.4f L1d misses/header\n", tlb_misses / walks, l1_misses / walks);
+        else
+            printf(" (miss counters not available)\n");
+
+        if (tlb_fd >= 0)
+            close(tlb_fd);
+        if (l1_fd >= 0)
+            close(l1_fd);
+        free(headers);
+        mem_deinit();
+    }
+}
+
 void *alloc_exceeding_memory(void *arg)
 {
     size_t size_to_allocate = (size_t)arg;
@@ -814,14 +2165,14 @@ void *thread_function(void *arg)
 
 void run_concurrency_test(TestParams params)
 {
-    printf_yellow("  Running concurrency test with %d threads, %d allocations per thread, and block size %zu bytes --> ", params.num_threads, params.num_blocks / params.num_threads, params.block_size);
+    printf_yellow("  Running concurrency test with %d threads, %d allocations per thread, and block size %zu bytes (%s) --> ", params.num_threads, params.num_blocks / params.num_threads, params.block_size, mode_name(params.init_flags));
     struct timeval start_time, end_time;
     gettimeofday(&start_time, NULL); // Start timing
     pthread_t threads[params.num_threads];
     thread_data_t params_t[params.num_threads];
     my_barrier_init(&barrier, params.num_threads);
     // Initialize your memory manager here
-    mem_init(params.num_blocks * params.block_size); // Initialize with enough memory for the test
+    mem_init_flags(params.num_blocks * params.block_size, params.init_flags); // Initialize with enough memory for the test
 
     // Create multiple threads to perform memory operations
     for (int i = 0; i < params.num_threads; i++)
@@ -839,6 +2190,9 @@ void run_concurrency_test(TestParams params)
         pthread_join(threads[i], NULL);
     }
 
+    struct mem_lock_stats lock_stats;
+    mem_lock_stats(&lock_stats);
+
     // Clean up the memory manager here if needed
     mem_deinit();
 
@@ -847,7 +2201,7 @@ void run_concurrency_test(TestParams params)
     // Calculate elapsed time
     long seconds = end_time.tv_sec - start_time.tv_sec;
     long micros = ((seconds * 1000000) + end_time.tv_usec) - (start_time.tv_usec);
-    printf_yellow("Time: %ld microseconds.\t", micros);
+    printf_yellow("Time: %ld microseconds, contended: %lu/%lu, sleeps: %lu.\t", micros, lock_stats.contended, lock_stats.acquisitions, lock_stats.sleeps);
 
     printf_green("[PASS].\n");
 }
@@ -908,7 +2262,11 @@ int main(int argc, char *argv[])
     }
 
     // used for case 19
+#ifdef MEM_SINGLE_THREADED
+    int base_num_threads = 1; // Nothing keeps threads of such a build apart
+#else
     int base_num_threads = 4;
+#endif
     int allocs;
     size_t blockSize;
     bool simulate_work = false; // set this to true to see the benefits of multithreading
@@ -925,6 +2283,13 @@ int main(int argc, char *argv[])
         run_concurrent_test(test_zero_alloc_and_free, (TestParams){.num_threads = base_num_threads, .memory_size = 1024}, "zero alloc and free");
         
         test_resize_multithread((TestParams){.num_threads = base_num_threads});
+        test_resize_large_copy();
+        test_usable_size();
+        test_prefault();
+        test_lazy_init_and_reset((TestParams){.num_threads = base_num_threads});
+        test_single_thread_mode();
+        // After mem_deinit the next pool must be locked again
+        run_concurrent_test(test_alloc_and_free, (TestParams){.num_threads = base_num_threads, .memory_size = 1024}, "mem_alloc and mem_free after single-thread mode");
         
         test_exceed_single_allocation_multithread((TestParams){.num_threads = base_num_threads});
         test_exceed_cumulative_allocation_multithread((TestParams){.num_threads = base_num_threads, .memory_size = 1024}); // TODO: Fix this to be able to run with various configurations
@@ -936,6 +2301,33 @@ int main(int argc, char *argv[])
 
         test_memory_fragmentation_multithread((TestParams){.num_threads = base_num_threads, .memory_size = 2048});
         test_random_blocks_multithread((TestParams){.num_threads = base_num_threads, .block_size = 1024});
+        test_random_blocks_multithread((TestParams){.num_threads = base_num_threads, .block_size = 1024, .init_flags = MEM_INIT_FLAT_COMBINING});
+        test_random_blocks_multithread((TestParams){.num_threads = base_num_threads, .block_size = 1024, .init_flags = MEM_INIT_STRIPED});
+        test_striped_spanning();
+        test_size_classes((TestParams){.num_threads = base_num_threads});
+        test_magazines((TestParams){.num_threads = base_num_threads});
+        test_bitmap_allocator((TestParams){.num_threads = base_num_threads});
+        test_scan_benchmark(16384, 1000);
+        test_block_stats();
+        test_fast_bins();
+        test_address_tree();
+#ifndef MEM_SINGLE_THREADED // Such builds never start the maintenance thread
+        test_maintenance();
+#endif
+        test_reservations();
+        test_spill();
+        test_alloc_near();
+        test_hot_cold();
+        test_handles();
+#ifndef MEM_SINGLE_THREADED // Such builds refuse to share a pool between processes
+        test_shared_pool();
+        test_shared_pool_owner_died();
+#endif
+        test_file_pool();
+        test_runtime_stats();
+        test_lock_histogram();
+        test_random_blocks_multithread((TestParams){.num_threads = base_num_threads, .block_size = 1024, .init_flags = MEM_INIT_MAINTENANCE});
+        test_random_blocks_multithread((TestParams){.num_threads = base_num_threads, .block_size = 1024, .init_flags = MEM_INIT_ADDRESS_TREE});
 
         break;
 
@@ -978,7 +2370,22 @@ int main(int argc, char *argv[])
 
         printf("Testing large number of blocks of fixed size\n");
         for (int i = 0; i < 9; i++)
+        {
             run_concurrency_test((TestParams){.num_threads = pow(2, i), .num_blocks = allocs, .block_size = blockSize, .simulate_work = simulate_work});
+            run_concurrency_test((TestParams){.num_threads = pow(2, i), .num_blocks = allocs, .block_size = blockSize, .simulate_work = simulate_work, .init_flags = MEM_INIT_PTHREAD_MUTEX});
+            run_concurrency_test((TestParams){.num_threads = pow(2, i), .num_blocks = allocs, .block_size = blockSize, .simulate_work = simulate_work, .init_flags = MEM_INIT_FLAT_COMBINING});
+            run_concurrency_test((TestParams){.num_threads = pow(2, i), .num_blocks = allocs, .block_size = blockSize, .simulate_work = simulate_work, .init_flags = MEM_INIT_STRIPED});
+            run_concurrency_test((TestParams){.num_threads = pow(2, i), .num_blocks = allocs, .block_size = blockSize, .simulate_work = simulate_work, .init_flags = MEM_INIT_SIZE_CLASSES});
+            run_concurrency_test((TestParams){.num_threads = pow(2, i), .num_blocks = allocs, .block_size = blockSize, .simulate_work = simulate_work, .init_flags = MEM_INIT_MAGAZINES});
+            run_concurrency_test((TestParams){.num_threads = pow(2, i), .num_blocks = allocs, .block_size = blockSize, .simulate_work = simulate_work, .init_flags = MEM_INIT_BITMAP});
+        }
+
+        printf("Testing long-run fragmentation\n");
+        test_fragmentation_benchmark(0, 10, 200000);
+        test_fragmentation_benchmark(MEM_INIT_ADDRESS_TREE, 10, 200000);
+
+        printf("Testing hot/cold placement\n");
+        test_hot_cold_benchmark(16384, 100);
         break;
 
     case 3: